@@ -0,0 +1,645 @@
+#include "Server.h"
+
+#ifndef _WIN32
+
+#include "ThreadPool.h"
+#include "jpeg.h"
+#include "OutputSink.h"
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <cstring>
+#include <cstdint>
+#include <cstdio>
+#include <csignal>
+#include <stdexcept>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+enum Op : uint32_t
+{
+	OpEncode = 1,
+	OpDecode = 2,
+	OpStats = 3,
+};
+
+// messages above are taken for a broken stream, the connection is closed
+static const uint32_t MAX_MESSAGE = 1u << 30;
+// request fields around the inline bytes: op to format, source and sink with the longest names
+static const size_t REQUEST_OVERHEAD = 6 * 4 + (2 + 0xFFFF + 16) + (2 + 0xFFFF);
+
+
+// Shared memory object of a client mapped whole
+class SharedMemory
+{
+public:
+	SharedMemory(const string& name, bool writable) : m_data(nullptr), m_size(0)
+	{
+		const int fd = shm_open(name.c_str(), writable ? O_RDWR : O_RDONLY, 0);
+		if (fd < 0) throw std::runtime_error("Cannot open shared memory");
+
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_size > 0)
+		{
+			void* data = mmap(nullptr, (size_t)st.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+			if (data != MAP_FAILED)
+			{
+				m_data = (unsigned char*)data;
+				m_size = (size_t)st.st_size;
+			}
+		}
+
+		close(fd);
+
+		if (!m_data) throw std::runtime_error("Cannot map shared memory");
+	}
+
+	~SharedMemory()
+	{
+		munmap(m_data, m_size);
+	}
+
+	SharedMemory(const SharedMemory&) = delete;
+	SharedMemory& operator=(const SharedMemory&) = delete;
+
+	unsigned char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	unsigned char* m_data;
+	size_t m_size;
+};
+
+
+// Fields of a message, bounds checked
+class Cursor
+{
+public:
+	Cursor(const char* data, size_t size) : m_pos(data), m_end(data + size)
+	{}
+
+	template <typename T>
+	T get()
+	{
+		T value;
+		memcpy(&value, take(sizeof(T)), sizeof(T));
+		return value;
+	}
+
+	string bytes(size_t n)
+	{
+		const char* p = take(n);
+		return string(p, n);
+	}
+
+private:
+	const char* take(size_t n)
+	{
+		if ((size_t)(m_end - m_pos) < n)
+			throw std::runtime_error("Truncated request");
+
+		const char* p = m_pos;
+		m_pos += n;
+		return p;
+	}
+
+private:
+	const char* m_pos;
+	const char* m_end;
+};
+
+
+struct Server::Connection
+{
+	explicit Connection(int fd) : fd(fd)
+	{}
+
+	~Connection()
+	{
+		close(fd);
+	}
+
+	int fd;
+	mutex write_mutex;  // replies of several workers
+};
+
+struct Server::Request
+{
+	uint32_t op = 0;
+	uint32_t id = 0;
+	string error;  // set if the request could not be parsed
+
+	int width = 0, height = 0;
+	EncodeOptions options;
+	bool jfif = false;
+
+	// source, either inline bytes or a range of a shared memory object
+	string inline_bytes;
+	shared_ptr<SharedMemory> memory;
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+
+	string sink;  // shared memory name, empty for inline
+
+	Clock::time_point received;
+
+	// batching weight: pixels to encode, or bytes to decode
+	size_t cost() const { return op == OpEncode ? (size_t)width * height : size; }
+
+	// errors are kept in error and replied like coding errors
+	void parse(const char* message, size_t length);
+	void parseSource(Cursor& cursor);
+};
+
+struct Server::Reply
+{
+	uint32_t status = 0;
+	uint32_t width = 0, height = 0;
+	uint64_t size = 0;
+	string body;  // inline output or error message
+};
+
+
+Server::Server(const ServerOptions& options) :
+	m_options(options),
+	m_stop(false),
+	m_listen(-1),
+	m_pool(new ThreadPool(options.threads)),
+	m_in_flight(options.max_in_flight),
+	m_requests(0),
+	m_readers(0)
+{
+	for (size_t t = 0; t < m_pool->size(); ++t)
+	{
+		m_canvases.emplace_back(new Canvas);
+		m_canvases.back()->SetMaxPixels(m_options.max_pixels);
+	}
+
+	if (m_options.latency_window == 0)
+		m_options.latency_window = 1;
+}
+
+Server::~Server()
+{
+	m_pool->Wait();
+}
+
+void Server::Stop()
+{
+	m_stop = true;
+}
+
+// Run
+// Accept loop, polled so Stop is seen within a fraction of a second
+void Server::Run()
+{
+	// a client gone before its reply must not kill the server
+	signal(SIGPIPE, SIG_IGN);
+
+	sockaddr_un addr{};
+	addr.sun_family = AF_UNIX;
+	if (m_options.socket_path.empty() || m_options.socket_path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("Invalid socket path");
+	strcpy(addr.sun_path, m_options.socket_path.c_str());
+
+	m_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (m_listen < 0) throw std::runtime_error("Cannot create socket");
+
+	// a socket file left by an earlier run would fail bind
+	unlink(addr.sun_path);
+
+	if (::bind(m_listen, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(m_listen, 64) != 0)
+	{
+		close(m_listen);
+		m_listen = -1;
+		throw std::runtime_error("Cannot bind socket");
+	}
+
+	clog << "Serving on " << m_options.socket_path << " with " << m_pool->size() << " workers" << endl;
+
+	while (!m_stop)
+	{
+		pollfd p{ m_listen, POLLIN, 0 };
+		if (poll(&p, 1, 200) <= 0)
+			continue;
+
+		const int fd = accept(m_listen, nullptr, nullptr);
+		if (fd < 0)
+			continue;
+
+		auto connection = make_shared<Connection>(fd);
+
+		{
+			lock_guard<mutex> lock(m_connections_mutex);
+
+			m_connections.erase(
+				remove_if(m_connections.begin(), m_connections.end(), [](const weak_ptr<Connection>& c) { return c.expired(); }),
+				m_connections.end());
+			m_connections.push_back(connection);
+			++m_readers;
+		}
+
+		thread(&Server::serve, this, connection).detach();
+	}
+
+	// readers return once their connection stops delivering
+	{
+		unique_lock<mutex> lock(m_connections_mutex);
+
+		for (const weak_ptr<Connection>& c : m_connections)
+			if (shared_ptr<Connection> connection = c.lock())
+				shutdown(connection->fd, SHUT_RD);
+
+		m_readers_done.wait(lock, [this]() { return m_readers == 0; });
+	}
+
+	m_pool->Wait();
+
+	close(m_listen);
+	m_listen = -1;
+	unlink(addr.sun_path);
+}
+
+// serve
+// Reader of one connection, every recv is split into messages, small requests of the same recv
+// go to the pool together
+void Server::serve(shared_ptr<Connection> connection)
+{
+	vector<char> buffer;
+	size_t have = 0;
+	bool broken = false;
+
+	// inline sources are at most the pixels of the largest image allowed
+	const size_t max_message = m_options.max_pixels > 0 ?
+		std::min((size_t)MAX_MESSAGE, m_options.max_pixels * 4 + REQUEST_OVERHEAD) : MAX_MESSAGE;
+
+	while (!broken)
+	{
+		// room for the rest of the current message, doubled as its bytes arrive rather than taken
+		// at once for the length claimed
+		size_t want = 1 << 16;
+		if (have >= 4)
+		{
+			uint32_t length;
+			memcpy(&length, buffer.data(), 4);
+			if (4 + (size_t)length > have)
+				want = std::max(want, std::min(have, 4 + (size_t)length - have));
+		}
+
+		if (buffer.size() < have + want)
+			buffer.resize(have + want);
+
+		const ssize_t n = recv(connection->fd, buffer.data() + have, want, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		have += (size_t)n;
+
+		vector<Request> batch;
+		size_t batch_cost = 0;
+		size_t pos = 0;
+
+		while (have - pos >= 4)
+		{
+			uint32_t length;
+			memcpy(&length, buffer.data() + pos, 4);
+
+			if (length > max_message)
+			{
+				broken = true;
+				break;
+			}
+
+			if (have - pos - 4 < length)
+				break;
+
+			Request request;
+			request.parse(buffer.data() + pos + 4, length);
+			pos += 4 + (size_t)length;
+
+			// no coding, answered right away
+			if (request.op == OpStats && request.error.empty())
+			{
+				Reply reply;
+				reply.body = Stats();
+				reply.size = reply.body.size();
+				finish(*connection, request, reply);
+				continue;
+			}
+
+			const size_t cost = request.cost();
+
+			if (cost > m_options.small_pixels)
+			{
+				vector<Request> single(1);
+				single[0] = std::move(request);
+				submit(connection, single);
+				continue;
+			}
+
+			batch_cost += cost;
+			batch.push_back(std::move(request));
+
+			if (batch_cost >= m_options.batch_pixels)
+			{
+				submit(connection, batch);
+				batch_cost = 0;
+			}
+		}
+
+		// small requests do not wait for more data
+		if (!batch.empty())
+			submit(connection, batch);
+
+		memmove(buffer.data(), buffer.data() + pos, have - pos);
+		have -= pos;
+	}
+
+	lock_guard<mutex> lock(m_connections_mutex);
+	if (--m_readers == 0)
+		m_readers_done.notify_all();
+}
+
+// submit
+// Requests of batch to one pool task, batch is left empty
+void Server::submit(shared_ptr<Connection> connection, vector<Request>& batch)
+{
+	const size_t n = batch.size();
+	// Back-pressure: the reader waits, the client then blocks on a full socket
+	m_in_flight.acquire(n);
+
+	auto requests = make_shared<vector<Request> >(std::move(batch));
+	batch.clear();
+
+	m_pool->Submit([this, connection, requests]() {
+		Canvas& canvas = *m_canvases[ThreadPool::WorkerIndex()];
+
+		for (const Request& request : *requests)
+		{
+			Reply reply;
+			execute(request, canvas, reply);
+			finish(*connection, request, reply);
+			m_in_flight.release();
+		}
+	});
+}
+
+// execute
+// Coding of a request, errors are caught into the reply
+void Server::execute(const Request& request, Canvas& canvas, Reply& reply)
+{
+	try
+	{
+		if (!request.error.empty())
+			throw std::runtime_error(request.error.c_str());
+
+		shared_ptr<SharedMemory> sink;
+		if (!request.sink.empty())
+			sink = make_shared<SharedMemory>(request.sink, true);
+
+		if (request.op == OpEncode)
+		{
+			if (m_options.max_pixels > 0 && (size_t)request.width * request.height > m_options.max_pixels)
+				throw std::runtime_error("Image too large");
+
+			if (request.size != (size_t)request.width * request.height * 4)
+				throw std::runtime_error("Pixel size does not match the image");
+
+			// file goes straight into the sink, or into the reply
+			unique_ptr<OutputSink> out;
+			if (sink)
+				out.reset(new MemorySink(sink->data(), sink->size()));
+			else
+				out.reset(new StringSink(reply.body));
+
+			if (request.jfif)
+			{
+				canvas.Init(request.width, request.height);
+				canvas.SetAllPixels(request.data);
+				canvas.SaveAsJFIF(*out, request.options);
+			}
+			else
+			{
+				// pixels are read in place from the request or its shared memory
+				canvas.SaveAsJPEG(PixelView(PixelFormat::RGBA, request.data, (int)request.width, (int)request.height), *out, request.options);
+			}
+
+			reply.size = sink ? ((MemorySink*)out.get())->size() : reply.body.size();
+		}
+		else
+		{
+			// shared memory sources are decoded in place
+			canvas.Decode(request.data, request.size);
+
+			reply.width = (uint32_t)canvas.width();
+			reply.height = (uint32_t)canvas.height();
+			reply.size = (uint64_t)reply.width * reply.height * 4;
+
+			const char* pixels = (const char*)canvas.pixels();
+
+			if (sink)
+			{
+				if (sink->size() < reply.size)
+					throw std::runtime_error("Sink too small");
+				memcpy(sink->data(), pixels, (size_t)reply.size);
+			}
+			else
+			{
+				reply.body.assign(pixels, (size_t)reply.size);
+			}
+		}
+	}
+	catch (const std::exception& e)
+	{
+		// a request may fail after sizing the canvas for a forged header, nothing of it is kept
+		canvas.Free();
+
+		reply = Reply();
+		reply.status = 1;
+		reply.body = e.what();
+		reply.size = reply.body.size();
+	}
+}
+
+// finish
+// Reply to the client and latency of the request
+void Server::finish(Connection& connection, const Request& request, const Reply& reply)
+{
+	char head[4 + 24];
+	const uint32_t length = (uint32_t)(24 + reply.body.size());
+
+	memcpy(head + 0, &length, 4);
+	memcpy(head + 4, &request.id, 4);
+	memcpy(head + 8, &reply.status, 4);
+	memcpy(head + 12, &reply.width, 4);
+	memcpy(head + 16, &reply.height, 4);
+	memcpy(head + 20, &reply.size, 8);
+
+	{
+		lock_guard<mutex> lock(connection.write_mutex);
+
+		iovec parts[2] = {
+			{ head, sizeof(head) },
+			{ (void*)reply.body.data(), reply.body.size() },
+		};
+
+		// a reply is sent whole or the client is gone
+		size_t part = 0;
+		while (part < 2)
+		{
+			const ssize_t n = writev(connection.fd, parts + part, 2 - (int)part);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				break;
+
+			size_t sent = (size_t)n;
+			while (part < 2 && sent >= parts[part].iov_len)
+				sent -= parts[part++].iov_len;
+			if (part < 2)
+			{
+				parts[part].iov_base = (char*)parts[part].iov_base + sent;
+				parts[part].iov_len -= sent;
+			}
+		}
+	}
+
+	if (request.op == OpStats)
+		return;
+
+	const double seconds = chrono::duration<double>(Clock::now() - request.received).count();
+
+	lock_guard<mutex> lock(m_stats_mutex);
+
+	if (m_latencies.size() < m_options.latency_window)
+		m_latencies.push_back(seconds);
+	else
+		m_latencies[m_requests % m_options.latency_window] = seconds;
+
+	++m_requests;
+}
+
+string Server::Stats()
+{
+	vector<double> latencies;
+	size_t requests;
+	{
+		lock_guard<mutex> lock(m_stats_mutex);
+		latencies = m_latencies;
+		requests = m_requests;
+	}
+
+	ostringstream out;
+	out << "requests " << requests;
+
+	if (latencies.empty())
+		return out.str();
+
+	sort(latencies.begin(), latencies.end());
+
+	auto percentile = [&](double q) {
+		const size_t i = (size_t)(q * latencies.size());
+		return 1000. * latencies[i < latencies.size() ? i : latencies.size() - 1];
+	};
+
+	char line[160];
+	snprintf(line, sizeof(line), ", last %zu: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, p99.9 %.3f ms, max %.3f ms",
+		latencies.size(), percentile(.5), percentile(.9), percentile(.99), percentile(.999), 1000. * latencies.back());
+
+	out << line;
+	return out.str();
+}
+
+
+// parseSource
+// Inline bytes or a range of shared memory
+void Server::Request::parseSource(Cursor& cursor)
+{
+	const string name = cursor.bytes(cursor.get<uint16_t>());
+
+	if (name.empty())
+	{
+		inline_bytes = cursor.bytes(cursor.get<uint32_t>());
+		data = (const unsigned char*)inline_bytes.data();
+		size = inline_bytes.size();
+		return;
+	}
+
+	const uint64_t offset = cursor.get<uint64_t>();
+	const uint64_t length = cursor.get<uint64_t>();
+
+	memory = make_shared<SharedMemory>(name, false);
+
+	if (offset > memory->size() || length > memory->size() - offset)
+		throw std::runtime_error("Source out of shared memory");
+
+	data = memory->data() + offset;
+	size = (size_t)length;
+}
+
+void Server::Request::parse(const char* message, size_t length)
+{
+	received = Clock::now();
+
+	try
+	{
+		Cursor cursor(message, length);
+
+		op = cursor.get<uint32_t>();
+		id = cursor.get<uint32_t>();
+
+		switch (op)
+		{
+		case OpEncode:
+		{
+			width = (int)cursor.get<uint32_t>();
+			height = (int)cursor.get<uint32_t>();
+			options.quality = cursor.get<float>();
+			if (!jpeg::util::IsValidQuality(options.quality))
+				throw std::runtime_error("Invalid quality");
+
+			const uint32_t format = cursor.get<uint32_t>();
+			if (format > 2) throw std::runtime_error("Unknown format");
+
+			jfif = format != 0;
+			options.progressive = format == 2;
+
+			if (width <= 0 || height <= 0)
+				throw std::runtime_error("Invalid image");
+
+			parseSource(cursor);
+			sink = cursor.bytes(cursor.get<uint16_t>());
+			break;
+		}
+		case OpDecode:
+			parseSource(cursor);
+			sink = cursor.bytes(cursor.get<uint16_t>());
+			break;
+		case OpStats:
+			break;
+		default:
+			throw std::runtime_error("Unknown op");
+		}
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+}
+
+#endif // !_WIN32
@@ -0,0 +1,112 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#ifdef UNIT_TEST_FLAG
+#include "Server.cpp"
+#endif
+
+// Unix domain sockets and POSIX shared memory only
+#ifndef _WIN32
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+#include "Engine.h"
+#include "SlotLimit.h"
+
+class ThreadPool;
+
+// Protocol
+// Every message is a u32 byte count followed by that many bytes. Integers are in host byte order,
+// both ends run on the same machine. A client may send requests without waiting for replies,
+// replies come back as jobs finish and carry the id of their request.
+//
+// request:   u32 op, u32 id, then by op
+//   1 encode:  u32 width, u32 height, f32 quality, u32 format (0 MyJPEG, 1 JFIF, 2 progressive JFIF),
+//              source of width * height * 4 RGBA bytes, sink of the file
+//   2 decode:  source of a MyJPEG or JFIF file, sink of the RGBA pixels
+//   3 stats:   nothing
+//
+// source:    u16 n, n bytes of a shared memory name, then
+//              n == 0: u32 size, size bytes inline
+//              n > 0:  u64 offset, u64 size of the bytes in the shared memory object
+// sink:      u16 n, n bytes of a shared memory name, empty to get the bytes inline in the reply
+//
+// reply:     u32 id, u32 status (0 ok, 1 error), u32 width, u32 height, u64 size, then
+//              ok:     size bytes if the sink was inline, else nothing (they are in the sink)
+//              error:  size bytes of message
+//   stats replies hold latency percentiles as text.
+//
+// Shared memory objects are made by the client (shm_open + ftruncate), a sink must be large enough
+// for the whole output. Objects are mapped shared: a client shrinking one while a request on it is
+// in flight makes the server crash with SIGBUS, so objects must keep their size until the reply.
+// A message longer than max_pixels * 4 bytes plus its fields closes the connection, files beyond
+// that go through shared memory.
+
+struct ServerOptions
+{
+	std::string socket_path;
+	size_t threads = 0;               // 0: one per hardware thread
+	size_t max_in_flight = 256;       // requests read and not yet replied, reading waits above
+	size_t max_pixels = 1 << 26;      // larger images are refused, decodes before allocating for them
+	size_t small_pixels = 256 * 256;  // images up to this size (decodes: input bytes) are batched
+	size_t batch_pixels = 1 << 20;    // pixels of a batch of small images run as one task
+	size_t latency_window = 100000;   // latencies kept for percentiles
+};
+
+// Long running encoder / decoder on a Unix socket
+// One thread reads each connection, requests go to a work-stealing pool whose workers keep a Canvas
+// each, so encoder buffers stay allocated from request to request. Small images that arrive
+// together are run as one task to cut the per-task cost. Latency is taken from the end of a
+// request to the end of its reply.
+class Server
+{
+public:
+	explicit Server(const ServerOptions& options);
+	~Server();
+
+	// Accept connections until Stop, throws if the socket cannot be bound
+	void Run();
+	// May be called from a signal handler
+	void Stop();
+
+	// Count and percentiles of the latencies in the window
+	std::string Stats();
+
+private:
+	struct Connection;
+	struct Request;
+	struct Reply;
+
+	void serve(std::shared_ptr<Connection> connection);
+	void submit(std::shared_ptr<Connection> connection, std::vector<Request>& batch);
+	void execute(const Request& request, Canvas& canvas, Reply& reply);
+	void finish(Connection& connection, const Request& request, const Reply& reply);
+
+private:
+	ServerOptions m_options;
+	std::atomic<bool> m_stop;
+	int m_listen;
+
+	std::vector<std::unique_ptr<Canvas> > m_canvases; // by worker index, outlive the pool
+	std::unique_ptr<ThreadPool> m_pool;
+
+	SlotLimit m_in_flight;            // requests read and not yet replied
+
+	std::mutex m_stats_mutex;
+	std::vector<double> m_latencies;  // seconds, ring of latency_window
+	size_t m_requests;                // replied since start
+
+	std::mutex m_connections_mutex;
+	std::condition_variable m_readers_done;
+	std::vector<std::weak_ptr<Connection> > m_connections;
+	size_t m_readers;                 // connection threads running, they are detached
+};
+
+#endif // !_WIN32
+
+#endif // !SERVER_H
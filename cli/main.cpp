@@ -0,0 +1,507 @@
+// Headless encoder / decoder on top of Canvas, no SDL
+//
+// jpegcli [options] input...
+// jpegcli [options] --serve socket
+//   -d               decode MyJPEG or JFIF files instead of encoding pixels
+//   -o path          output of a single input, '-' for stdout
+//   -q quality       encoder quality (default 1)
+//   -j threads       files coded in parallel (default 1), workers of --serve (default one per core)
+//   -t threads       transform workers of the pipelined MyJPEG encoder (default 0, no pipeline)
+//   -f format        encode: myjpeg (default), jfif, progressive
+//                    decode: ppm (default), rgba
+//   -s WxH           size of raw RGBA input, PPM (P6) input carries its own
+//   --dct fast|exact forward DCT of the encoder
+//   --trellis        rate-distortion optimized quantization
+//   --optimize       JFIF Huffman tables built from the image
+//   --serve socket   encode / decode requests of a Unix socket until SIGINT or SIGTERM, see Server.h
+//   -v               timing and compress ratios on stderr
+//
+// Input '-' is stdin. Without -o each output is written next to its input with
+// the extension of the format.
+
+//
+#include <iostream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <future>
+#include <stdexcept>
+#include <cctype>
+#include <csignal>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+//
+#include "Engine.h"
+#include "jpeg.h"
+#include "BatchIO.h"
+#include "OutputSink.h"
+#include "Server.h"
+
+using namespace std;
+
+
+
+struct Options
+{
+	bool decode = false;
+	string output;
+	string format;
+	int threads = 0;  // 0: default of the mode
+	int width = 0, height = 0;
+	bool verbose = false;
+	EncodeOptions encode;
+	vector<string> inputs;
+	string socket;    // server mode if set
+};
+
+
+// Usage
+//
+void Usage()
+{
+	cerr <<
+		"usage: jpegcli [options] input...\n"
+		"       jpegcli [options] --serve socket\n"
+		"  -d               decode MyJPEG or JFIF files instead of encoding pixels\n"
+		"  -o path          output of a single input, '-' for stdout\n"
+		"  -q quality       encoder quality, 0.01 to 100 (default 1)\n"
+		"  -j threads       files coded in parallel (default 1), workers of --serve (default one per core)\n"
+		"  -t threads       transform workers of the pipelined MyJPEG encoder (default 0, no pipeline)\n"
+		"  -f format        encode: myjpeg (default), jfif, progressive\n"
+		"                   decode: ppm (default), rgba\n"
+		"  -s WxH           size of raw RGBA input, PPM (P6) input carries its own\n"
+		"  --dct fast|exact forward DCT of the encoder\n"
+		"  --trellis        rate-distortion optimized quantization\n"
+		"  --optimize       JFIF Huffman tables built from the image\n"
+		"  --serve socket   encode / decode requests of a Unix socket until SIGINT or SIGTERM\n"
+		"  -v               timing and compress ratios on stderr\n"
+		"input '-' is stdin\n";
+}
+
+
+// ParseArgs
+// ret: false on bad arguments
+bool ParseArgs(int argc, char* argv[], Options& opt)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const string arg = argv[i];
+		const bool has_value = i + 1 < argc;
+
+		if (arg == "-d")
+			opt.decode = true;
+		else if (arg == "-v")
+			opt.verbose = true;
+		else if (arg == "--trellis")
+			opt.encode.trellis = true;
+		else if (arg == "--optimize")
+			opt.encode.optimize_huffman = true;
+		else if (arg == "-o" && has_value)
+			opt.output = argv[++i];
+		else if (arg == "-f" && has_value)
+			opt.format = argv[++i];
+		else if (arg == "-q" && has_value)
+		{
+			opt.encode.quality = (float)atof(argv[++i]);
+			if (!jpeg::util::IsValidQuality(opt.encode.quality))
+				return false;
+		}
+		else if (arg == "-j" && has_value)
+			opt.threads = atoi(argv[++i]);
+		else if (arg == "-t" && has_value)
+			opt.encode.threads = atoi(argv[++i]);
+		else if (arg == "--serve" && has_value)
+			opt.socket = argv[++i];
+		else if (arg == "-s" && has_value)
+		{
+			if (sscanf(argv[++i], "%dx%d", &opt.width, &opt.height) != 2)
+				return false;
+		}
+		else if (arg == "--dct" && has_value)
+		{
+			const string method = argv[++i];
+			if (method == "fast")
+				opt.encode.dct = DCTMethod::Fast;
+			else if (method == "exact")
+				opt.encode.dct = DCTMethod::Exact;
+			else
+				return false;
+		}
+		else if (arg == "-" || arg[0] != '-')
+			opt.inputs.push_back(arg);
+		else
+			return false;
+	}
+
+	if (opt.format.empty())
+		opt.format = opt.decode ? "ppm" : "myjpeg";
+
+	const vector<string> formats = opt.decode ?
+		vector<string>{ "ppm", "rgba" } :
+		vector<string>{ "myjpeg", "jfif", "progressive" };
+
+	bool known = false;
+	for (const string& f : formats)
+		known = known || f == opt.format;
+
+	opt.encode.progressive = opt.format == "progressive";
+
+	if (!opt.socket.empty())
+		return opt.threads >= 0 && opt.inputs.empty();
+
+	return known && opt.threads >= 0 && opt.encode.threads >= 0 && !opt.inputs.empty() && (opt.output.empty() || opt.inputs.size() == 1);
+}
+
+
+// OutputPath
+// Input path with the extension of the output format
+string OutputPath(const Options& opt, const string& input)
+{
+	if (!opt.output.empty())
+		return opt.output;
+
+	if (input == "-")
+		return "-";
+
+	const string ext =
+		opt.format == "myjpeg" ? ".myj" :
+		opt.format == "ppm" ? ".ppm" :
+		opt.format == "rgba" ? ".rgba" : ".jpg";
+
+	const size_t slash = input.find_last_of("/\\");
+	const size_t dot = input.find_last_of('.');
+	const bool has_ext = dot != string::npos && (slash == string::npos || dot > slash);
+
+	return (has_ext ? input.substr(0, dot) : input) + ext;
+}
+
+
+// ReadStdin
+// Whole stdin, files are read by the I/O thread
+string ReadStdin()
+{
+	return string(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+}
+
+
+// ReadPPM
+// Binary PPM (P6, maxval 255) => RGBA pixels
+// ret: false if data is not a PPM file
+bool ReadPPM(const string& data, int& w, int& h, vector<unsigned char>& rgba)
+{
+	if (data.size() < 2 || data[0] != 'P' || data[1] != '6')
+		return false;
+
+	// header fields are separated by whitespace, comments run to the end of line
+	size_t pos = 2;
+	int fields[3]{};
+
+	for (int& field : fields)
+	{
+		while (pos < data.size() && (isspace((unsigned char)data[pos]) || data[pos] == '#'))
+		{
+			if (data[pos] == '#')
+				pos = data.find('\n', pos);
+			else
+				++pos;
+		}
+
+		if (pos >= data.size() || !isdigit((unsigned char)data[pos]))
+			throw std::runtime_error("Invalid PPM header");
+
+		while (pos < data.size() && isdigit((unsigned char)data[pos]))
+			field = field * 10 + (data[pos++] - '0');
+	}
+
+	// single whitespace before pixels
+	++pos;
+
+	w = fields[0];
+	h = fields[1];
+
+	if (w <= 0 || h <= 0 || fields[2] != 255)
+		throw std::runtime_error("Unsupported PPM");
+
+	if (data.size() < pos + (size_t)w * h * 3)
+		throw std::runtime_error("Truncated PPM");
+
+	rgba.resize((size_t)w * h * 4);
+	for (size_t p = 0; p < (size_t)w * h; ++p)
+	{
+		rgba[p * 4 + 0] = (unsigned char)data[pos + p * 3 + 0];
+		rgba[p * 4 + 1] = (unsigned char)data[pos + p * 3 + 1];
+		rgba[p * 4 + 2] = (unsigned char)data[pos + p * 3 + 2];
+		rgba[p * 4 + 3] = 255;
+	}
+
+	return true;
+}
+
+
+// Encode
+// PPM or raw RGBA => MyJPEG or JFIF
+void Encode(Canvas& canvas, const Options& opt, const string& data, OutputSink& out)
+{
+	int w = opt.width, h = opt.height;
+	vector<unsigned char> rgba;
+
+	if (!ReadPPM(data, w, h, rgba))
+	{
+		if (w <= 0 || h <= 0)
+			throw std::runtime_error("Raw input needs -s WxH");
+		if (data.size() != (size_t)w * h * 4)
+			throw std::runtime_error("Raw input size does not match -s");
+
+		rgba.assign(data.begin(), data.end());
+	}
+
+	canvas.Init(w, h);
+	canvas.SetAllPixels(rgba.data());
+
+	if (opt.format == "myjpeg")
+		canvas.SaveAsJPEG(out, opt.encode);
+	else
+		canvas.SaveAsJFIF(out, opt.encode);
+}
+
+
+// Decode
+// MyJPEG or JFIF => PPM or raw RGBA
+void Decode(Canvas& canvas, const Options& opt, const string& data, OutputSink& out)
+{
+	canvas.Decode((const uint8_t*)data.data(), data.size());
+
+	const int w = canvas.width(), h = canvas.height();
+	const unsigned char* pixels = (const unsigned char*)canvas.pixels();
+
+	if (opt.format == "rgba")
+	{
+		out.Reserve((size_t)w * h * 4);
+		out.Write(pixels, (size_t)w * h * 4);
+		return;
+	}
+
+	const string header = "P6\n" + to_string(w) + " " + to_string(h) + "\n255\n";
+	out.Reserve(header.size() + (size_t)w * h * 3);
+	out.Write(header.data(), header.size());
+
+	vector<char> row((size_t)w * 3);
+	for (int i = 0; i < h; ++i)
+	{
+		for (int j = 0; j < w; ++j)
+			for (int c = 0; c < 3; ++c)
+				row[j * 3 + c] = (char)pixels[((size_t)i * w + j) * 4 + c];
+
+		out.Write(row.data(), row.size());
+	}
+}
+
+
+// Report
+// Error of an input on stderr
+void Report(const string& input, const char* error)
+{
+	static mutex err_mutex;
+	lock_guard<mutex> lock(err_mutex);
+	cerr << "jpegcli: " << input << ": " << error << endl;
+}
+
+
+// Output file queued to the I/O thread
+struct PendingWrite
+{
+	string input;
+	future<void> done;
+};
+
+
+// Process
+// One input to its output, errors are reported
+// read is the input queued to the I/O thread, unless it is stdin. Output files are queued to it as
+// well, their errors are reported once they are written.
+bool Process(Canvas& canvas, const Options& opt, const string& input, future<string>& read, BatchIO& io, vector<PendingWrite>& writes)
+{
+	const string output = OutputPath(opt, input);
+
+	try
+	{
+		const string data = input == "-" ? ReadStdin() : read.get();
+
+		// files are coded into memory and queued, stdout is written as coded
+		string bytes;
+		StringSink file_out(bytes);
+		StreamSink stdout_out(cout);
+		OutputSink& out = output == "-" ? (OutputSink&)stdout_out : file_out;
+
+		if (opt.decode)
+			Decode(canvas, opt, data, out);
+		else
+			Encode(canvas, opt, data, out);
+
+		if (output == "-")
+		{
+			cout.flush();
+			if (!cout) throw std::runtime_error("Write failed");
+		}
+		else
+		{
+			writes.push_back(PendingWrite{ input, io.Write(output, std::move(bytes)) });
+		}
+	}
+	catch (const std::exception& e)
+	{
+		Report(input, e.what());
+		return false;
+	}
+
+	return true;
+}
+
+#ifndef _WIN32
+// server of --serve, stopped by signals
+static Server* g_server = nullptr;
+
+void StopServer(int)
+{
+	if (g_server)
+		g_server->Stop();
+}
+#endif
+
+// Serve
+// ret: exit code, latency percentiles on stderr once stopped
+int Serve(const Options& opt)
+{
+#ifdef _WIN32
+	cerr << "jpegcli: --serve needs Unix domain sockets" << endl;
+	return 2;
+#else
+	ServerOptions options;
+	options.socket_path = opt.socket;
+	options.threads = (size_t)opt.threads;
+
+	Server server(options);
+	g_server = &server;
+
+	signal(SIGINT, StopServer);
+	signal(SIGTERM, StopServer);
+
+	int ret = 0;
+
+	try
+	{
+		server.Run();
+		cerr << "jpegcli: " << server.Stats() << endl;
+	}
+	catch (const std::exception& e)
+	{
+		cerr << "jpegcli: " << opt.socket << ": " << e.what() << endl;
+		ret = 1;
+	}
+
+	g_server = nullptr;
+	return ret;
+#endif
+}
+
+
+
+int main(int argc, char* argv[])
+{
+	Options opt;
+
+	if (!ParseArgs(argc, argv, opt))
+	{
+		Usage();
+		return 2;
+	}
+
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+
+	// engine logs go to clog
+	SetEngineLog(opt.verbose);
+	if (!opt.verbose)
+		clog.rdbuf(nullptr);
+
+	if (!opt.socket.empty())
+		return Serve(opt);
+
+
+
+	const size_t threads = opt.threads > 0 ? (size_t)opt.threads : 1;
+	const size_t n_threads = threads < opt.inputs.size() ? threads : opt.inputs.size();
+
+	// Input files are read ahead of the workers, outputs written behind them, so coding does not
+	// wait on the disk
+	BatchIO io;
+	clog << "File I/O: " << io.backend() << endl;
+
+	vector<future<string> > reads(opt.inputs.size());
+	size_t reads_queued = 0;
+	mutex reads_mutex;
+
+	auto read_ahead = [&](size_t end) {
+		lock_guard<mutex> lock(reads_mutex);
+		for (; reads_queued < end && reads_queued < opt.inputs.size(); ++reads_queued)
+			if (opt.inputs[reads_queued] != "-")
+				reads[reads_queued] = io.Read(opt.inputs[reads_queued]);
+	};
+
+	const size_t window = 2 * n_threads;
+	read_ahead(window);
+
+	// Workers take the next input until none is left
+	// each keeps one canvas, so encoder buffers are reused from file to file
+	atomic<size_t> next{ 0 };
+	atomic<int> failed{ 0 };
+
+	auto worker = [&]() {
+		Canvas canvas;
+		vector<PendingWrite> writes;
+
+		for (size_t i = next++; i < opt.inputs.size(); i = next++)
+		{
+			read_ahead(i + 1 + window);
+
+			if (!Process(canvas, opt, opt.inputs[i], reads[i], io, writes))
+				++failed;
+		}
+
+		for (PendingWrite& write : writes)
+		{
+			try
+			{
+				write.done.get();
+			}
+			catch (const std::exception& e)
+			{
+				Report(write.input, e.what());
+				++failed;
+			}
+		}
+	};
+
+	vector<thread> pool;
+
+	for (size_t t = 1; t < n_threads; ++t)
+		pool.emplace_back(worker);
+
+	worker();
+
+	for (thread& t : pool)
+		t.join();
+
+	return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,146 @@
+#include "Async.h"
+#include "ThreadPool.h"
+#include "OutputSink.h"
+
+#include <stdexcept>
+
+using namespace std;
+
+
+// run_job
+// Result or error of job to its completion and promise
+// done runs in between, before the future becomes ready
+template <typename T>
+void run_job(const function<T()>& job, const Completion<T>& on_done, const function<void()>& done, promise<T>& result)
+{
+	T value{};
+	exception_ptr error;
+
+	try
+	{
+		value = job();
+	}
+	catch (...)
+	{
+		error = current_exception();
+	}
+
+	if (on_done)
+	{
+		// a failing completion must not take the worker down
+		try
+		{
+			on_done(error ? nullptr : &value, error);
+		}
+		catch (...)
+		{}
+	}
+
+	done();
+
+	if (error)
+		result.set_exception(error);
+	else
+		result.set_value(std::move(value));
+}
+
+
+AsyncCodec::AsyncCodec(size_t threads, size_t max_in_flight) :
+	m_pool(new ThreadPool(threads)),
+	m_in_flight(max_in_flight)
+{
+	for (size_t t = 0; t < m_pool->size(); ++t)
+		m_canvases.emplace_back(new Canvas);
+}
+
+AsyncCodec::~AsyncCodec()
+{
+	m_pool->Wait();
+}
+
+size_t AsyncCodec::inFlight()
+{
+	return m_in_flight.used();
+}
+
+future<EncodedBuffer> AsyncCodec::EncodeAsync(
+	Image image,
+	const EncodeOptions& options,
+	FileFormat format,
+	Completion<EncodedBuffer> on_done)
+{
+	m_in_flight.acquire();
+
+	auto result = make_shared<promise<EncodedBuffer> >();
+	auto pixels = make_shared<Image>(std::move(image));
+	future<EncodedBuffer> ret = result->get_future();
+
+	m_pool->Submit([this, result, pixels, options, format, on_done]() {
+		function<EncodedBuffer()> job = [&]() {
+			const Image& img = *pixels;
+
+			if (img.width <= 0 || img.height <= 0 || img.pixels.size() != (size_t)img.width * img.height * 4)
+				throw std::runtime_error("Invalid image");
+
+			Canvas& canvas = *m_canvases[ThreadPool::WorkerIndex()];
+
+			EncodedBuffer buffer;
+			buffer.format = format;
+
+			StringSink out(buffer.bytes);
+
+			if (format == FileFormat::JFIF)
+			{
+				canvas.Init(img.width, img.height);
+				canvas.SetAllPixels(img.pixels.data());
+				canvas.SaveAsJFIF(out, options);
+			}
+			else if (options.threads > 0)
+			{
+				canvas.Init(img.width, img.height);
+				canvas.SetAllPixels(img.pixels.data());
+				canvas.SaveAsJPEG(out, options);
+			}
+			else
+			{
+				// pixels of the job are read in place
+				canvas.SaveAsJPEG(PixelView(PixelFormat::RGBA, img.pixels.data(), img.width, img.height), out, options);
+			}
+
+			return buffer;
+		};
+
+		// the slot is freed before the future is ready, so a caller waiting on it may submit right away
+		run_job<EncodedBuffer>(job, on_done, [this]() { m_in_flight.release(); }, *result);
+	});
+
+	return ret;
+}
+
+future<Image> AsyncCodec::DecodeAsync(string bytes, Completion<Image> on_done)
+{
+	m_in_flight.acquire();
+
+	auto result = make_shared<promise<Image> >();
+	auto data = make_shared<string>(std::move(bytes));
+	future<Image> ret = result->get_future();
+
+	m_pool->Submit([this, result, data, on_done]() {
+		function<Image()> job = [&]() {
+			Canvas& canvas = *m_canvases[ThreadPool::WorkerIndex()];
+			canvas.Decode((const uint8_t*)data->data(), data->size());
+
+			Image img;
+			img.width = canvas.width();
+			img.height = canvas.height();
+
+			const unsigned char* pixels = (const unsigned char*)canvas.pixels();
+			img.pixels.assign(pixels, pixels + (size_t)img.width * img.height * 4);
+			return img;
+		};
+
+		run_job<Image>(job, on_done, [this]() { m_in_flight.release(); }, *result);
+	});
+
+	return ret;
+}
@@ -0,0 +1,76 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+#ifdef UNIT_TEST_FLAG
+#include "Async.cpp"
+#endif
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <future>
+#include <functional>
+#include <exception>
+
+#include "Engine.h"
+#include "SlotLimit.h"
+
+class ThreadPool;
+
+// RGBA pixels, rows packed
+struct Image
+{
+	int width{}, height{};
+	std::vector<unsigned char> pixels;
+};
+
+enum class FileFormat
+{
+	MyJPEG,
+	JFIF,
+};
+
+// Whole encoded file
+struct EncodedBuffer
+{
+	FileFormat format{};
+	std::string bytes;
+};
+
+// Called on a worker once a job is done, result is null on error
+// Completions must not wait for other jobs of the same codec
+template <typename T>
+using Completion = std::function<void(const T* result, std::exception_ptr error)>;
+
+// Encoding and decoding in memory on a thread pool
+// At most max_in_flight jobs are queued or running, further calls block until one is done, so a
+// producer faster than the pool is slowed down instead of piling up images. Errors are thrown by
+// future::get. Every worker keeps one Canvas, buffers are reused from job to job.
+class AsyncCodec
+{
+public:
+	// 0 threads: one per hardware thread
+	explicit AsyncCodec(size_t threads = 0, size_t max_in_flight = 64);
+	// Waits for every job
+	~AsyncCodec();
+
+	std::future<EncodedBuffer> EncodeAsync(
+		Image image,
+		const EncodeOptions& options,
+		FileFormat format = FileFormat::MyJPEG,
+		Completion<EncodedBuffer> on_done = nullptr);
+
+	// MyJPEG or JFIF, told apart by the first bytes
+	std::future<Image> DecodeAsync(std::string bytes, Completion<Image> on_done = nullptr);
+
+	// Jobs queued or running
+	size_t inFlight();
+
+private:
+	std::vector<std::unique_ptr<Canvas> > m_canvases; // by worker index, outlive the pool
+	std::unique_ptr<ThreadPool> m_pool;
+
+	SlotLimit m_in_flight;
+};
+
+#endif // !ASYNC_H
@@ -0,0 +1,570 @@
+#include "BatchIO.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#endif
+
+#if defined(JPEG_IO_URING) && defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#define IO_URING_ENABLED
+#endif
+
+using namespace std;
+
+// transfers are split into calls of at most this many bytes
+static const size_t MAX_TRANSFER = 1 << 30;
+
+
+// File descriptors on both platforms, the Windows CRT has no pread, seeks are fine on the one
+// I/O thread
+#ifdef _WIN32
+static int OpenFile(const string& path, bool write)
+{
+	return write ?
+		_open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE) :
+		_open(path.c_str(), _O_RDONLY | _O_BINARY);
+}
+
+static long long FileSize(int fd)
+{
+	return _filelengthi64(fd);
+}
+
+static long long ReadAt(int fd, char* data, size_t size, long long offset)
+{
+	if (_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return _read(fd, data, (unsigned)size);
+}
+
+static long long WriteAt(int fd, const char* data, size_t size, long long offset)
+{
+	if (_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return _write(fd, data, (unsigned)size);
+}
+
+static void CloseFile(int fd)
+{
+	_close(fd);
+}
+#else
+static int OpenFile(const string& path, bool write)
+{
+	return write ?
+		::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644) :
+		::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+}
+
+static long long FileSize(int fd)
+{
+	struct stat st;
+	return fstat(fd, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+static long long ReadAt(int fd, char* data, size_t size, long long offset)
+{
+	return pread(fd, data, size, (off_t)offset);
+}
+
+static long long WriteAt(int fd, const char* data, size_t size, long long offset)
+{
+	return pwrite(fd, data, size, (off_t)offset);
+}
+
+static void CloseFile(int fd)
+{
+	close(fd);
+}
+#endif
+
+
+struct BatchIO::Op
+{
+	bool write = false;
+	string path;
+	string bytes;     // whole file
+	size_t done = 0;  // bytes transferred
+	int fd = -1;
+
+#ifdef IO_URING_ENABLED
+	iovec iov;        // of the transfer in the ring
+#endif
+
+	promise<string> read_result;
+	promise<void> write_result;
+};
+
+
+#ifdef IO_URING_ENABLED
+// Submission and completion rings of an io_uring, used by the I/O thread only
+// The kernel headers are enough, no liburing.
+class BatchIO::Ring
+{
+public:
+	explicit Ring(unsigned entries) : m_to_submit(0)
+	{
+		memset(&m_params, 0, sizeof(m_params));
+
+		m_fd = (int)syscall(__NR_io_uring_setup, entries, &m_params);
+		if (m_fd < 0) throw std::runtime_error("io_uring not available");
+
+		m_sq_size = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+		m_cq_size = m_params.cq_off.cqes + m_params.cq_entries * sizeof(io_uring_cqe);
+
+		// both rings in one mapping on kernels 5.4 and later
+		const bool single = (m_params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+		if (single)
+			m_sq_size = m_cq_size = std::max(m_sq_size, m_cq_size);
+
+		m_sq = mmap(nullptr, m_sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+		m_cq = single ? m_sq : mmap(nullptr, m_cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+		m_sqes_size = m_params.sq_entries * sizeof(io_uring_sqe);
+		m_sqes = (io_uring_sqe*)mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES);
+
+		if (m_sq == MAP_FAILED || m_cq == MAP_FAILED || m_sqes == MAP_FAILED)
+		{
+			unmap();
+			throw std::runtime_error("io_uring not available");
+		}
+
+		char* sq = (char*)m_sq;
+		m_sq_head = (unsigned*)(sq + m_params.sq_off.head);
+		m_sq_tail = (unsigned*)(sq + m_params.sq_off.tail);
+		m_sq_mask = (unsigned*)(sq + m_params.sq_off.ring_mask);
+		m_sq_array = (unsigned*)(sq + m_params.sq_off.array);
+
+		char* cq = (char*)m_cq;
+		m_cq_head = (unsigned*)(cq + m_params.cq_off.head);
+		m_cq_tail = (unsigned*)(cq + m_params.cq_off.tail);
+		m_cq_mask = (unsigned*)(cq + m_params.cq_off.ring_mask);
+		m_cqes = (io_uring_cqe*)(cq + m_params.cq_off.cqes);
+	}
+
+	~Ring()
+	{
+		unmap();
+	}
+
+	// ret: false if the submission ring is full
+	bool push(uint8_t opcode, int fd, const void* data, size_t size, uint64_t offset, void* user)
+	{
+		const unsigned tail = *m_sq_tail;
+		if (tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE) >= m_params.sq_entries)
+			return false;
+
+		const unsigned index = tail & *m_sq_mask;
+		io_uring_sqe& sqe = m_sqes[index];
+
+		memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = opcode;
+		sqe.fd = fd;
+		sqe.addr = (uint64_t)(uintptr_t)data;
+		sqe.len = (uint32_t)size;
+		sqe.off = offset;
+		sqe.user_data = (uint64_t)(uintptr_t)user;
+
+		m_sq_array[index] = index;
+		__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		++m_to_submit;
+
+		return true;
+	}
+
+	// Submit what was pushed and wait for wait completions
+	void enter(unsigned wait)
+	{
+		for (;;)
+		{
+			const int ret = (int)syscall(__NR_io_uring_enter, m_fd, m_to_submit, wait, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+			if (ret >= 0)
+			{
+				m_to_submit -= (unsigned)ret;
+				return;
+			}
+
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+				throw std::runtime_error("io_uring_enter failed");
+		}
+	}
+
+	// ret: false if no completion is there
+	bool pop(void*& user, int& result)
+	{
+		const unsigned head = *m_cq_head;
+		if (head == __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE))
+			return false;
+
+		const io_uring_cqe& cqe = m_cqes[head & *m_cq_mask];
+		user = (void*)(uintptr_t)cqe.user_data;
+		result = cqe.res;
+
+		__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+private:
+	void unmap()
+	{
+		if (m_sqes != MAP_FAILED)
+			munmap(m_sqes, m_sqes_size);
+		if (m_cq != MAP_FAILED && m_cq != m_sq)
+			munmap(m_cq, m_cq_size);
+		if (m_sq != MAP_FAILED)
+			munmap(m_sq, m_sq_size);
+		close(m_fd);
+	}
+
+private:
+	int m_fd;
+	io_uring_params m_params;
+	unsigned m_to_submit;  // pushed and not yet taken by the kernel
+
+	void* m_sq = MAP_FAILED;
+	void* m_cq = MAP_FAILED;
+	io_uring_sqe* m_sqes = (io_uring_sqe*)MAP_FAILED;
+	size_t m_sq_size, m_cq_size, m_sqes_size;
+
+	unsigned *m_sq_head, *m_sq_tail, *m_sq_mask, *m_sq_array;
+	unsigned *m_cq_head, *m_cq_tail, *m_cq_mask;
+	io_uring_cqe* m_cqes;
+};
+#else
+// No io_uring in this build
+class BatchIO::Ring
+{
+public:
+	bool push(uint8_t, int, const void*, size_t, uint64_t, void*) { return false; }
+	void enter(unsigned) {}
+	bool pop(void*&, int&) { return false; }
+};
+#endif
+
+
+BatchIO::BatchIO(size_t depth, size_t max_pending_bytes) :
+	m_depth(depth > 0 ? depth : 1),
+	m_ring_failed(false),
+	m_ops(0),
+	m_pending_bytes(0),
+	m_max_pending_bytes(max_pending_bytes),
+	m_stop(false)
+{
+#ifdef IO_URING_ENABLED
+	// older kernels and sandboxes without io_uring get blocking transfers
+	try
+	{
+		m_ring.reset(new Ring((unsigned)m_depth));
+	}
+	catch (const std::exception&)
+	{}
+#endif
+
+	m_thread = thread(&BatchIO::run, this);
+}
+
+BatchIO::~BatchIO()
+{
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_work.notify_one();
+
+	m_thread.join();
+
+	// closing the ring ends what the kernel still does with abandoned ops, they go after it
+	m_ring.reset();
+	m_abandoned.clear();
+}
+
+const char* BatchIO::backend() const
+{
+	return m_ring && !m_ring_failed ? "io_uring" : "pread";
+}
+
+future<string> BatchIO::Read(const string& path)
+{
+	unique_ptr<Op> op(new Op);
+	op->path = path;
+	future<string> ret = op->read_result.get_future();
+
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_queue.push_back(std::move(op));
+		++m_ops;
+	}
+	m_work.notify_one();
+
+	return ret;
+}
+
+// Write
+// Back-pressure: a producer faster than the disk waits for earlier writes
+future<void> BatchIO::Write(const string& path, string bytes)
+{
+	unique_ptr<Op> op(new Op);
+	op->write = true;
+	op->path = path;
+	op->bytes = std::move(bytes);
+	future<void> ret = op->write_result.get_future();
+
+	{
+		unique_lock<mutex> lock(m_mutex);
+		m_space.wait(lock, [this]() { return m_pending_bytes == 0 || m_pending_bytes < m_max_pending_bytes; });
+
+		m_pending_bytes += op->bytes.size();
+		m_queue.push_back(std::move(op));
+		++m_ops;
+	}
+	m_work.notify_one();
+
+	return ret;
+}
+
+void BatchIO::Wait()
+{
+	unique_lock<mutex> lock(m_mutex);
+	m_idle.wait(lock, [this]() { return m_ops == 0; });
+}
+
+// run
+// I/O thread: takes queued ops while fewer than depth are in the kernel, then waits for one to
+// complete. Short transfers are resubmitted for the rest. If the ring fails, the ops in it fail
+// and the thread goes on with blocking transfers.
+void BatchIO::run()
+{
+	vector<Op*> in_flight;  // ops in the ring
+
+	for (;;)
+	{
+		vector<Op*> taken;
+		{
+			unique_lock<mutex> lock(m_mutex);
+
+			if (in_flight.empty())
+				m_work.wait(lock, [this]() { return !m_queue.empty() || m_stop; });
+
+			if (m_queue.empty() && in_flight.empty())
+				return;
+
+			while (!m_queue.empty() && in_flight.size() + taken.size() < m_depth)
+			{
+				taken.push_back(m_queue.front().release());
+				m_queue.pop_front();
+			}
+		}
+
+		for (Op* op : taken)
+		{
+			if (!open(*op))
+				continue;
+
+			if (m_ring && !m_ring_failed)
+			{
+				submit(*op);
+				in_flight.push_back(op);
+			}
+			else
+			{
+				transfer(*op);
+			}
+		}
+
+		if (in_flight.empty())
+			continue;
+
+		try
+		{
+			m_ring->enter(1);
+		}
+		catch (const std::exception&)
+		{
+			// the kernel may still fill the buffers of ops in the ring, they are kept
+			m_ring_failed = true;
+
+			for (Op* op : in_flight)
+				finish(op, make_exception_ptr(std::runtime_error(op->write ? "Write failed" : "Read failed")), true);
+
+			in_flight.clear();
+			continue;
+		}
+
+		void* user;
+		int result;
+
+		while (m_ring->pop(user, result))
+		{
+			Op* op = (Op*)user;
+
+			if (result == -EINTR || result == -EAGAIN)
+			{
+				submit(*op);
+				continue;
+			}
+
+			// a write that makes no progress would be resubmitted forever
+			if (result < 0 || (result == 0 && op->write))
+			{
+				in_flight.erase(std::find(in_flight.begin(), in_flight.end(), op));
+				finish(op, make_exception_ptr(std::runtime_error(op->write ? "Write failed" : "Read failed")));
+				continue;
+			}
+
+			op->done += (size_t)result;
+
+			// a file that got shorter since its size was taken ends early
+			if (result == 0)
+				op->bytes.resize(op->done);
+
+			if (op->done < op->bytes.size())
+			{
+				submit(*op);
+				continue;
+			}
+
+			in_flight.erase(std::find(in_flight.begin(), in_flight.end(), op));
+			finish(op, nullptr);
+		}
+	}
+}
+
+// open
+// ret: false if op is already finished, failed or empty
+bool BatchIO::open(Op& op)
+{
+	op.fd = OpenFile(op.path, op.write);
+
+	if (op.fd < 0)
+	{
+		finish(&op, make_exception_ptr(std::runtime_error(op.write ? "Cannot create output" : "File missing")));
+		return false;
+	}
+
+	if (!op.write)
+	{
+		const long long size = FileSize(op.fd);
+		if (size < 0)
+		{
+			finish(&op, make_exception_ptr(std::runtime_error("Read failed")));
+			return false;
+		}
+
+		op.bytes.resize((size_t)size);
+	}
+
+	if (op.bytes.empty())
+	{
+		finish(&op, nullptr);
+		return false;
+	}
+
+	return true;
+}
+
+// transfer
+// Blocking pread / pwrite of the whole op
+void BatchIO::transfer(Op& op)
+{
+	while (op.done < op.bytes.size())
+	{
+		const size_t size = std::min(op.bytes.size() - op.done, MAX_TRANSFER);
+		const long long n = op.write ?
+			WriteAt(op.fd, &op.bytes[op.done], size, (long long)op.done) :
+			ReadAt(op.fd, &op.bytes[op.done], size, (long long)op.done);
+
+		if (n < 0)
+		{
+			finish(&op, make_exception_ptr(std::runtime_error(op.write ? "Write failed" : "Read failed")));
+			return;
+		}
+
+		if (n == 0)
+		{
+			if (op.write)
+			{
+				finish(&op, make_exception_ptr(std::runtime_error("Write failed")));
+				return;
+			}
+
+			op.bytes.resize(op.done);
+			break;
+		}
+
+		op.done += (size_t)n;
+	}
+
+	finish(&op, nullptr);
+}
+
+// submit
+// Rest of op to the ring, it has room as at most depth ops are in flight
+void BatchIO::submit(Op& op)
+{
+#ifdef IO_URING_ENABLED
+	// vectored ops are there since io_uring came in (5.1), plain read / write only since 5.6
+	op.iov.iov_base = &op.bytes[op.done];
+	op.iov.iov_len = std::min(op.bytes.size() - op.done, MAX_TRANSFER);
+
+	m_ring->push(op.write ? IORING_OP_WRITEV : IORING_OP_READV, op.fd, &op.iov, 1, op.done, &op);
+#endif
+}
+
+// finish
+// Result of op to its future, op is deleted unless kept for a kernel that may still use it
+void BatchIO::finish(Op* op, exception_ptr error, bool keep)
+{
+	unique_ptr<Op> owned(op);
+
+	if (op->fd >= 0)
+		CloseFile(op->fd);
+
+	const size_t written = op->write ? op->bytes.size() : 0;
+
+	if (op->write)
+	{
+		if (!keep)
+			op->bytes = string();
+
+		if (error)
+			op->write_result.set_exception(error);
+		else
+			op->write_result.set_value();
+	}
+	else
+	{
+		if (error)
+			op->read_result.set_exception(error);
+		else
+			op->read_result.set_value(std::move(op->bytes));
+	}
+
+	{
+		lock_guard<mutex> lock(m_mutex);
+		m_pending_bytes -= written;
+		--m_ops;
+
+		if (m_ops == 0)
+			m_idle.notify_all();
+	}
+	m_space.notify_all();
+
+	if (keep)
+		m_abandoned.push_back(std::move(owned));
+}
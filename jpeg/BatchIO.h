@@ -0,0 +1,70 @@
+#ifndef BATCH_IO_H
+#define BATCH_IO_H
+
+#ifdef UNIT_TEST_FLAG
+#include "BatchIO.cpp"
+#endif
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <memory>
+#include <future>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+// Whole-file reads and writes of a batch, done by one I/O thread
+// Coding threads queue a read of an input they will need soon or a write of an output they are
+// done with and go on coding, the I/O thread keeps up to depth transfers in the kernel.
+// Built with JPEG_IO_URING on Linux, transfers are submitted through io_uring. Without it, or
+// when the kernel has no io_uring, every transfer is a blocking pread / pwrite on the I/O thread.
+// Errors are thrown by future::get.
+class BatchIO
+{
+public:
+	// max_pending_bytes: Write blocks while that many bytes are queued and not yet written
+	explicit BatchIO(size_t depth = 32, size_t max_pending_bytes = 256 << 20);
+	// Waits for every queued transfer
+	~BatchIO();
+
+	std::future<std::string> Read(const std::string& path);
+	std::future<void> Write(const std::string& path, std::string bytes);
+
+	// Block until every queued transfer is done
+	void Wait();
+
+	// "io_uring" or "pread"
+	const char* backend() const;
+
+private:
+	struct Op;
+	class Ring;
+
+	void run();
+	bool open(Op& op);
+	void transfer(Op& op);
+	void submit(Op& op);
+	void finish(Op* op, std::exception_ptr error, bool keep = false);
+
+private:
+	size_t m_depth;
+	std::unique_ptr<Ring> m_ring;  // null: blocking transfers
+	std::atomic<bool> m_ring_failed;  // blocking transfers after an error of the ring
+	std::vector<std::unique_ptr<Op> > m_abandoned;  // failed while in the ring, of the I/O thread
+
+	std::mutex m_mutex;
+	std::condition_variable m_work;   // queued or stopping
+	std::condition_variable m_space;  // pending bytes went down
+	std::condition_variable m_idle;   // nothing queued or running
+	std::deque<std::unique_ptr<Op> > m_queue;
+	size_t m_ops;                     // queued and running
+	size_t m_pending_bytes;
+	size_t m_max_pending_bytes;
+	bool m_stop;
+
+	std::thread m_thread;
+};
+
+#endif // !BATCH_IO_H
@@ -1,10 +1,36 @@
 #include "BitStream.h"
 
 #include <streambuf>
+#include <stdexcept>
 
 using namespace std;
 
 
+// ReadRest
+// Everything left in the stream appended to out
+// In blocks, assigning from istreambuf_iterator went one character at a time
+template <typename Container>
+static void ReadRest(std::istream& in, Container& out)
+{
+	streambuf* buf = in.rdbuf();
+	const size_t begin = out.size();
+
+	// seekable streams are read in one go
+	const streampos cur = buf->pubseekoff(0, ios::cur, ios::in);
+	const streampos end = cur != streampos(-1) ? buf->pubseekoff(0, ios::end, ios::in) : streampos(-1);
+
+	if (end != streampos(-1) && buf->pubseekpos(cur, ios::in) == cur && end > cur)
+	{
+		out.resize(begin + (size_t)(end - cur));
+		out.resize(begin + (size_t)buf->sgetn((char*)&out[begin], end - cur));
+	}
+
+	char block[1 << 14];
+	for (streamsize n; (n = buf->sgetn(block, sizeof(block))) > 0; )
+		out.insert(out.end(), block, block + n);
+}
+
+
 BitStream::BitStream()
 {}
 
@@ -40,7 +66,7 @@ void BitStream::Read(std::istream & in)
 
 
 
-StringBitStream::StringBitStream()
+StringBitStream::StringBitStream() : m_pos(0)
 {}
 
 
@@ -50,13 +76,33 @@ StringBitStream::~StringBitStream()
 
 size_t StringBitStream::size()
 {
-	return m_bits.size();
+	return m_bits.size() - m_pos;
 }
 
 
 bool StringBitStream::empty()
 {
-	return m_bits.empty();
+	return m_pos >= m_bits.size();
+}
+
+
+size_t StringBitStream::bytes(size_t bits)
+{
+	// one character per bit
+	return bits;
+}
+
+
+void StringBitStream::reset()
+{
+	m_bits.clear();
+	m_pos = 0;
+}
+
+
+void StringBitStream::reserve(size_t bits)
+{
+	m_bits.reserve(bits);
 }
 
 
@@ -75,30 +121,29 @@ void StringBitStream::Write(std::ostream& out)
 
 int StringBitStream::Pop()
 {
-	while (!empty() && m_bits[0] != '0' && m_bits[0] != '1')
-		m_bits.erase(m_bits.begin());
+	// bits are consumed by moving a cursor, erasing the front made decoding quadratic
+	while (!empty() && m_bits[m_pos] != '0' && m_bits[m_pos] != '1')
+		++m_pos;
 
 	if (empty())
 		return -1;
 
-	int bit = m_bits[0] - '0';
-	m_bits.erase(m_bits.begin());
-
-	return bit;
+	return m_bits[m_pos++] - '0';
 }
 
 
 void StringBitStream::Read(std::istream& in)
 {
 	m_bits.clear();
-	m_bits.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+	ReadRest(in, m_bits);
+	m_pos = 0;
 }
 
 
 
 
 
-BinaryBitStream::BinaryBitStream()
+BinaryBitStream::BinaryBitStream() : m_acc(0), m_nacc(0), m_size(0), m_pos(0)
 {}
 
 
@@ -108,29 +153,444 @@ BinaryBitStream::~BinaryBitStream()
 
 size_t BinaryBitStream::size()
 {
-	return size_t();
+	return m_size;
 }
 
 
 bool BinaryBitStream::empty()
 {
-	return false;
+	return m_size == 0;
+}
+
+
+size_t BinaryBitStream::bytes(size_t bits)
+{
+	return (bits + 7) / 8;
+}
+
+
+void BinaryBitStream::reset()
+{
+	m_bytes.clear();
+	m_acc = 0;
+	m_nacc = 0;
+	m_size = 0;
+	m_pos = 0;
+}
+
+
+void BinaryBitStream::reserve(size_t bits)
+{
+	m_bytes.reserve(bytes(bits));
 }
 
 
 void BinaryBitStream::Add(const std::string& bits)
+{
+	for (char bit : bits)
+	{
+		if (bit != '0' && bit != '1')
+			continue;
+
+		m_acc = (m_acc << 1) | (unsigned int)(bit - '0');
+		++m_size;
+
+		if (++m_nacc == 8)
+		{
+			m_bytes.push_back((unsigned char)m_acc);
+			m_acc = 0;
+			m_nacc = 0;
+		}
+	}
+}
+
+
+void BinaryBitStream::Write(std::ostream& out)
+{
+	out.write((const char*)m_bytes.data(), m_bytes.size());
+
+	// pad with 0-bits, readers know the number of bits from the header
+	if (m_nacc > 0)
+		out.put((char)(m_acc << (8 - m_nacc)));
+}
+
+
+int BinaryBitStream::Pop()
+{
+	if (m_nacc == 0)
+	{
+		if (m_pos >= m_bytes.size())
+			return -1;
+
+		m_acc = m_bytes[m_pos++];
+		m_nacc = 8;
+	}
+
+	--m_nacc;
+	return (m_acc >> m_nacc) & 1;
+}
+
+
+void BinaryBitStream::Read(std::istream& in)
+{
+	m_bytes.clear();
+	ReadRest(in, m_bytes);
+	m_acc = 0;
+	m_nacc = 0;
+	m_size = m_bytes.size() * 8;
+	m_pos = 0;
+}
+
+
+
+
+
+JFIFBitStream::JFIFBitStream() : m_acc(0), m_nacc(0), m_size(0), m_pos(0)
 {}
 
 
-void BinaryBitStream::Write(std::ostream & out)
+JFIFBitStream::~JFIFBitStream()
 {}
 
 
-int BinaryBitStream::Pop()
+size_t JFIFBitStream::size()
+{
+	return m_size;
+}
+
+
+bool JFIFBitStream::empty()
+{
+	return m_size == 0;
+}
+
+
+size_t JFIFBitStream::bytes(size_t bits)
+{
+	// stuffed zero bytes are not counted
+	return (bits + 7) / 8;
+}
+
+
+void JFIFBitStream::reset()
+{
+	m_bytes.clear();
+	m_acc = 0;
+	m_nacc = 0;
+	m_size = 0;
+	m_pos = 0;
+}
+
+
+void JFIFBitStream::reserve(size_t bits)
+{
+	// room for a few stuffed bytes
+	m_bytes.reserve(bytes(bits) + bytes(bits) / 64);
+}
+
+
+void JFIFBitStream::Add(const std::string& bits)
+{
+	for (char bit : bits)
+	{
+		if (bit != '0' && bit != '1')
+			continue;
+
+		m_acc = (m_acc << 1) | (unsigned int)(bit - '0');
+		++m_size;
+
+		if (++m_nacc == 8)
+		{
+			m_bytes.push_back((unsigned char)m_acc);
+			if (m_acc == 0xFF)
+				m_bytes.push_back(0x00);
+
+			m_acc = 0;
+			m_nacc = 0;
+		}
+	}
+}
+
+
+void JFIFBitStream::Write(std::ostream& out)
+{
+	out.write((const char*)m_bytes.data(), m_bytes.size());
+
+	if (m_nacc > 0)
+	{
+		// pad with 1-bits so the tail can't be taken for a code
+		const unsigned char last = (unsigned char)((m_acc << (8 - m_nacc)) | ((1u << (8 - m_nacc)) - 1));
+		out.put((char)last);
+		if (last == 0xFF)
+			out.put(0x00);
+	}
+}
+
+
+int JFIFBitStream::Pop()
+{
+	if (m_nacc == 0)
+	{
+		if (m_pos >= m_bytes.size())
+			return -1;
+
+		const unsigned char byte = m_bytes[m_pos];
+
+		// 0xFF 0x00 is a stuffed 0xFF, anything else is a marker
+		if (byte == 0xFF)
+		{
+			if (m_pos + 1 >= m_bytes.size() || m_bytes[m_pos + 1] != 0x00)
+				return -1;
+			++m_pos;
+		}
+
+		++m_pos;
+		m_acc = byte;
+		m_nacc = 8;
+	}
+
+	--m_nacc;
+	return (m_acc >> m_nacc) & 1;
+}
+
+
+void JFIFBitStream::Read(std::istream& in)
+{
+	const std::streampos start = in.tellg();
+
+	m_bytes.clear();
+	ReadRest(in, m_bytes);
+	m_acc = 0;
+	m_nacc = 0;
+	m_pos = 0;
+
+	// keep entropy-coded data only, the stream is put back at the marker ending it
+	size_t end = 0;
+	while (end + 1 < m_bytes.size())
+	{
+		if (m_bytes[end] == 0xFF && m_bytes[end + 1] != 0x00 && (m_bytes[end + 1] < 0xD0 || m_bytes[end + 1] > 0xD7))
+			break;
+		end += m_bytes[end] == 0xFF ? 2 : 1;
+	}
+	if (end + 1 >= m_bytes.size())
+		end = m_bytes.size();
+
+	m_bytes.resize(end);
+	m_size = end * 8;
+
+	in.clear();
+	in.seekg(start + (std::streamoff)end);
+}
+
+
+void JFIFBitStream::Restart()
+{
+	m_nacc = 0;
+
+	if (m_pos + 1 >= m_bytes.size() || m_bytes[m_pos] != 0xFF || m_bytes[m_pos + 1] < 0xD0 || m_bytes[m_pos + 1] > 0xD7)
+		throw std::runtime_error("Missing restart marker");
+
+	m_pos += 2;
+}
+
+
+
+
+
+ChunkBitStream::ChunkBitStream(bool binary) : m_binary(binary), m_base(0), m_pos(0), m_starved(false)
+{}
+
+
+ChunkBitStream::~ChunkBitStream()
+{}
+
+
+size_t ChunkBitStream::size()
+{
+	const size_t total = m_binary ? m_data.size() * 8 : m_data.size();
+	return total - m_pos;
+}
+
+
+bool ChunkBitStream::empty()
+{
+	return size() == 0;
+}
+
+
+size_t ChunkBitStream::bytes(size_t bits)
+{
+	return m_binary ? (bits + 7) / 8 : bits;
+}
+
+
+void ChunkBitStream::reset()
+{
+	m_data.clear();
+	m_base = 0;
+	m_pos = 0;
+	m_starved = false;
+}
+
+
+void ChunkBitStream::reserve(size_t bits)
+{
+	m_data.reserve(bytes(bits));
+}
+
+
+void ChunkBitStream::Add(const std::string& bits)
+{
+	throw std::runtime_error("ChunkBitStream is read only");
+}
+
+
+void ChunkBitStream::Write(std::ostream& out)
+{
+	throw std::runtime_error("ChunkBitStream is read only");
+}
+
+
+int ChunkBitStream::Pop()
+{
+	if (m_binary)
+	{
+		if (m_pos >= m_data.size() * 8)
+		{
+			m_starved = true;
+			return -1;
+		}
+
+		const unsigned char byte = (unsigned char)m_data[m_pos / 8];
+		const int bit = (byte >> (7 - m_pos % 8)) & 1;
+		++m_pos;
+		return bit;
+	}
+
+	// characters other than 0 and 1 are skipped like StringBitStream does
+	while (m_pos < m_data.size() && m_data[m_pos] != '0' && m_data[m_pos] != '1')
+		++m_pos;
+
+	if (m_pos >= m_data.size())
+	{
+		m_starved = true;
+		return -1;
+	}
+
+	return m_data[m_pos++] - '0';
+}
+
+
+void ChunkBitStream::Read(std::istream& in)
+{
+	ReadRest(in, m_data);
+}
+
+
+void ChunkBitStream::Append(const char* data, size_t size)
+{
+	m_data.append(data, size);
+}
+
+
+void ChunkBitStream::seek(size_t pos)
+{
+	if (pos < m_base)
+		throw std::runtime_error("Position already discarded");
+
+	m_pos = pos - m_base;
+	m_starved = false;
+}
+
+
+void ChunkBitStream::Discard()
+{
+	// whole bytes only, a partly read byte is kept
+	const size_t n = m_binary ? m_pos / 8 : m_pos;
+
+	m_data.erase(0, n);
+	m_base += m_binary ? n * 8 : n;
+	m_pos -= m_binary ? n * 8 : n;
+}
+
+
+
+
+
+MemoryBitStream::MemoryBitStream(const unsigned char* data, size_t size, bool binary) :
+	m_data(data), m_size(size), m_binary(binary), m_pos(0)
+{}
+
+
+MemoryBitStream::~MemoryBitStream()
+{}
+
+
+size_t MemoryBitStream::size()
+{
+	const size_t total = m_binary ? m_size * 8 : m_size;
+	return total - m_pos;
+}
+
+
+bool MemoryBitStream::empty()
+{
+	return size() == 0;
+}
+
+
+size_t MemoryBitStream::bytes(size_t bits)
 {
-	return -1;
+	return m_binary ? (bits + 7) / 8 : bits;
 }
 
 
-void BinaryBitStream::Read(std::istream & in)
+void MemoryBitStream::reset()
+{
+	m_pos = 0;
+}
+
+
+void MemoryBitStream::reserve(size_t bits)
 {}
+
+
+void MemoryBitStream::Add(const std::string& bits)
+{
+	throw std::runtime_error("MemoryBitStream is read only");
+}
+
+
+void MemoryBitStream::Write(std::ostream& out)
+{
+	throw std::runtime_error("MemoryBitStream is read only");
+}
+
+
+int MemoryBitStream::Pop()
+{
+	if (m_binary)
+	{
+		if (m_pos >= m_size * 8)
+			return -1;
+
+		const int bit = (m_data[m_pos / 8] >> (7 - m_pos % 8)) & 1;
+		++m_pos;
+		return bit;
+	}
+
+	// characters other than 0 and 1 are skipped like StringBitStream does
+	while (m_pos < m_size && m_data[m_pos] != '0' && m_data[m_pos] != '1')
+		++m_pos;
+
+	if (m_pos >= m_size)
+		return -1;
+
+	return m_data[m_pos++] - '0';
+}
+
+
+void MemoryBitStream::Read(std::istream& in)
+{
+	throw std::runtime_error("MemoryBitStream views memory, it does not read streams");
+}
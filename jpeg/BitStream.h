@@ -21,6 +21,14 @@ public:
 	virtual size_t size() = 0;
 	virtual bool empty() = 0;
 
+	// Number of bytes Write() outputs for given number of bits
+	virtual size_t bytes(size_t bits) = 0;
+
+	// Drop all data, capacity is kept for the next use
+	virtual void reset() = 0;
+	// Make room for given number of bits
+	virtual void reserve(size_t bits) = 0;
+
 	////////////////////////////////////////
 	// Encode data to bits container
 	////////////////////////////////////////
@@ -56,6 +64,9 @@ public:
 
 	virtual size_t size();
 	virtual bool empty();
+	virtual size_t bytes(size_t bits);
+	virtual void reset();
+	virtual void reserve(size_t bits);
 
 	virtual void Add(const std::string& bits);
 	virtual void Write(std::ostream& out);
@@ -63,12 +74,17 @@ public:
 	virtual int Pop();
 	virtual void Read(std::istream& in);
 
+	// Bits added so far, one character per bit
+	const std::string& str() const { return m_bits; }
+
 private:
 	std::string m_bits;
+	size_t m_pos; // next character to pop
 };
 
 
 // For real binary file format
+// Bits are packed MSB first and the last byte is padded with 0-bits
 class BinaryBitStream : public BitStream
 {
 public:
@@ -77,6 +93,116 @@ public:
 
 	virtual size_t size();
 	virtual bool empty();
+	virtual size_t bytes(size_t bits);
+	virtual void reset();
+	virtual void reserve(size_t bits);
+
+	virtual void Add(const std::string& bits);
+	virtual void Write(std::ostream& out);
+
+	virtual int Pop();
+	virtual void Read(std::istream& in);
+
+private:
+	std::vector<unsigned char> m_bytes;
+	unsigned int m_acc;  // pending bits not yet forming a byte
+	int m_nacc;          // number of pending bits
+	size_t m_size;       // number of bits added or read
+	size_t m_pos;        // next byte to pop
+};
+
+
+// For JFIF entropy-coded segments
+// Bits are packed MSB first, a 0x00 is stuffed after every 0xFF byte
+// and the last byte is padded with 1-bits
+class JFIFBitStream : public BitStream
+{
+public:
+	JFIFBitStream();
+	virtual ~JFIFBitStream();
+
+	virtual size_t size();
+	virtual bool empty();
+	virtual size_t bytes(size_t bits);
+	virtual void reset();
+	virtual void reserve(size_t bits);
+
+	virtual void Add(const std::string& bits);
+	virtual void Write(std::ostream& out);
+
+	// Pop returns -1 at a marker, Read stops in front of the first marker other than RSTn
+	virtual int Pop();
+	virtual void Read(std::istream& in);
+
+	// Drop the bits left in current byte and step over the RSTn marker
+	void Restart();
+
+private:
+	std::vector<unsigned char> m_bytes;
+	unsigned int m_acc;  // pending bits not yet forming a byte
+	int m_nacc;          // number of pending bits
+	size_t m_size;       // number of bits added
+	size_t m_pos;        // next byte to pop
+};
+
+// For decoding while a file is still being received
+// Received bytes are appended in chunks, they hold bits like BinaryBitStream (binary) or like
+// StringBitStream. Pop returns -1 once the received bits run out and marks the stream starved,
+// a decoder then seeks back to a position taken with tell() and retries when more bits arrived.
+class ChunkBitStream : public BitStream
+{
+public:
+	explicit ChunkBitStream(bool binary);
+	virtual ~ChunkBitStream();
+
+	virtual size_t size();
+	virtual bool empty();
+	virtual size_t bytes(size_t bits);
+	virtual void reset();
+	virtual void reserve(size_t bits);
+
+	// Decoding only, Add and Write throw
+	virtual void Add(const std::string& bits);
+	virtual void Write(std::ostream& out);
+
+	virtual int Pop();
+	// Append everything left in the stream
+	virtual void Read(std::istream& in);
+
+	// Append received bytes
+	void Append(const char* data, size_t size);
+
+	// Position of the next bit, valid across Append and Discard
+	size_t tell() const { return m_base + m_pos; }
+	// Go back to a position taken with tell(), the starved mark is cleared
+	void seek(size_t pos);
+	// Whether a Pop ran out of bits since the last seek
+	bool starved() const { return m_starved; }
+	// Free the bytes before the current position
+	void Discard();
+
+private:
+	bool m_binary;
+	std::string m_data;
+	size_t m_base;    // bits discarded before m_data
+	size_t m_pos;     // next bit in m_data
+	bool m_starved;
+};
+
+// For decoding bytes already in memory, a mapped file or a buffer given to Canvas::Decode
+// Bits are read in place like BinaryBitStream (binary) or StringBitStream does, nothing is copied,
+// the memory must outlive the stream. Decoding only, Add, Write and Read throw.
+class MemoryBitStream : public BitStream
+{
+public:
+	MemoryBitStream(const unsigned char* data, size_t size, bool binary);
+	virtual ~MemoryBitStream();
+
+	virtual size_t size();
+	virtual bool empty();
+	virtual size_t bytes(size_t bits);
+	virtual void reset();
+	virtual void reserve(size_t bits);
 
 	virtual void Add(const std::string& bits);
 	virtual void Write(std::ostream& out);
@@ -85,6 +211,10 @@ public:
 	virtual void Read(std::istream& in);
 
 private:
+	const unsigned char* m_data;
+	size_t m_size;    // bytes
+	bool m_binary;
+	size_t m_pos;     // next bit (binary) or character
 };
 
 #endif // !BYTE_MANAGER_H
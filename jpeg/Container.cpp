@@ -0,0 +1,240 @@
+#include "Container.h"
+
+#include <cstring>
+#include <stdexcept>
+
+namespace jpeg
+{
+namespace container
+{
+using std::vector;
+
+
+// put / get
+// Little-endian field access on a byte buffer
+void put_u8(vector<uint8_t>& buf, size_t pos, uint8_t val)
+{
+	buf[pos] = val;
+}
+
+void put_u16(vector<uint8_t>& buf, size_t pos, uint16_t val)
+{
+	for (size_t i = 0; i < 2; ++i)
+		buf[pos + i] = (uint8_t)(val >> (8 * i));
+}
+
+void put_u32(vector<uint8_t>& buf, size_t pos, uint32_t val)
+{
+	for (size_t i = 0; i < 4; ++i)
+		buf[pos + i] = (uint8_t)(val >> (8 * i));
+}
+
+void put_u64(vector<uint8_t>& buf, size_t pos, uint64_t val)
+{
+	for (size_t i = 0; i < 8; ++i)
+		buf[pos + i] = (uint8_t)(val >> (8 * i));
+}
+
+uint8_t get_u8(const vector<uint8_t>& buf, size_t pos)
+{
+	return buf[pos];
+}
+
+uint16_t get_u16(const vector<uint8_t>& buf, size_t pos)
+{
+	uint16_t val{};
+	for (size_t i = 0; i < 2; ++i)
+		val |= (uint16_t)buf[pos + i] << (8 * i);
+	return val;
+}
+
+uint32_t get_u32(const vector<uint8_t>& buf, size_t pos)
+{
+	uint32_t val{};
+	for (size_t i = 0; i < 4; ++i)
+		val |= (uint32_t)buf[pos + i] << (8 * i);
+	return val;
+}
+
+uint64_t get_u64(const vector<uint8_t>& buf, size_t pos)
+{
+	uint64_t val{};
+	for (size_t i = 0; i < 8; ++i)
+		val |= (uint64_t)buf[pos + i] << (8 * i);
+	return val;
+}
+
+
+// put_table / get_table
+// Huffman table as 16 code counts followed by a fixed number of symbol slots
+void put_table(vector<uint8_t>& buf, size_t pos, const vector<int>& bits, const vector<int>& values, size_t slots)
+{
+	if (bits.size() != 16 || values.size() > slots)
+		throw std::runtime_error("Huffman table does not fit in header");
+
+	for (size_t l = 0; l < 16; ++l)
+		put_u8(buf, pos + l, (uint8_t)bits[l]);
+
+	for (size_t k = 0; k < values.size(); ++k)
+		put_u8(buf, pos + 16 + k, (uint8_t)values[k]);
+}
+
+void get_table(const vector<uint8_t>& buf, size_t pos, vector<int>& bits, vector<int>& values, size_t slots)
+{
+	size_t count{};
+
+	bits.resize(16);
+	for (size_t l = 0; l < 16; ++l)
+	{
+		bits[l] = get_u8(buf, pos + l);
+		count += bits[l];
+	}
+
+	if (count > slots)
+		throw std::runtime_error("Invalid Huffman table in header");
+
+	values.resize(count);
+	for (size_t k = 0; k < count; ++k)
+		values[k] = get_u8(buf, pos + 16 + k);
+}
+
+// min_code_length
+// Length of the shortest code of a table in DHT form, 0 if it has none
+size_t min_code_length(const vector<int>& bits)
+{
+	for (size_t l = 0; l < bits.size(); ++l)
+		if (bits[l] > 0)
+			return l + 1;
+	return 0;
+}
+
+
+//
+//
+void WriteHeader(std::ostream& out, const Header& header)
+{
+	vector<uint8_t> buf(HEADER_SIZE, 0);
+
+	if (header.components.size() > MAX_COMPONENTS)
+		throw std::runtime_error("Too many components");
+
+	uint32_t quality{};
+	std::memcpy(&quality, &header.quality, sizeof(quality));
+
+	put_u32(buf, 0, MAGIC);
+	put_u16(buf, 4, VERSION);
+	put_u16(buf, 6, (uint16_t)HEADER_SIZE);
+	put_u32(buf, 8, header.width);
+	put_u32(buf, 12, header.height);
+	put_u32(buf, 16, quality);
+	put_u8(buf, 20, (uint8_t)header.components.size());
+	put_u8(buf, 21, (uint8_t)header.subsampling);
+	put_u8(buf, 22, (uint8_t)header.format);
+
+	for (size_t c = 0; c < header.components.size(); ++c)
+	{
+		const Component& comp = header.components[c];
+		put_u8(buf, 24 + c * 4 + 0, comp.id);
+		put_u8(buf, 24 + c * 4 + 1, comp.quant_table);
+		put_u8(buf, 24 + c * 4 + 2, comp.dc_table);
+		put_u8(buf, 24 + c * 4 + 3, comp.ac_table);
+	}
+
+	for (size_t t = 0; t < 2; ++t)
+	{
+		if (header.quant[t].size() != 64)
+			throw std::runtime_error("Invalid quantization table");
+
+		for (size_t n = 0; n < 64; ++n)
+			put_u8(buf, 40 + t * 64 + n, (uint8_t)header.quant[t][n]);
+	}
+
+	put_table(buf, 168, header.dc_bits, header.dc_values, MAX_DC_SYMBOLS);
+	put_table(buf, 200, header.ac_bits, header.ac_values, MAX_AC_SYMBOLS);
+
+	put_u64(buf, 380, header.payload_bits);
+	put_u32(buf, 388, header.index_offset);
+	put_u32(buf, 392, header.index_count);
+
+	out.write((const char*)buf.data(), buf.size());
+}
+
+
+//
+//
+Header ReadHeader(std::istream& in)
+{
+	vector<uint8_t> buf(HEADER_SIZE, 0);
+	Header header;
+
+	// single fixed-size read
+	if (!in.read((char*)buf.data(), buf.size()))
+		throw std::runtime_error("Incomplete header");
+
+	if (get_u32(buf, 0) != MAGIC)
+		throw std::runtime_error("Not a MyJPEG file");
+
+	if (get_u16(buf, 4) != VERSION || get_u16(buf, 6) != HEADER_SIZE)
+		throw std::runtime_error("Unsupported file version");
+
+	uint32_t quality = get_u32(buf, 16);
+	std::memcpy(&header.quality, &quality, sizeof(quality));
+
+	header.width = get_u32(buf, 8);
+	header.height = get_u32(buf, 12);
+	header.subsampling = (Subsampling)get_u8(buf, 21);
+	header.format = (PayloadFormat)get_u8(buf, 22);
+
+	const size_t n_comp = get_u8(buf, 20);
+	if (n_comp > MAX_COMPONENTS)
+		throw std::runtime_error("Too many components");
+
+	for (size_t c = 0; c < n_comp; ++c)
+	{
+		header.components.push_back({
+			get_u8(buf, 24 + c * 4 + 0),
+			get_u8(buf, 24 + c * 4 + 1),
+			get_u8(buf, 24 + c * 4 + 2),
+			get_u8(buf, 24 + c * 4 + 3), });
+	}
+
+	for (size_t t = 0; t < 2; ++t)
+	{
+		header.quant[t].resize(64);
+		for (size_t n = 0; n < 64; ++n)
+			header.quant[t][n] = get_u8(buf, 40 + t * 64 + n);
+	}
+
+	get_table(buf, 168, header.dc_bits, header.dc_values, MAX_DC_SYMBOLS);
+	get_table(buf, 200, header.ac_bits, header.ac_values, MAX_AC_SYMBOLS);
+
+	header.payload_bits = get_u64(buf, 380);
+	header.index_offset = get_u32(buf, 388);
+	header.index_count = get_u32(buf, 392);
+
+	const uint64_t nbw = ((uint64_t)header.width + 7) / 8;
+	const uint64_t nbh = ((uint64_t)header.height + 7) / 8;
+
+	if (nbw == 0 || nbh == 0 || nbw * nbh > MAX_BLOCKS)
+		throw std::runtime_error("Invalid image size");
+
+	// each channel of each block takes one DC code and at least one AC code
+	const size_t dc_length = min_code_length(header.dc_bits);
+	const size_t ac_length = min_code_length(header.ac_bits);
+
+	if (dc_length == 0 || ac_length == 0)
+		throw std::runtime_error("Invalid Huffman table in header");
+
+	if (header.payload_bits < nbw * nbh * n_comp * (dc_length + ac_length))
+		throw std::runtime_error("Payload too short for the image");
+
+	return header;
+}
+
+uint64_t PayloadBytes(const Header& header)
+{
+	// text payloads take one character per bit
+	return header.format == PayloadFormat::Binary ? (header.payload_bits + 7) / 8 : header.payload_bits;
+}
+}
+}
@@ -0,0 +1,97 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#ifdef UNIT_TEST_FLAG
+#include "Container.cpp"
+#endif
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+
+namespace jpeg
+{
+namespace container
+{
+// File layout: [ header (fixed size) ] [ payload ] [ index (optional) ]
+//
+// Header layout, integers are little-endian:
+//   0  u32  magic "MJPG"
+//   4  u16  version
+//   6  u16  header size
+//   8  u32  width
+//  12  u32  height
+//  16  f32  quality (IEEE-754 bits)
+//  20  u8   number of components
+//  21  u8   chroma subsampling filter applied before DCT
+//  22  u8   payload format
+//  23  u8   reserved
+//  24  4 x  component: id, quant table, DC table, AC table
+//  40  2 x  64 u8 quant steps in natural order (luma, chroma)
+// 168  u8   DC table: 16 code counts + 16 symbols
+// 200  u8   AC table: 16 code counts + 162 symbols
+// 378  u16  reserved
+// 380  u64  payload size in bits
+// 388  u32  index offset in bytes from start of file (0: no index)
+// 392  u32  number of index entries
+
+constexpr uint32_t MAGIC = 0x47504A4D; // "MJPG"
+constexpr uint16_t VERSION = 1;
+constexpr size_t HEADER_SIZE = 396;
+
+constexpr size_t MAX_COMPONENTS = 4;
+constexpr uint64_t MAX_BLOCKS = 1 << 22; // 8x8 blocks of an image, coef indices of the codec are int
+constexpr size_t MAX_DC_SYMBOLS = 16;
+constexpr size_t MAX_AC_SYMBOLS = 162;
+
+enum class Subsampling : uint8_t
+{
+	S444 = 0,
+	S422 = 1,
+	S420 = 2,
+};
+
+enum class PayloadFormat : uint8_t
+{
+	Text = 0,   // one '0'/'1' character per bit (StringBitStream)
+	Binary = 1, // bits packed MSB first
+};
+
+struct Component
+{
+	uint8_t id;
+	uint8_t quant_table;
+	uint8_t dc_table;
+	uint8_t ac_table;
+};
+
+struct Header
+{
+	uint32_t width{};
+	uint32_t height{};
+	float quality{};
+
+	Subsampling subsampling{ Subsampling::S420 };
+	PayloadFormat format{ PayloadFormat::Text };
+	std::vector<Component> components;
+
+	std::vector<int> quant[2];            // luma, chroma
+	std::vector<int> dc_bits, dc_values;  // DHT form
+	std::vector<int> ac_bits, ac_values;  // DHT form
+
+	uint64_t payload_bits{};
+	uint32_t index_offset{};
+	uint32_t index_count{};
+};
+
+void WriteHeader(std::ostream& out, const Header& header);
+// Throws unless the image size is within MAX_BLOCKS and payload_bits can hold a code for every
+// channel of every block, so readers may allocate for the image once the payload is there
+Header ReadHeader(std::istream& in);
+
+// Bytes taken by the payload_bits of header
+uint64_t PayloadBytes(const Header& header);
+}
+}
+
+#endif // !CONTAINER_H
@@ -1,33 +1,290 @@
 #include "Engine.h"
 #include "jpeg.h"
+#include "Container.h"
+#include "Jfif.h"
+#include "ThreadPool.h"
+#include "SpscQueue.h"
+#include "BatchIO.h"
+#include "MappedFile.h"
+#include "MemoryBuffer.h"
+#include "OutputSink.h"
 
 #include <iostream>
-#include <sstream>
 #include <fstream>
+#include <sstream>
 #include <cassert>
 #include <cstdio>
 #include <vector>
 #include <functional>
 #include <stdexcept>
+#include <cmath>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <exception>
 
 #include <omp.h>
 
 using namespace std;
 
-#define DEBUG
+static std::atomic<bool> g_engine_log(false);
+
+void SetEngineLog(bool enabled)
+{
+	g_engine_log = enabled;
+}
 
 void DisplayModuleWallTime(const string& info)
 {
-#ifdef DEBUG
-	static double last = omp_get_wtime();
+	if (!g_engine_log)
+		return;
+
+	static thread_local double last = omp_get_wtime();
 	double curr = omp_get_wtime();
-	printf("%s: %lf\n", info.c_str(), curr - last);
+	clog << info << ": " << curr - last << endl;
 	last = curr;
-#endif // DEBUG
 }
 
 
-Canvas::Canvas() : m_Pixels(nullptr), m_stream(nullptr)
+// TransformBlock
+// Forward DCT of a channel with the selected method, output is scaled for QuantTable::Forward
+void TransformBlock(vector<float>& blocks, size_t block_id, size_t channel, const EncodeOptions& options)
+{
+	if (options.dct == DCTMethod::Exact)
+		jpeg::dct::ScaledForwardTransform8x8(blocks, block_id, channel);
+	else
+		jpeg::dct::FastForwardTransform8x8(blocks, block_id, channel);
+}
+
+
+// QuantizeBlock
+// Quantize a channel of DCT coefs with the selected method
+void QuantizeBlock(
+	vector<float>& blocks,
+	size_t block_id,
+	size_t channel,
+	const jpeg::util::QuantTable& table,
+	const EncodeOptions& options)
+{
+	if (options.trellis)
+		jpeg::util::TrellisQuantizeZigzag(blocks, block_id, channel, table, options.lambda);
+	else
+		jpeg::util::QuantizeZigzag(blocks, block_id, channel, table.Forward(channel));
+}
+
+
+// EdgeIndex
+// Pixel rows or columns of a block, past the image edge they repeat the edge one
+void EdgeIndex(size_t first, size_t size, size_t index[8])
+{
+	for (size_t k = 0; k < 8; ++k)
+		index[k] = first + k < size ? first + k : size - 1;
+}
+
+
+// GatherPacked
+// One block of pixels of N bytes with channels at byte R, G, B, A, no alpha if A < 0
+// Block Format: [ <== 256 bytes ==> ]
+// [C0 C1 C2 C3] x64, channels of a pixel interleaved
+template <size_t N, size_t R, size_t G, size_t B, int A>
+void GatherPacked(const PixelView& pixels, vector<float>& blocks, const size_t rows[8], const size_t cols[8], size_t block_id)
+{
+	float* out = &blocks[block_id * 256];
+
+	for (size_t ii = 0; ii < 8; ++ii)
+	{
+		const uint8_t* row = pixels.planes[0] + rows[ii] * pixels.strides[0];
+
+		for (size_t jj = 0; jj < 8; ++jj, out += 4)
+		{
+			const uint8_t* p = row + cols[jj] * N;
+
+			out[0] = p[R];
+			out[1] = p[G];
+			out[2] = p[B];
+			out[3] = A < 0 ? 255.f : p[A < 0 ? 0 : A];
+		}
+	}
+}
+
+
+// GatherGray
+// One block of gray pixels, already Y of YCC
+void GatherGray(const PixelView& pixels, vector<float>& blocks, const size_t rows[8], const size_t cols[8], size_t block_id)
+{
+	float* out = &blocks[block_id * 256];
+
+	for (size_t ii = 0; ii < 8; ++ii)
+	{
+		const uint8_t* row = pixels.planes[0] + rows[ii] * pixels.strides[0];
+
+		for (size_t jj = 0; jj < 8; ++jj, out += 4)
+		{
+			out[0] = row[cols[jj]];
+			out[1] = 128.f;
+			out[2] = 128.f;
+			out[3] = 255.f;
+		}
+	}
+}
+
+
+// GatherYUV
+// One block of Y, U, V planes, already YCC, chroma planes are smaller by 1 << shift
+template <size_t shift>
+void GatherYUV(const PixelView& pixels, vector<float>& blocks, const size_t rows[8], const size_t cols[8], size_t block_id)
+{
+	float* out = &blocks[block_id * 256];
+
+	for (size_t ii = 0; ii < 8; ++ii)
+	{
+		const uint8_t* y = pixels.planes[0] + rows[ii] * pixels.strides[0];
+		const uint8_t* u = pixels.planes[1] + (rows[ii] >> shift) * pixels.strides[1];
+		const uint8_t* v = pixels.planes[2] + (rows[ii] >> shift) * pixels.strides[2];
+
+		for (size_t jj = 0; jj < 8; ++jj, out += 4)
+		{
+			out[0] = y[cols[jj]];
+			out[1] = u[cols[jj] >> shift];
+			out[2] = v[cols[jj] >> shift];
+			out[3] = 255.f;
+		}
+	}
+}
+
+
+// PrepareBlock
+// Pixels => one block of YCC channels ready for DCT
+// Block Format: [ <== 256 bytes ==> ]
+// [C0 x64] [C1 x64] [C2 x64] [C3 x64]
+void PrepareBlock(const PixelView& pixels, vector<float>& blocks, int nbw, size_t block_id)
+{
+	const size_t bi = block_id / nbw, bj = block_id % nbw;
+
+	size_t rows[8], cols[8];
+	EdgeIndex(bi * 8, pixels.height, rows);
+	EdgeIndex(bj * 8, pixels.width, cols);
+
+	// the format is picked once per block, kernels run without branching on it
+	switch (pixels.format)
+	{
+	case PixelFormat::RGBA:   GatherPacked<4, 0, 1, 2, 3>(pixels, blocks, rows, cols, block_id); break;
+	case PixelFormat::BGRA:   GatherPacked<4, 2, 1, 0, 3>(pixels, blocks, rows, cols, block_id); break;
+	case PixelFormat::RGB24:  GatherPacked<3, 0, 1, 2, -1>(pixels, blocks, rows, cols, block_id); break;
+	case PixelFormat::Gray8:  GatherGray(pixels, blocks, rows, cols, block_id); break;
+	case PixelFormat::YUV420: GatherYUV<1>(pixels, blocks, rows, cols, block_id); break;
+	case PixelFormat::YUV444: GatherYUV<0>(pixels, blocks, rows, cols, block_id); break;
+	}
+
+	// gray and YUV are YCC already
+	if (pixels.format != PixelFormat::Gray8 && pixels.format != PixelFormat::YUV420 && pixels.format != PixelFormat::YUV444)
+		jpeg::util::RGB2YCC(blocks, block_id);
+
+	// Union same channel in buffer
+	jpeg::util::UnionChannels(blocks, block_id);
+
+	// Down sampling (no significant effect on compress ratio)
+	jpeg::util::DownSampling420(blocks, block_id, 1);
+	jpeg::util::DownSampling420(blocks, block_id, 2);
+}
+
+// w x h RGBA pixels, rows packed
+void PrepareBlock(const unsigned char* pixels, int w, int h, vector<float>& blocks, int nbw, size_t block_id)
+{
+	PrepareBlock(PixelView(PixelFormat::RGBA, pixels, w, h), blocks, nbw, block_id);
+}
+
+
+// HeaderJPEG
+// Everything a reader needs to configure decoding of the coded stream
+jpeg::container::Header HeaderJPEG(int w, int h, const jpeg::util::QuantTable& table, size_t payload_bits)
+{
+	jpeg::container::Header header;
+
+	header.width = w;
+	header.height = h;
+	header.quality = table.quality;
+
+	// chroma is averaged in place by DownSampling420, blocks keep full size
+	header.subsampling = jpeg::container::Subsampling::S420;
+
+	// the context codes into a StringBitStream
+	header.format = jpeg::container::PayloadFormat::Text;
+
+	// Y, Cb, Cr, A
+	header.components = { { 0, 0, 0, 0 }, { 1, 1, 0, 0 }, { 2, 1, 0, 0 }, { 3, 0, 0, 0 } };
+
+	header.quant[0] = table.divisors[0];
+	header.quant[1] = table.divisors[1];
+
+	const jpeg::huffman_coding::HuffmanTable& dc_table = jpeg::huffman_coding::DefaultTable_DC();
+	const jpeg::huffman_coding::HuffmanTable& ac_table = jpeg::huffman_coding::DefaultTable_AC();
+
+	header.dc_bits = dc_table.bits;
+	header.dc_values = dc_table.values;
+	header.ac_bits = ac_table.bits;
+	header.ac_values = ac_table.values;
+
+	header.payload_bits = payload_bits;
+
+	return header;
+}
+
+
+// EncodeBlocks
+// Huffman coding of quantized blocks into out
+void EncodeBlocks(const vector<float>& blocks, BitStream* out)
+{
+	const size_t n = blocks.size() / 256;
+	vector<int> prev_dc_coef(4, 0);
+
+	for (size_t b = 0; b < n; ++b)
+		for (size_t c = 0; c < 4; ++c)
+			jpeg::huffman_coding::EncodeBlock(blocks, b, c, prev_dc_coef[c], out);
+}
+
+
+PixelView::PixelView(PixelFormat format, const void* data, int width, int height, size_t stride)
+	: format(format), width(width), height(height)
+{
+	const size_t bytes = format == PixelFormat::Gray8 ? 1 : format == PixelFormat::RGB24 ? 3 : 4;
+
+	planes[0] = (const uint8_t*)data;
+	strides[0] = stride ? stride : (size_t)width * bytes;
+}
+
+PixelView::PixelView(PixelFormat format, const void* y, const void* u, const void* v, int width, int height, size_t y_stride, size_t uv_stride)
+	: format(format), width(width), height(height)
+{
+	const size_t chroma_width = format == PixelFormat::YUV420 ? ((size_t)width + 1) / 2 : (size_t)width;
+
+	planes[0] = (const uint8_t*)y;
+	planes[1] = (const uint8_t*)u;
+	planes[2] = (const uint8_t*)v;
+	strides[0] = y_stride ? y_stride : (size_t)width;
+	strides[1] = strides[2] = uv_stride ? uv_stride : chroma_width;
+}
+
+EncoderContext::EncoderContext() : m_stream(new StringBitStream)
+{}
+
+void EncoderContext::reset()
+{
+	m_stream->reset();
+}
+
+// reserve
+// Rough code size growing with log of quality, the capacity left by earlier saves is kept if larger
+void EncoderContext::reserve(int w, int h, float quality)
+{
+	const float bits_per_pixel = 1.f + std::log2(1.f + (quality > 0.f ? quality : 0.f));
+
+	m_stream->reserve((size_t)(w * h * bits_per_pixel));
+}
+
+
+Canvas::Canvas() : m_width(0), m_height(0), m_Pixels(nullptr), m_max_pixels(0), m_shared_context(false), m_coefs_lambda(0.f), m_coefs_dct(DCTMethod::Fast)
 {}
 
 Canvas::~Canvas()
@@ -40,14 +297,18 @@ bool Canvas::Init(int w, int h)
 	m_width = w;
 	m_height = h;
 
+	if (m_Pixels)
+		freePixel();
+
 	allocPixel(w, h);
 	if (!m_Pixels)
-		throw std::exception("Bad alloc");
+		throw std::runtime_error("Bad alloc");
+
+	m_coefs.clear();
 
-	// choose one stream
-	m_stream = new StringBitStream;
-	if (!m_stream)
-		throw std::exception("Bad alloc");
+	// kept across Init calls, so is its capacity
+	if (!m_context)
+		m_context = std::make_shared<EncoderContext>();
 
 	return true;
 }
@@ -59,11 +320,23 @@ void Canvas::Free()
 		freePixel();
 	}
 
-	if (m_stream)
-	{
-		delete m_stream;
-		m_stream = nullptr;
-	}
+	m_width = 0;
+	m_height = 0;
+
+	// coefs kept for re-saving take several times the size of the pixels
+	vector<float>().swap(m_coefs);
+	vector<bool>().swap(m_changed);
+	vector<string>().swap(m_segments);
+
+	// a context of the caller may be shared with other canvases
+	if (!m_shared_context)
+		m_context.reset();
+}
+
+void Canvas::SetEncoderContext(std::shared_ptr<EncoderContext> context)
+{
+	m_shared_context = context != nullptr;
+	m_context = context ? context : std::make_shared<EncoderContext>();
 }
 
 bool Canvas::allocPixel(int w, int h)
@@ -100,12 +373,25 @@ void Canvas::EditPixel(
 			m_Pixels[offset + 3] = color[3];
 		}
 	}
+
+	// blocks covering the edited rectangle
+	if (!m_coefs.empty())
+	{
+		const int nbw = w % 8 == 0 ? w / 8 : w / 8 + 1;
+
+		for (int bi = sy / 8; bi <= ey / 8; ++bi)
+			for (int bj = sx / 8; bj <= ex / 8; ++bj)
+				m_changed[bi * nbw + bj] = true;
+	}
 }
 
 void Canvas::SetAllPixels(std::vector<unsigned char>&& color)
 {
 	const int w = m_width;
 	const int h = m_height;
+
+	// every block changes
+	m_changed.assign(m_changed.size(), true);
 	for (int i = 0; i < h; ++i)
 	{
 		for (int j = 0; j < w; ++j)
@@ -127,6 +413,9 @@ void Canvas::SetAllPixels(
 	const int w = m_width;
 	const int h = m_height;
 
+	// every block changes
+	m_changed.assign(m_changed.size(), true);
+
 	for (int i = 0; i < h; ++i)
 	{
 		for (int j = 0; j < w; ++j)
@@ -150,6 +439,9 @@ void Canvas::SetAllPixels(
 	const int w = m_width;
 	const int h = m_height;
 
+	// every block changes
+	m_changed.assign(m_changed.size(), true);
+
 	for (int i = 0; i < h; ++i)
 	{
 		for (int j = 0; j < w; ++j)
@@ -165,191 +457,261 @@ void Canvas::SetAllPixels(
 	}
 }
 
+void Canvas::SetAllPixels(const unsigned char* rgba)
+{
+	// every block changes
+	m_changed.assign(m_changed.size(), true);
+
+	std::copy_n(rgba, m_width * m_height * 4, m_Pixels);
+}
+
 bool Canvas::SaveAsJPEG(const string& filename, float quality)
 {
-	fstream fs(filename, ios::out);
-	if (!fs) throw std::exception("File missing");
+	EncodeOptions options;
+	options.quality = quality;
+
+	return SaveAsJPEG(filename, options);
+}
+
+bool Canvas::SaveAsJPEG(const string& filename, const EncodeOptions& options)
+{
+	fstream fs(filename, ios::out | ios::binary);
+	if (!fs) throw std::runtime_error("File missing");
 
-	// write image config to file header
-	string config = to_string(m_width) + " " + to_string(m_height) + " " + to_string(quality);
-	fs << config << endl;
+	if (g_engine_log)
+		clog << "Save image to: " << filename << endl;
 
-	// jpeg code
-	writeCodeJPEG(quality);
+	return SaveAsJPEG(fs, options);
+}
+
+bool Canvas::SaveAsJPEG(ostream& out, const EncodeOptions& options)
+{
+	const jpeg::util::QuantTable& table = jpeg::util::GetQuantTable(options.quality);
+
+	// code of the previous save is dropped, its buffer is reused
+	m_context->reset();
+	m_context->reserve(m_width, m_height, options.quality);
+
+	if (options.threads > 0)
+	{
+		pipeCodeJPEG(table, options, out);
+	}
+	else
+	{
+		// jpeg code
+		writeCodeJPEG(table, options);
 
-	// save encoded stuff to file or buffer
-	m_stream->Write(fs);
+		// write image config to file header
+		jpeg::container::WriteHeader(out, headerJPEG(table));
+
+		// save encoded stuff to file or buffer
+		m_context->stream()->Write(out);
+	}
 
 	// calculate compress ratio
-	cout << "Save image to: " << filename << endl;
-	cout << "Compress ratio: " << (float)(m_width * m_height * 4) * 8.f / (float)m_stream->size() << endl;
+	if (g_engine_log)
+		clog << "Compress ratio: " << (float)(m_width * m_height * 4) * 8.f / (float)m_context->stream()->size() << endl;
 
 	return true;
 }
 
-// writeCodeJPEG
-//
-void Canvas::writeCodeJPEG(float quality)
+bool Canvas::SaveAsJPEG(OutputSink& out, const EncodeOptions& options)
 {
-	const int w = m_width;
-	const int h = m_height;
+	if (options.threads > 0)
+	{
+		// the pipeline writes rows as they are coded, the size is not known up front
+		SinkBuffer buffer(out);
+		ostream os(&buffer);
+		os.exceptions(ios::badbit);
 
-	const int nbw = w % 8 == 0 ? w / 8 : w / 8 + 1;
-	const int nbh = h % 8 == 0 ? h / 8 : h / 8 + 1;
+		SaveAsJPEG(os, options);
+		os.flush();
 
-	vector<float> blocks(nbw * nbh * 256, 0.f);
-	vector<int> prev_dc_coef(4, 0);
+		return true;
+	}
 
-	DisplayModuleWallTime("");
+	const jpeg::util::QuantTable& table = jpeg::util::GetQuantTable(options.quality);
 
-	// divide pixels into 8x8 blocks
-	// original image => continuous [64 pixels] (256 bytes for 4 channels) in memory
+	m_context->reset();
+	m_context->reserve(m_width, m_height, options.quality);
 
-	//for (size_t i = 0; i < nbh; ++i)
-	//	for (size_t j = 0; j < nbw; ++j)
-	//		for (size_t l = 0; l < 8; ++l)
-	//			for (size_t e = 0; e < 32; ++e)
-	//				blocks[(i *nbw + j) * 256 + l * 32 + e] = m_Pixels[((i * 8 + l) *w + j * 8) * 4 + e];
+	writeCodeJPEG(table, options);
+
+	BitStream* stream = m_context->stream();
+	out.Reserve(jpeg::container::HEADER_SIZE + stream->bytes(stream->size()));
 
-	for (size_t i = 0; i < h; ++i)
 	{
-		for (size_t j = 0; j < w; ++j)
-		{
-			const size_t bi = i / 8, bj = j / 8;
-			const size_t ii = i - 8 * bi, jj = j - 8 * bj;
-			for (size_t c = 0; c < 4; ++c)
-				blocks[((bi * nbw + bj) * 64 + (ii * 8 + jj)) * 4 + c] = m_Pixels[(i*w + j) * 4 + c];
-		}
+		// the header is gathered, the code goes to the sink in one piece
+		SinkBuffer buffer(out);
+		ostream os(&buffer);
+		os.exceptions(ios::badbit);
+
+		jpeg::container::WriteHeader(os, headerJPEG(table));
+		stream->Write(os);
+		os.flush();
 	}
 
-	// edge compensation
+	if (g_engine_log)
+		clog << "Compress ratio: " << (float)(m_width * m_height * 4) * 8.f / (float)stream->size() << endl;
 
-	for (size_t i = 0; i < h; ++i)
-	{
-		for (size_t j = w; j < nbw * 8; ++j)
-		{
-			const size_t bi = i / 8, bj = j / 8;
-			const size_t ii = i - 8 * bi, jj = j - 8 * bj;
+	return true;
+}
 
-			// how to deal with edge filling
-			const size_t ej = w - 1;
+// SaveAsJPEG
+// Pixels read in place => file, through the canvas buffers
+// m_coefs is only scratch here, it is left empty so the next save of the canvas starts over
+bool Canvas::SaveAsJPEG(const PixelView& pixels, OutputSink& out, const EncodeOptions& options)
+{
+	const bool yuv = pixels.format == PixelFormat::YUV420 || pixels.format == PixelFormat::YUV444;
 
-			for (size_t c = 0; c < 4; ++c)
-				blocks[((bi * nbw + bj) * 64 + (ii * 8 + jj)) * 4 + c] = m_Pixels[(i*w + ej) * 4 + c];
-		}
-	}
+	if (pixels.width <= 0 || pixels.height <= 0 || !pixels.planes[0] || (yuv && (!pixels.planes[1] || !pixels.planes[2])))
+		throw std::runtime_error("Invalid image");
+
+	const jpeg::util::QuantTable& table = jpeg::util::GetQuantTable(options.quality);
+
+	const int nbw = pixels.width % 8 == 0 ? pixels.width / 8 : pixels.width / 8 + 1;
+	const int nbh = pixels.height % 8 == 0 ? pixels.height / 8 : pixels.height / 8 + 1;
 
-	for (size_t i = h; i < nbh * 8; ++i)
+	if (!m_context)
+		m_context = std::make_shared<EncoderContext>();
+
+	m_context->reset();
+	m_context->reserve(pixels.width, pixels.height, options.quality);
+
+	DisplayModuleWallTime("");
+
+	m_coefs.assign((size_t)nbw * nbh * 256, 0.f);
+
+	for (size_t b = 0; b < (size_t)nbw * nbh; ++b)
 	{
-		for (size_t j = 0; j < nbw * 8; ++j)
+		PrepareBlock(pixels, m_coefs, nbw, b);
+
+		for (size_t c = 0; c < 4; ++c)
 		{
-			const size_t bi = i / 8, bj = j / 8;
-			const size_t ii = i - 8 * bi, jj = j - 8 * bj;
+			TransformBlock(m_coefs, b, c, options);
+			QuantizeBlock(m_coefs, b, c, table, options);
+		}
+	}
 
-			// how to deal with edge filling
-			const size_t ei = h - 1;
+	DisplayModuleWallTime("Gathering pixels, DCT and quantization");
 
-			for (size_t c = 0; c < 4; ++c)
-				blocks[((bi * nbw + bj) * 64 + (ii * 8 + jj)) * 4 + c] = m_Pixels[(ei*w + j) * 4 + c];
-		}
+	BitStream* stream = m_context->stream();
+	EncodeBlocks(m_coefs, stream);
+	m_coefs.clear();
+
+	DisplayModuleWallTime("Coding");
+
+	out.Reserve(jpeg::container::HEADER_SIZE + stream->bytes(stream->size()));
+
+	{
+		SinkBuffer buffer(out);
+		ostream os(&buffer);
+		os.exceptions(ios::badbit);
+
+		jpeg::container::WriteHeader(os, HeaderJPEG(pixels.width, pixels.height, table, stream->size()));
+		stream->Write(os);
+		os.flush();
 	}
 
-	DisplayModuleWallTime("Dividing image into blocks");
+	if (g_engine_log)
+		clog << "Compress ratio: " << (float)((size_t)pixels.width * pixels.height * 4) * 8.f / (float)stream->size() << endl;
 
-	// RGB to YCrCb
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			jpeg::util::RGB2YCC(blocks, i*nbw + j);
+	return true;
+}
 
-	DisplayModuleWallTime("RGB to YCC");
+bool Canvas::EncodeToBuffer(vector<uint8_t>& out, const EncodeOptions& options)
+{
+	out.clear();
 
-	// Union same channel in buffer
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			jpeg::util::UnionChannels(blocks, i * nbw + j);
+	VectorSink sink(out);
+	return SaveAsJPEG(sink, options);
+}
 
-	DisplayModuleWallTime("Unioning channels");
+bool Canvas::SaveAsJPEGTargetSize(const string& filename, size_t bytes)
+{
+	return SaveAsJPEGTargetSize(filename, bytes, EncodeOptions());
+}
 
-	// Block Format: [ <== 256 bytes ==> ]
-	// [C0 x64] [C1 x64] [C2 x64] [C3 x64]
+// SaveAsJPEGTargetSize
+// Pick the highest quality whose file fits in given bytes and encode once
+// DCT runs once, candidates are only requantized and their code length summed up
+bool Canvas::SaveAsJPEGTargetSize(const string& filename, size_t bytes, const EncodeOptions& options)
+{
+	fstream fs(filename, ios::out | ios::binary);
+	if (!fs) throw std::runtime_error("File missing");
 
-	// Down sampling (no significant effect on compress ratio)
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-		{
-			jpeg::util::DownSampling420(blocks, i * nbw + j, 1);
-			jpeg::util::DownSampling420(blocks, i * nbw + j, 2);
-		}
+	const size_t nbw = m_width % 8 == 0 ? m_width / 8 : m_width / 8 + 1;
+	const size_t nbh = m_height % 8 == 0 ? m_height / 8 : m_height / 8 + 1;
 
-	DisplayModuleWallTime("Down sampling 4:2:0");
+	vector<float> coefs(nbw * nbh * 256, 0.f), blocks;
 
-	// DCT
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			for (size_t c = 0; c < 4; ++c)
-				jpeg::dct::ForwardTransform8x8(blocks, i * nbw + j, c);
+	prepareCodeJPEG(coefs, nbw, nbh);
+
+	for (size_t b = 0; b < nbw * nbh; ++b)
+		for (size_t c = 0; c < 4; ++c)
+			TransformBlock(coefs, b, c, options);
 
 	DisplayModuleWallTime("DCT");
 
-	// Quantize
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			for (size_t c = 0; c < 4; ++c)
-				jpeg::util::Quantize(blocks, i * nbw + j, c, quality);
+	// binary search on log scale of quality
+	// tables of arbitrary candidates are not cached, the chosen one neither
+	EncodeOptions candidate = options;
+	float lo = log(.1f), hi = log(100.f);
 
-	DisplayModuleWallTime("Quantization");
+	for (int iter = 0; iter < 12; ++iter)
+	{
+		const float mid = .5f * (lo + hi);
+		candidate.quality = exp(mid);
 
-	// Zigzag
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			for (size_t c = 0; c < 4; ++c)
-				jpeg::util::Zigzag(blocks, i * nbw + j, c);
+		jpeg::util::QuantTable table(candidate.quality);
 
-	DisplayModuleWallTime("Zigzaging");
+		blocks = coefs;
+		quantizeCodeJPEG(blocks, table, candidate);
 
-	// Huffman coding
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			for (size_t c = 0; c < 4; ++c)
-				jpeg::huffman_coding::EncodeBlock(blocks, i * nbw + j, c, prev_dc_coef[c], m_stream);
+		const size_t size = jpeg::container::HEADER_SIZE + m_context->stream()->bytes(estimateCodeJPEG(blocks));
 
-	DisplayModuleWallTime("Coding");
-}
+		if (size <= bytes)
+			lo = mid;
+		else
+			hi = mid;
+	}
 
-bool Canvas::ReadAsJPEG(const std::string& filename)
-{
-	string config{};
-	fstream fs(filename, ios::in);
-	if (!fs) throw std::exception("File missing");
+	DisplayModuleWallTime("Searching quality");
 
-	// read file header
-	if (!getline(fs, config))
-		throw std::exception("Incomplete code");
+	candidate.quality = exp(lo);
+	const jpeg::util::QuantTable table(candidate.quality);
 
-	int w, h;
-	float quality;
-	stringstream ss(config);
+	quantizeCodeJPEG(coefs, table, candidate);
 
-	ss >> w >> h >> quality;
+	m_context->reset();
+	m_context->reserve(m_width, m_height, candidate.quality);
 
-	if (w != m_width || h != m_height)
+	encodeCodeJPEG(coefs);
+
+	jpeg::container::WriteHeader(fs, headerJPEG(table));
+	m_context->stream()->Write(fs);
+
+	const size_t size = (size_t)fs.tellp();
+
+	if (g_engine_log)
 	{
-		m_width = w;
-		m_height = h;
-		if (m_Pixels)
-			freePixel();
-		if (!allocPixel(w, h))
-			throw std::exception("Bad alloc");
+		clog << "Save image to: " << filename << endl;
+		clog << "Quality: " << candidate.quality << ", size: " << size << " / " << bytes << endl;
 	}
 
-	m_stream->Read(fs);
-
-	readCodeJPEG(quality);
+	return size <= bytes;
+}
 
-	return 1;
+// headerJPEG
+// Everything a reader needs to configure decoding of the coded stream
+jpeg::container::Header Canvas::headerJPEG(const jpeg::util::QuantTable& table)
+{
+	return HeaderJPEG(m_width, m_height, table, m_context->stream()->size());
 }
 
-void Canvas::readCodeJPEG(float quality)
+// writeCodeJPEG
+//
+void Canvas::writeCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options)
 {
 	const int w = m_width;
 	const int h = m_height;
@@ -357,42 +719,508 @@ void Canvas::readCodeJPEG(float quality)
 	const int nbw = w % 8 == 0 ? w / 8 : w / 8 + 1;
 	const int nbh = h % 8 == 0 ? h / 8 : h / 8 + 1;
 
-	vector<float> blocks(nbw * nbh * 256, 0.f);
-	vector<int> prev_dc_coef(4, 0);
-
 	DisplayModuleWallTime("");
 
-	// Huffman decoding
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			for (size_t c = 0; c < 4; ++c)
-				jpeg::huffman_coding::DecodeBlock(blocks, i * nbw + j, c, prev_dc_coef[c], m_stream);
+	if (!reuseCodeJPEG(table, options))
+		resetCodeJPEG(table, options);
 
-	DisplayModuleWallTime("Decoding");
+	transformCodeJPEG(table, options, nbw, 0, nbw * nbh);
+	m_changed.assign(m_changed.size(), false);
 
-	// Unzigzag
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			for (size_t c = 0; c < 4; ++c)
-				jpeg::util::Unzigzag(blocks, i * nbw + j, c);
+	DisplayModuleWallTime("RGB to YCC, DCT and quantization");
 
-	DisplayModuleWallTime("Unigzaging");
+	spliceCodeJPEG();
+}
 
-	// Dequantize
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			for (size_t c = 0; c < 4; ++c)
-				jpeg::util::Dequantize(blocks, i * nbw + j, c, quality);
+// pipeCodeJPEG
+// writeCodeJPEG + file writing as a pipeline over rows of blocks
+// options.threads transform workers take every n-th row, each feeds its own SPSC queue so rows
+// reach the coder in order. Code of each row goes through another queue to the calling thread,
+// which writes it. The header takes the number of coded bits and is rewritten at the end when out
+// can seek, otherwise the code is held back until the header is known.
+void Canvas::pipeCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options, ostream& out)
+{
+	const int w = m_width;
+	const int h = m_height;
 
-	DisplayModuleWallTime("Dequantization");
+	const size_t nbw = w % 8 == 0 ? w / 8 : w / 8 + 1;
+	const size_t nbh = h % 8 == 0 ? h / 8 : h / 8 + 1;
 
-	// Inverse DCT
-	for (size_t i = 0; i < nbh; ++i)
-		for (size_t j = 0; j < nbw; ++j)
-			for (size_t c = 0; c < 4; ++c)
-				jpeg::dct::InverseTransform8x8(blocks, i * nbw + j, c);
+	DisplayModuleWallTime("");
+
+	if (!reuseCodeJPEG(table, options))
+		resetCodeJPEG(table, options);
+
+	const size_t n_workers = (size_t)options.threads;
+	const size_t depth = 16;
+
+	vector<std::unique_ptr<SpscQueue<size_t> > > transformed;
+	for (size_t k = 0; k < n_workers; ++k)
+		transformed.emplace_back(new SpscQueue<size_t>(depth));
+
+	SpscQueue<string> coded(depth);
+
+	// the first exception of any stage stops the others and is rethrown here once they are joined
+	std::atomic<bool> failed(false);
+	std::exception_ptr error;
+	std::mutex error_mutex;
+
+	auto fail = [&]() {
+		std::lock_guard<std::mutex> lock(error_mutex);
+		if (!error)
+			error = std::current_exception();
+		failed = true;
+	};
+
+	// Stage threads, joined however pipeCodeJPEG is left
+	// Leaving early stops them first, they would wait on queues nobody serves anymore.
+	struct Stages
+	{
+		std::atomic<bool>& stop;
+		vector<std::thread> threads;
+
+		explicit Stages(std::atomic<bool>& stop) : stop(stop) {}
+		~Stages() { stop = true; join(); }
+
+		void join()
+		{
+			for (std::thread& thread : threads)
+				if (thread.joinable())
+					thread.join();
+		}
+	} stages(failed);
+
+	// transform stage
+	for (size_t k = 0; k < n_workers; ++k)
+	{
+		stages.threads.emplace_back([&, k]() {
+			try
+			{
+				for (size_t row = k; row < nbh; row += n_workers)
+				{
+					transformCodeJPEG(table, options, nbw, row * nbw, (row + 1) * nbw);
+					if (!transformed[k]->Push(row, failed))
+						return;
+				}
+			}
+			catch (...)
+			{
+				fail();
+			}
+		});
+	}
+
+	// entropy coding stage
+	stages.threads.emplace_back([&]() {
+		try
+		{
+			vector<int> prev_dc_coef(4, 0);
+			StringBitStream bits;
+
+			for (size_t row = 0; row < nbh; ++row)
+			{
+				size_t transformed_row;
+				if (!transformed[row % n_workers]->Pop(transformed_row, failed))
+					return;
+
+				bits.reset();
+				spliceBlocksJPEG(row * nbw, (row + 1) * nbw, prev_dc_coef, &bits);
+				if (!coded.Push(bits.str(), failed))
+					return;
+			}
+		}
+		catch (...)
+		{
+			fail();
+		}
+	});
+
+	// I/O stage
+	const std::streampos begin = out.tellp();
+	const bool seekable = begin != std::streampos(-1);
+
+	try
+	{
+		if (seekable)
+			jpeg::container::WriteHeader(out, headerJPEG(table));
+
+		for (size_t row = 0; row < nbh; ++row)
+		{
+			string chunk;
+			if (!coded.Pop(chunk, failed))
+				break;
+
+			// the context keeps the whole code like writeCodeJPEG does
+			m_context->stream()->Add(chunk);
+
+			if (seekable)
+				out << chunk;
+		}
+	}
+	catch (...)
+	{
+		fail();
+	}
+
+	stages.join();
+
+	if (error)
+		std::rethrow_exception(error);
+
+	m_changed.assign(m_changed.size(), false);
+
+	if (seekable)
+	{
+		const std::streampos end = out.tellp();
+		out.seekp(begin);
+		jpeg::container::WriteHeader(out, headerJPEG(table));
+		out.seekp(end);
+	}
+	else
+	{
+		jpeg::container::WriteHeader(out, headerJPEG(table));
+		m_context->stream()->Write(out);
+	}
+
+	DisplayModuleWallTime("Pipelined RGB to YCC, DCT, quantization, coding and writing");
+}
+
+// prepareCodeJPEG
+// Pixels => nbw x nbh blocks of YCC channels ready for DCT
+// blocks past the image edge repeat the edge pixels
+void Canvas::prepareCodeJPEG(vector<float>& blocks, size_t nbw, size_t nbh)
+{
+	DisplayModuleWallTime("");
+
+	for (size_t b = 0; b < nbw * nbh; ++b)
+		prepareBlockJPEG(blocks, nbw, b);
+
+	DisplayModuleWallTime("Dividing image into blocks, RGB to YCC and down sampling 4:2:0");
+}
+
+// prepareBlockJPEG
+// Pixels => one block of YCC channels ready for DCT
+void Canvas::prepareBlockJPEG(vector<float>& blocks, int nbw, size_t block_id)
+{
+	PrepareBlock(m_Pixels, m_width, m_height, blocks, nbw, block_id);
+}
+
+// resetCodeJPEG
+// Drop kept coefs, every block is transformed and coded again with table and options
+void Canvas::resetCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options)
+{
+	const int nbw = m_width % 8 == 0 ? m_width / 8 : m_width / 8 + 1;
+	const int nbh = m_height % 8 == 0 ? m_height / 8 : m_height / 8 + 1;
+
+	m_coefs.assign(nbw * nbh * 256, 0.f);
+	m_coefs_quant[0] = table.divisors[0];
+	m_coefs_quant[1] = table.divisors[1];
+	m_coefs_lambda = options.trellis ? options.lambda : 0.f;
+	m_coefs_dct = options.dct;
+	m_changed.assign(nbw * nbh, true);
+	m_segments.assign(nbw * nbh * 4, string());
+}
+
+// transformCodeJPEG
+// Pixels => quantized coefs of edited blocks in [begin, end)
+// m_changed is only read, so ranges may run on several threads
+void Canvas::transformCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options, int nbw, size_t begin, size_t end)
+{
+	for (size_t b = begin; b < end; ++b)
+	{
+		if (!m_changed[b])
+			continue;
+
+		prepareBlockJPEG(m_coefs, nbw, b);
+
+		for (size_t c = 0; c < 4; ++c)
+		{
+			TransformBlock(m_coefs, b, c, options);
+			QuantizeBlock(m_coefs, b, c, table, options);
+			m_segments[b * 4 + c].clear();
+		}
+	}
+}
+
+// reuseCodeJPEG
+// Whether kept coefs are quantized the way table and options would do it
+bool Canvas::reuseCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options)
+{
+	if (m_coefs.empty() || m_coefs_quant[0] != table.divisors[0] || m_coefs_quant[1] != table.divisors[1])
+		return false;
+
+	if (m_coefs_lambda < 0.f)
+		return true;
+
+	return m_coefs_lambda == (options.trellis ? options.lambda : 0.f) && m_coefs_dct == options.dct;
+}
+
+// quantizeCodeJPEG
+// DCT coefs => quantized coefs in zigzag order
+void Canvas::quantizeCodeJPEG(vector<float>& blocks, const jpeg::util::QuantTable& table, const EncodeOptions& options)
+{
+	const size_t n = blocks.size() / 256;
+
+	for (size_t b = 0; b < n; ++b)
+		for (size_t c = 0; c < 4; ++c)
+			QuantizeBlock(blocks, b, c, table, options);
+
+	DisplayModuleWallTime("Quantization");
+}
+
+// encodeCodeJPEG
+// Huffman coding of quantized blocks into stream
+void Canvas::encodeCodeJPEG(const vector<float>& blocks)
+{
+	EncodeBlocks(blocks, m_context->stream());
+
+	DisplayModuleWallTime("Coding");
+}
+
+// spliceCodeJPEG
+// Huffman coding of m_coefs into stream
+// AC bits of a block don't depend on other blocks and are coded once, DC diffs are coded on every save
+void Canvas::spliceCodeJPEG()
+{
+	vector<int> prev_dc_coef(4, 0);
+
+	spliceBlocksJPEG(0, m_coefs.size() / 256, prev_dc_coef, m_context->stream());
+
+	DisplayModuleWallTime("Coding");
+}
+
+// spliceBlocksJPEG
+// spliceCodeJPEG of blocks [begin, end) into out
+void Canvas::spliceBlocksJPEG(size_t begin, size_t end, vector<int>& prev_dc_coef, BitStream* out)
+{
+	for (size_t b = begin; b < end; ++b)
+		for (size_t c = 0; c < 4; ++c)
+		{
+			string& segment = m_segments[b * 4 + c];
+
+			// an AC band ends with EOB or a nonzero coef, so it is never empty
+			if (segment.empty())
+			{
+				StringBitStream bits;
+				int prev{};
+				jpeg::huffman_coding::EncodeBand(m_coefs, b, c, 1, 63, prev, &bits);
+				segment = bits.str();
+			}
+
+			const int dc = (int)m_coefs[b * 256 + c * 64];
+			jpeg::huffman_coding::Encode_DC(dc - prev_dc_coef[c], out);
+			prev_dc_coef[c] = dc;
+
+			out->Add(segment);
+		}
+}
+
+// estimateCodeJPEG
+// Number of bits encodeCodeJPEG would produce, nothing is written
+size_t Canvas::estimateCodeJPEG(const vector<float>& blocks)
+{
+	const size_t n = blocks.size() / 256;
+	vector<int> prev_dc_coef(4, 0);
+	size_t bits{};
+
+	for (size_t b = 0; b < n; ++b)
+		for (size_t c = 0; c < 4; ++c)
+			bits += jpeg::huffman_coding::BitLengthBlock(blocks, b, c, prev_dc_coef[c]);
+
+	return bits;
+}
+
+bool Canvas::ReadAsJPEG(const std::string& filename)
+{
+	// pages of the file are decoded as mapped, without reading it into a buffer first
+	MappedFile file(filename);
+
+	return decodeJPEG(file.data(), file.size());
+}
+
+bool Canvas::ReadAsJPEG(istream& is)
+{
+	// read file header
+	jpeg::container::Header header = jpeg::container::ReadHeader(is);
+
+	// decoding leaves the stream of the context to the encoder
+	StringBitStream text;
+	BinaryBitStream binary;
+	BitStream* in = nullptr;
+
+	switch (header.format)
+	{
+	case jpeg::container::PayloadFormat::Text: in = &text; break;
+	case jpeg::container::PayloadFormat::Binary: in = &binary; break;
+	default: throw std::runtime_error("Unsupported payload format");
+	}
+
+	// the payload is read first, pixels are only allocated for an image whose bits are all there
+	in->Read(is);
+
+	if (in->size() < header.payload_bits)
+		throw std::runtime_error("Truncated payload");
+
+	openCodeJPEG(header);
+
+	jpeg::util::QuantTable table(header.quality, header.quant[0], header.quant[1]);
+	jpeg::huffman_coding::HuffmanTable dc_table(header.dc_bits, header.dc_values);
+	jpeg::huffman_coding::HuffmanTable ac_table(header.ac_bits, header.ac_values);
+
+	readCodeJPEG(table, dc_table, ac_table, in);
+
+	return 1;
+}
+
+bool Canvas::Decode(const uint8_t* data, size_t size)
+{
+	// JFIF starts with SOI, MyJPEG with its magic
+	if (size >= 2 && data[0] == 0xFF && data[1] == 0xD8)
+	{
+		MemoryBuffer buffer((const char*)data, size);
+		istream is(&buffer);
+
+		return ReadAsJFIF(is);
+	}
+
+	return decodeJPEG(data, size);
+}
 
-	DisplayModuleWallTime("INV DCT");
+// decodeJPEG
+// MyJPEG file in memory, the payload is read in place
+bool Canvas::decodeJPEG(const uint8_t* data, size_t size)
+{
+	// the header has a fixed size, the payload follows it
+	MemoryBuffer buffer((const char*)data, size);
+	istream is(&buffer);
+
+	jpeg::container::Header header = jpeg::container::ReadHeader(is);
+
+	bool binary = false;
+
+	switch (header.format)
+	{
+	case jpeg::container::PayloadFormat::Text: binary = false; break;
+	case jpeg::container::PayloadFormat::Binary: binary = true; break;
+	default: throw std::runtime_error("Unsupported payload format");
+	}
+
+	if (size - jpeg::container::HEADER_SIZE < jpeg::container::PayloadBytes(header))
+		throw std::runtime_error("Truncated payload");
+
+	openCodeJPEG(header);
+
+	jpeg::util::QuantTable table(header.quality, header.quant[0], header.quant[1]);
+	jpeg::huffman_coding::HuffmanTable dc_table(header.dc_bits, header.dc_values);
+	jpeg::huffman_coding::HuffmanTable ac_table(header.ac_bits, header.ac_values);
+
+	MemoryBitStream in(data + jpeg::container::HEADER_SIZE, size - jpeg::container::HEADER_SIZE, binary);
+
+	readCodeJPEG(table, dc_table, ac_table, &in);
+
+	return 1;
+}
+
+void Canvas::readCodeJPEG(
+	const jpeg::util::QuantTable& table,
+	const jpeg::huffman_coding::HuffmanTable& dc_table,
+	const jpeg::huffman_coding::HuffmanTable& ac_table,
+	BitStream* in)
+{
+	const int nbh = m_height % 8 == 0 ? m_height / 8 : m_height / 8 + 1;
+
+	vector<int> prev_dc_coef(4, 0);
+
+	DisplayModuleWallTime("");
+
+	// Huffman decoding, quantized coefs are kept for re-saving
+	resetReadJPEG(table);
+
+	for (size_t b = 0; b < m_coefs.size() / 256; ++b)
+		for (size_t c = 0; c < 4; ++c)
+			jpeg::huffman_coding::DecodeBlock(m_coefs, b, c, prev_dc_coef[c], in, dc_table, ac_table);
+
+	DisplayModuleWallTime("Decoding");
+
+	renderCodeJPEG(table, 0, nbh);
+
+	DisplayModuleWallTime("INV DCT, YCC to RGB and writing blocks back");
+}
+
+// openCodeJPEG
+// Check the layout of a MyJPEG file and size pixels for it
+void Canvas::openCodeJPEG(const jpeg::container::Header& header)
+{
+	// channels are coded as Y, Cb, Cr, A with luma/chroma/chroma/luma quant tables
+	if (header.components.size() != 4 ||
+		header.components[0].quant_table != 0 || header.components[1].quant_table != 1 ||
+		header.components[2].quant_table != 1 || header.components[3].quant_table != 0)
+		throw std::runtime_error("Unsupported component layout");
+
+	if (m_max_pixels > 0 && (size_t)header.width * header.height > m_max_pixels)
+		throw std::runtime_error("Image too large");
+
+	const int w = (int)header.width;
+	const int h = (int)header.height;
+
+	if (w != m_width || h != m_height)
+	{
+		m_width = w;
+		m_height = h;
+		if (m_Pixels)
+			freePixel();
+		if (!allocPixel(w, h))
+			throw std::runtime_error("Bad alloc");
+	}
+
+	// a canvas that was never initialized gets its encoder context here
+	if (!m_context)
+		m_context = std::make_shared<EncoderContext>();
+}
+
+// resetReadJPEG
+// Zeroed coefs to decode into, kept for re-saving with table
+void Canvas::resetReadJPEG(const jpeg::util::QuantTable& table)
+{
+	const int nbw = m_width % 8 == 0 ? m_width / 8 : m_width / 8 + 1;
+	const int nbh = m_height % 8 == 0 ? m_height / 8 : m_height / 8 + 1;
+
+	m_coefs.assign(nbw * nbh * 256, 0.f);
+	m_coefs_quant[0] = table.divisors[0];
+	m_coefs_quant[1] = table.divisors[1];
+	m_coefs_lambda = -1.f;
+	m_changed.assign(nbw * nbh, false);
+	m_segments.assign(nbw * nbh * 4, string());
+}
+
+// renderCodeJPEG
+// Decoded coefs of block rows [row0, row0 + rows) => pixels
+void Canvas::renderCodeJPEG(const jpeg::util::QuantTable& table, size_t row0, size_t rows)
+{
+	const int nbw = m_width % 8 == 0 ? m_width / 8 : m_width / 8 + 1;
+
+	// Unzigzag + Dequantize straight from kept coefs into the IDCT input, then inverse DCT
+	vector<float> blocks(nbw * rows * 256);
+
+	for (size_t b = 0; b < nbw * rows; ++b)
+	{
+		for (size_t c = 0; c < 4; ++c)
+		{
+			jpeg::util::DequantizeZigzag(m_coefs, row0 * nbw + b, blocks, b, c, table.Inverse(c));
+			jpeg::dct::FastInverseTransform8x8(blocks, b, c);
+		}
+	}
+
+	restoreCodeJPEG(blocks, nbw, rows, row0);
+}
+
+// restoreCodeJPEG
+// Blocks of YCC channels after IDCT => pixels
+// blocks hold nbh block rows starting at block row row0 of the image
+void Canvas::restoreCodeJPEG(vector<float>& blocks, size_t nbw, size_t nbh, size_t row0)
+{
+	const size_t w = m_width;
+	const size_t h = m_height;
 
 	// Block Format: [ <== 256 bytes ==> ]
 	// [C0 x64] [C1 x64] [C2 x64] [C3 x64]
@@ -402,15 +1230,11 @@ void Canvas::readCodeJPEG(float quality)
 		for (size_t j = 0; j < nbw; ++j)
 			jpeg::util::ScatterChannels(blocks, i * nbw + j);
 
-	DisplayModuleWallTime("Scatter channels");
-
 	// YCrCb to RGBA
 	for (size_t i = 0; i < nbh; ++i)
 		for (size_t j = 0; j < nbw; ++j)
 			jpeg::util::YCC2RGB(blocks, i*nbw + j);
 
-	DisplayModuleWallTime("RGB to YCC");
-
 	// write 8x8 blocks back to pixels
 
 	//for (size_t i = 0; i < nbh; ++i)
@@ -423,12 +1247,14 @@ void Canvas::readCodeJPEG(float quality)
 	//				m_Pixels[((i * 8 + l) *w + j * 8) * 4 + e] = color;
 	//			}
 
-	for (size_t i = 0; i < h; ++i)
+	const size_t end = (row0 + nbh) * 8 < h ? (row0 + nbh) * 8 : h;
+
+	for (size_t i = row0 * 8; i < end; ++i)
 	{
 		for (size_t j = 0; j < w; ++j)
 		{
-			const size_t bi = i / 8, bj = j / 8;
-			const size_t ii = i - 8 * bi, jj = j - 8 * bj;
+			const size_t bi = i / 8 - row0, bj = j / 8;
+			const size_t ii = i % 8, jj = j - 8 * bj;
 			for (size_t c = 0; c < 4; ++c)
 			{
 				float fcolor = blocks[((bi * nbw + bj) * 64 + (ii * 8 + jj)) * 4 + c];
@@ -437,6 +1263,562 @@ void Canvas::readCodeJPEG(float quality)
 			}
 		}
 	}
+}
+
+bool Canvas::SaveAsJFIF(const string& filename, float quality)
+{
+	EncodeOptions options;
+	options.quality = quality;
+
+	return SaveAsJFIF(filename, options);
+}
+
+bool Canvas::SaveAsJFIF(const string& filename, const EncodeOptions& options)
+{
+	fstream fs(filename, ios::out | ios::binary);
+	if (!fs) throw std::runtime_error("File missing");
+
+	if (g_engine_log)
+		clog << "Save image to: " << filename << endl;
+
+	return SaveAsJFIF(fs, options);
+}
+
+bool Canvas::SaveAsJFIF(ostream& out, const EncodeOptions& options)
+{
+	const jpeg::util::QuantTable& table = jpeg::util::GetQuantTable(options.quality);
+
+	jpeg::jfif::Coefficients coefs;
+	coefs.frame = frameJFIF(table, options);
+
+	prepareCodeJFIF(table, options, coefs.planes);
+
+	if (options.optimize_huffman)
+		jpeg::jfif::SetOptimalTables(coefs);
+
+	const std::streampos begin = out.tellp();
+	jpeg::jfif::WriteCoefficients(out, coefs);
+
+	DisplayModuleWallTime("Coding");
+
+	// no position on pipes
+	if (g_engine_log && begin != std::streampos(-1))
+		clog << "Compress ratio: " << (float)(m_width * m_height * 4) / (float)(out.tellp() - begin) << endl;
+
+	return true;
+}
+
+bool Canvas::SaveAsJFIF(OutputSink& out, const EncodeOptions& options)
+{
+	SinkBuffer buffer(out);
+	ostream os(&buffer);
+	os.exceptions(ios::badbit);
+
+	SaveAsJFIF(os, options);
+	os.flush();
+
+	return true;
+}
+
+// frameJFIF
+// Y 2x2, Cb 1x1, Cr 1x1 sharing the default Huffman tables
+jpeg::jfif::Frame Canvas::frameJFIF(const jpeg::util::QuantTable& table, const EncodeOptions& options)
+{
+	if (m_width > 0xFFFF || m_height > 0xFFFF)
+		throw std::runtime_error("Image too large for JFIF");
+
+	jpeg::jfif::Frame frame;
+
+	frame.width = (uint16_t)m_width;
+	frame.height = (uint16_t)m_height;
+	frame.progressive = options.progressive;
+
+	frame.components = { { 1, 2, 2, 0, 0, 0 }, { 2, 1, 1, 1, 0, 0 }, { 3, 1, 1, 1, 0, 0 } };
+
+	frame.quant[0] = table.divisors[0];
+	frame.quant[1] = table.divisors[1];
+
+	jpeg::jfif::SetDefaultTables(frame);
+
+	return frame;
+}
+
+// prepareCodeJFIF
+// Pixels => planes of quantized coefs in zigzag order
+// planes[0]: Y, 8x8 blocks covering whole 16x16 MCUs, channel 0
+// planes[1], planes[2]: Cb, Cr, one block per MCU, channels 1 and 2
+void Canvas::prepareCodeJFIF(
+	const jpeg::util::QuantTable& table,
+	const EncodeOptions& options,
+	vector<vector<float> >& planes)
+{
+	const int w = m_width;
+	const int h = m_height;
+
+	const size_t nmw = w % 16 == 0 ? w / 16 : w / 16 + 1;
+	const size_t nmh = h % 16 == 0 ? h / 16 : h / 16 + 1;
+
+	const size_t nbw = nmw * 2;
+	const size_t nbh = nmh * 2;
+
+	planes.resize(3);
+
+	vector<float>& luma = planes[0];
+	luma.assign(nbw * nbh * 256, 0.f);
+
+	prepareCodeJPEG(luma, nbw, nbh);
+
+	// chroma planes are already averaged over 2x2 pixels by DownSampling420
+	// so one 8x8 block per MCU picks every other sample
+	for (size_t c = 1; c < 3; ++c)
+	{
+		planes[c].assign(nmw * nmh * 256, 0.f);
+
+		for (size_t mi = 0; mi < nmh; ++mi)
+			for (size_t mj = 0; mj < nmw; ++mj)
+				for (size_t y = 0; y < 8; ++y)
+					for (size_t x = 0; x < 8; ++x)
+					{
+						const size_t pi = mi * 16 + y * 2, pj = mj * 16 + x * 2;
+						const size_t bi = pi / 8, bj = pj / 8;
+						planes[c][(mi * nmw + mj) * 256 + c * 64 + y * 8 + x] =
+							luma[(bi * nbw + bj) * 256 + c * 64 + (pi - 8 * bi) * 8 + (pj - 8 * bj)];
+					}
+	}
+
+	DisplayModuleWallTime("Gathering chroma blocks");
+
+	// DCT + Quantize + Zigzag
+	for (size_t b = 0; b < nbw * nbh; ++b)
+	{
+		TransformBlock(luma, b, 0, options);
+		QuantizeBlock(luma, b, 0, table, options);
+	}
+
+	for (size_t m = 0; m < nmw * nmh; ++m)
+		for (size_t c = 1; c < 3; ++c)
+		{
+			TransformBlock(planes[c], m, c, options);
+			QuantizeBlock(planes[c], m, c, table, options);
+		}
+
+	DisplayModuleWallTime("DCT and quantization");
+}
+
+bool Canvas::ReadAsJFIF(const std::string& filename, function<void(size_t)> on_scan)
+{
+	MappedFile file(filename);
+	MemoryBuffer buffer((const char*)file.data(), file.size());
+	istream is(&buffer);
+
+	return ReadAsJFIF(is, on_scan);
+}
+
+bool Canvas::ReadAsJFIF(istream& is, function<void(size_t)> on_scan)
+{
+	// steps of foreign files don't match ours
+	m_coefs.clear();
+
+	DisplayModuleWallTime("");
+
+	// preview of what has been read so far
+	std::function<void(const jpeg::jfif::Coefficients&, size_t)> preview;
+
+	if (on_scan)
+	{
+		preview = [&](const jpeg::jfif::Coefficients& coefs, size_t scans) {
+			renderCodeJFIF(coefs);
+			on_scan(scans);
+		};
+	}
+
+	const jpeg::jfif::Coefficients coefs = jpeg::jfif::ReadCoefficients(is, preview, m_max_pixels);
+
+	DisplayModuleWallTime("Decoding");
+
+	if (!on_scan)
+		renderCodeJFIF(coefs);
+
+	return 1;
+}
+
+// renderCodeJFIF
+// Planes of quantized coefs => pixels
+// Components sampled below the max factors are upsampled by repeating samples
+void Canvas::renderCodeJFIF(const jpeg::jfif::Coefficients& coefs)
+{
+	const jpeg::jfif::Frame& frame = coefs.frame;
+	const jpeg::jfif::Layout layout(frame);
+
+	const int w = (int)frame.width;
+	const int h = (int)frame.height;
+
+	if (w != m_width || h != m_height)
+	{
+		m_width = w;
+		m_height = h;
+		if (m_Pixels)
+			freePixel();
+		if (!allocPixel(w, h))
+			throw std::runtime_error("Bad alloc");
+	}
+
+	const size_t nbw = layout.nmw * layout.hmax;
+	const size_t nbh = layout.nmh * layout.vmax;
+
+	vector<float> blocks(nbw * nbh * 256, 0.f);
+	const size_t n_comp = coefs.planes.size();
+
+	for (size_t c = 0; c < n_comp; ++c)
+	{
+		const jpeg::jfif::Component& comp = layout.comps[c];
+
+		if (frame.quant[comp.quant_table].empty())
+			throw std::runtime_error("Missing table");
+
+		// quality of foreign files is unknown
+		const jpeg::util::QuantTable table(0.f, frame.quant[comp.quant_table], frame.quant[comp.quant_table]);
+
+		// full size planes share the layout of blocks
+		const bool full = comp.h == layout.hmax && comp.v == layout.vmax;
+		vector<float> plane;
+		vector<float>& dst = full ? blocks : plane;
+
+		if (!full)
+			plane.assign(coefs.planes[c].size(), 0.f);
+
+		for (size_t b = 0; b < coefs.planes[c].size() / 256; ++b)
+		{
+			jpeg::util::DequantizeZigzag(coefs.planes[c], b, dst, b, c, table.Inverse(0));
+			jpeg::dct::FastInverseTransform8x8(dst, b, c);
+		}
+
+		if (full)
+			continue;
+
+		const size_t gw = layout.PlaneWidth(c);
+
+		for (size_t i = 0; i < nbh * 8; ++i)
+		{
+			for (size_t j = 0; j < nbw * 8; ++j)
+			{
+				const size_t si = i * comp.v / layout.vmax, sj = j * comp.h / layout.hmax;
+				blocks[((i / 8) * nbw + j / 8) * 256 + c * 64 + (i % 8) * 8 + j % 8] =
+					plane[((si / 8) * gw + sj / 8) * 256 + c * 64 + (si % 8) * 8 + sj % 8];
+			}
+		}
+	}
+
+	DisplayModuleWallTime("INV DCT and up sampling");
+
+	// gray images have neutral chroma, alpha is opaque
+	for (size_t b = 0; b < nbw * nbh; ++b)
+		for (size_t c = n_comp; c < 4; ++c)
+			for (size_t e = 0; e < 64; ++e)
+				blocks[b * 256 + c * 64 + e] = c == 3 ? 255.f : 128.f;
+
+	restoreCodeJPEG(blocks, nbw, nbh);
+
+	DisplayModuleWallTime("YCC to RGB and writing blocks back");
+}
+
+
+StreamDecoder::StreamDecoder(Canvas& canvas) :
+	m_canvas(canvas), m_state(State::Header), m_prev_dc_coef(4, 0), m_block(0), m_rows(0)
+{}
+
+StreamDecoder::~StreamDecoder()
+{}
+
+size_t StreamDecoder::Feed(const void* data, size_t size)
+{
+	const char* bytes = (const char*)data;
+
+	if (m_state == State::Header)
+	{
+		const size_t n = std::min(size, jpeg::container::HEADER_SIZE - m_header.size());
+		m_header.append(bytes, n);
+		bytes += n;
+		size -= n;
+
+		if (m_header.size() < jpeg::container::HEADER_SIZE)
+			return m_rows;
+
+		istringstream is(m_header, ios::in | ios::binary);
+		const jpeg::container::Header header = jpeg::container::ReadHeader(is);
+
+		if (header.format != jpeg::container::PayloadFormat::Text &&
+			header.format != jpeg::container::PayloadFormat::Binary)
+			throw std::runtime_error("Unsupported payload format");
+
+		m_canvas.openCodeJPEG(header);
+
+		m_table.reset(new jpeg::util::QuantTable(header.quality, header.quant[0], header.quant[1]));
+		m_dc_table.reset(new jpeg::huffman_coding::HuffmanTable(header.dc_bits, header.dc_values));
+		m_ac_table.reset(new jpeg::huffman_coding::HuffmanTable(header.ac_bits, header.ac_values));
+
+		// no room is reserved for payload_bits, the header is not backed by received bytes yet and
+		// decoded bytes are discarded as chunks arrive
+		m_bits.reset(new ChunkBitStream(header.format == jpeg::container::PayloadFormat::Binary));
+
+		m_canvas.resetReadJPEG(*m_table);
+		m_state = State::Payload;
+
+		DisplayModuleWallTime("");
+	}
+
+	if (m_state == State::Payload)
+	{
+		m_bits->Append(bytes, size);
+		decode();
+	}
+
+	return m_rows;
+}
+
+// decode
+// Blocks whose bits have all arrived, finished rows of blocks are rendered
+void StreamDecoder::decode()
+{
+	const size_t w = m_canvas.m_width;
+	const size_t h = m_canvas.m_height;
+
+	const size_t nbw = w % 8 == 0 ? w / 8 : w / 8 + 1;
+	const size_t nbh = h % 8 == 0 ? h / 8 : h / 8 + 1;
+
+	const size_t row0 = m_block / nbw;
+
+	int prev[4];
+	std::copy_n(m_prev_dc_coef.begin(), 4, prev);
+
+	while (m_block < nbw * nbh)
+	{
+		const size_t pos = m_bits->tell();
+		int next[4] = { prev[0], prev[1], prev[2], prev[3] };
+
+		try
+		{
+			for (size_t c = 0; c < 4; ++c)
+				jpeg::huffman_coding::DecodeBlock(m_canvas.m_coefs, m_block, c, next[c], m_bits.get(), *m_dc_table, *m_ac_table);
+		}
+		catch (const std::exception&)
+		{
+			// bad code unless the block is only cut by the end of the data received so far
+			if (!m_bits->starved())
+				throw;
+
+			m_bits->seek(pos);
+			break;
+		}
+
+		std::copy_n(next, 4, prev);
+		++m_block;
+	}
+
+	std::copy_n(prev, 4, m_prev_dc_coef.begin());
+	m_bits->Discard();
+
+	const size_t rows = m_block / nbw;
+
+	if (rows > row0)
+		m_canvas.renderCodeJPEG(*m_table, row0, rows - row0);
+
+	m_rows = rows * 8 < h ? rows * 8 : h;
+
+	if (m_block == nbw * nbh)
+	{
+		m_state = State::Done;
+		DisplayModuleWallTime("Decoding and rendering as data arrived");
+	}
+}
+
+
+// Blocks of a split image shared by its ranges
+struct BatchEncoder::Image
+{
+	const EncodeJob* job;
+	std::string* error;
+	int nbw, nbh;
+	vector<float> blocks;
+	std::atomic<size_t> remaining; // ranges not done yet
+	std::atomic<bool> failed;
+};
+
+BatchEncoder::BatchEncoder(size_t threads) : m_pool(new ThreadPool(threads))
+{
+	for (size_t t = 0; t < m_pool->size(); ++t)
+		m_scratch.emplace_back(new Scratch);
+}
+
+BatchEncoder::~BatchEncoder()
+{
+	// workers go first, they use the scratch buffers
+	m_pool.reset();
+}
+
+vector<string> BatchEncoder::Encode(const vector<EncodeJob>& jobs)
+{
+	vector<string> errors(jobs.size());
+
+	for (size_t i = 0; i < jobs.size(); ++i)
+	{
+		const EncodeJob& job = jobs[i];
+		string& error = errors[i];
+
+		if (!job.pixels || job.width <= 0 || job.height <= 0)
+		{
+			error = "Invalid image";
+			continue;
+		}
+
+		const int nbw = job.width % 8 == 0 ? job.width / 8 : job.width / 8 + 1;
+		const int nbh = job.height % 8 == 0 ? job.height / 8 : job.height / 8 + 1;
+		const size_t n = (size_t)nbw * nbh;
+
+		if (n <= split_blocks || range_blocks == 0)
+		{
+			m_pool->Submit([this, &job, &error]() { encodeWhole(job, error); });
+			continue;
+		}
+
+		std::shared_ptr<Image> image = std::make_shared<Image>();
+		image->job = &job;
+		image->error = &error;
+		image->nbw = nbw;
+		image->nbh = nbh;
+		image->blocks.assign(n * 256, 0.f);
+		image->remaining = (n + range_blocks - 1) / range_blocks;
+		image->failed = false;
+
+		for (size_t begin = 0; begin < n; begin += range_blocks)
+		{
+			const size_t end = std::min(begin + range_blocks, n);
+			m_pool->Submit([this, image, begin, end]() { encodeRange(image, begin, end); });
+		}
+	}
+
+	m_pool->Wait();
+
+	// files still in the I/O queue
+	for (PendingWrite& write : m_writes)
+	{
+		try
+		{
+			write.done.get();
+		}
+		catch (const std::exception& e)
+		{
+			*write.error = e.what();
+		}
+	}
+	m_writes.clear();
+
+	return errors;
+}
+
+// encodeWhole
+// Pixels => file in the scratch buffers of the calling worker
+void BatchEncoder::encodeWhole(const EncodeJob& job, string& error)
+{
+	Scratch& scratch = *m_scratch[ThreadPool::WorkerIndex()];
+
+	try
+	{
+		const jpeg::util::QuantTable& table = jpeg::util::GetQuantTable(job.options.quality);
+
+		const int nbw = job.width % 8 == 0 ? job.width / 8 : job.width / 8 + 1;
+		const int nbh = job.height % 8 == 0 ? job.height / 8 : job.height / 8 + 1;
+
+		// capacity is kept from job to job
+		scratch.blocks.assign((size_t)nbw * nbh * 256, 0.f);
+
+		for (size_t b = 0; b < (size_t)nbw * nbh; ++b)
+		{
+			PrepareBlock(job.pixels, job.width, job.height, scratch.blocks, nbw, b);
+
+			for (size_t c = 0; c < 4; ++c)
+			{
+				TransformBlock(scratch.blocks, b, c, job.options);
+				QuantizeBlock(scratch.blocks, b, c, table, job.options);
+			}
+		}
+
+		finish(job, scratch.blocks, error);
+	}
+	catch (const std::exception& e)
+	{
+		error = e.what();
+	}
+}
+
+// encodeRange
+// Blocks [begin, end) of a split image, the last range to finish codes the file
+void BatchEncoder::encodeRange(const std::shared_ptr<Image>& image, size_t begin, size_t end)
+{
+	const EncodeJob& job = *image->job;
+
+	try
+	{
+		const jpeg::util::QuantTable& table = jpeg::util::GetQuantTable(job.options.quality);
+
+		for (size_t b = begin; b < end; ++b)
+		{
+			PrepareBlock(job.pixels, job.width, job.height, image->blocks, image->nbw, b);
+
+			for (size_t c = 0; c < 4; ++c)
+			{
+				TransformBlock(image->blocks, b, c, job.options);
+				QuantizeBlock(image->blocks, b, c, table, job.options);
+			}
+		}
+	}
+	catch (const std::exception& e)
+	{
+		if (!image->failed.exchange(true))
+			*image->error = e.what();
+	}
+
+	if (--image->remaining > 0 || image->failed)
+		return;
+
+	try
+	{
+		finish(job, image->blocks, *image->error);
+	}
+	catch (const std::exception& e)
+	{
+		*image->error = e.what();
+	}
+}
+
+// finish
+// Quantized blocks => file, coded in the context of the calling worker
+void BatchEncoder::finish(const EncodeJob& job, const vector<float>& blocks, string& error)
+{
+	EncoderContext& context = m_scratch[ThreadPool::WorkerIndex()]->context;
+	const jpeg::util::QuantTable& table = jpeg::util::GetQuantTable(job.options.quality);
+
+	context.reset();
+	context.reserve(job.width, job.height, job.options.quality);
+
+	EncodeBlocks(blocks, context.stream());
+
+	if (io)
+	{
+		ostringstream file(ios::out | ios::binary);
+		jpeg::container::WriteHeader(file, HeaderJPEG(job.width, job.height, table, context.stream()->size()));
+		context.stream()->Write(file);
+
+		lock_guard<mutex> lock(m_writes_mutex);
+		m_writes.push_back(PendingWrite{ io->Write(job.destination, file.str()), &error });
+		return;
+	}
+
+	fstream fs(job.destination, ios::out | ios::binary);
+	if (!fs) throw std::runtime_error("File missing");
+
+	jpeg::container::WriteHeader(fs, HeaderJPEG(job.width, job.height, table, context.stream()->size()));
+	context.stream()->Write(fs);
 
-	DisplayModuleWallTime("Writing blocks back to image");
+	if (!fs) throw std::runtime_error("Write failed");
 }
@@ -5,13 +5,106 @@
 #include "Engine.cpp"
 #endif
 
+#include <iosfwd>
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <memory>
 #include <functional>
+#include <future>
+#include <mutex>
 
 #include "BitStream.h"
 
+namespace jpeg { namespace util { struct QuantTable; } }
+namespace jpeg { namespace huffman_coding { struct HuffmanTable; } }
+namespace jpeg { namespace container { struct Header; } }
+namespace jpeg { namespace jfif { struct Frame; struct Coefficients; } }
+
+class ThreadPool;
+class BatchIO;
+class OutputSink;
+
+// Stage timings and compress ratios of every save and decode to std::clog, off by default
+// Canvases used per request, as by a server or a batch, would log every request otherwise.
+void SetEngineLog(bool enabled);
+
+// Forward DCT of the encoder, decoding always uses the fast IDCT
+enum class DCTMethod
+{
+	Fast,  // AAN, float
+	Exact, // matrix product, slower
+};
+
+// Encoder settings
+struct EncodeOptions
+{
+	float quality = 1.f;
+
+	DCTMethod dct = DCTMethod::Fast;
+
+	// rate-distortion optimized (trellis) quantization
+	bool trellis = false;
+	float lambda = .005f;
+
+	// JFIF only: DC scan first, then scans of AC 1-5 and 6-63 per component
+	bool progressive = false;
+
+	// JFIF only: Huffman tables built from the symbols of the image instead of the Annex K ones
+	bool optimize_huffman = false;
+
+	// MyJPEG only: transform workers of a pipeline overlapping transform, coding and writing
+	// 0: everything runs on the calling thread, one stage after another
+	int threads = 0;
+};
+
+// Layout of pixels handed to the encoder
+enum class PixelFormat
+{
+	RGBA,    // 4 bytes per pixel
+	BGRA,    // 4 bytes per pixel, as in most framebuffers
+	RGB24,   // 3 bytes per pixel, opaque
+	Gray8,   // 1 byte per pixel, opaque, chroma is neutral
+	YUV420,  // Y, U, V planes, chroma of half width and height rounded up, opaque
+	YUV444,  // Y, U, V planes of full size, opaque
+};
+
+// Pixels the encoder reads in place, in their own layout
+// stride: bytes from the start of a row to the start of the next, 0: rows packed. YUV planes are
+// full range BT.601 like JFIF, they are coded as they are, without going through RGB.
+struct PixelView
+{
+	PixelView() {}
+	// packed formats
+	PixelView(PixelFormat format, const void* data, int width, int height, size_t stride = 0);
+	// YUV420 or YUV444, u and v share their stride
+	PixelView(PixelFormat format, const void* y, const void* u, const void* v, int width, int height, size_t y_stride = 0, size_t uv_stride = 0);
+
+	PixelFormat format = PixelFormat::RGBA;
+	int width = 0, height = 0;
+	const uint8_t* planes[3] = {};  // only planes[0] for packed formats
+	size_t strides[3] = {};
+};
+
+// Encoder state that outlives a save
+// The stream is cleared before every save but keeps its capacity, so a long running process
+// saving many frames, from one canvas or from several sharing a context, stops reallocating
+class EncoderContext
+{
+public:
+	EncoderContext();
+
+	// Drop coded data of the previous save, capacity is kept
+	void reset();
+	// Make room for the code of a w x h image at given quality
+	void reserve(int w, int h, float quality);
+
+	BitStream* stream() const { return m_stream.get(); }
+
+private:
+	std::unique_ptr<BitStream> m_stream;
+};
+
 class Canvas
 {
 public:
@@ -25,6 +118,16 @@ public:
 	int height() const { return m_height; }
 	const void* pixels() const { return (void*)m_Pixels; }
 
+	// Reads throw for images above max_pixels before allocating for them, 0: no limit
+	void SetMaxPixels(size_t max_pixels) { m_max_pixels = max_pixels; }
+
+	// Canvases may share one context, saves of one canvas go through its own otherwise
+	// A context set here is kept across Free and Init, null goes back to a context of its own. The
+	// context holds the code of the save in progress without locking, so canvases sharing it must
+	// save from one thread at a time.
+	void SetEncoderContext(std::shared_ptr<EncoderContext> context);
+	std::shared_ptr<EncoderContext> encoderContext() const { return m_context; }
+
 	void EditPixel(int x, int y, std::vector<unsigned char>&& color, int scale = 0);
 
 	void SetAllPixels(
@@ -37,21 +140,188 @@ public:
 		std::vector<std::function<float(int, int, const std::vector<float>&)>>,
 		const std::vector<std::vector<float>>&,
 		const int channel);
+	// width x height RGBA pixels, rows packed
+	void SetAllPixels(const unsigned char* rgba);
 
 	bool SaveAsJPEG(const std::string& filename, float quality = 1.f);
+	bool SaveAsJPEG(const std::string& filename, const EncodeOptions& options);
+	bool SaveAsJPEGTargetSize(const std::string& filename, size_t bytes);
+	bool SaveAsJPEGTargetSize(const std::string& filename, size_t bytes, const EncodeOptions& options);
 	bool ReadAsJPEG(const std::string& filename);
+	// Streams must be binary, filename versions go through these
+	bool SaveAsJPEG(std::ostream& out, const EncodeOptions& options);
+	bool ReadAsJPEG(std::istream& in);
+	// The sink is told the file size before any byte is written, unless options.threads > 0
+	bool SaveAsJPEG(OutputSink& out, const EncodeOptions& options);
+
+	// Baseline JFIF, 4:2:0, alpha is dropped
+	bool SaveAsJFIF(const std::string& filename, float quality = 1.f);
+	bool SaveAsJFIF(const std::string& filename, const EncodeOptions& options);
+	// on_scan is called with the number of scans read, pixels hold the image decoded so far
+	bool ReadAsJFIF(const std::string& filename, std::function<void(size_t)> on_scan = nullptr);
+	bool SaveAsJFIF(std::ostream& out, const EncodeOptions& options);
+	bool ReadAsJFIF(std::istream& in, std::function<void(size_t)> on_scan = nullptr);
+	bool SaveAsJFIF(OutputSink& out, const EncodeOptions& options);
+
+	// MyJPEG file of pixels the canvas does not own, such as a surface with a pitch or a video frame
+	// Canvas pixels are neither read nor changed, coefs kept for edits are dropped. Buffers of the
+	// canvas are reused from frame to frame. options.threads is ignored.
+	bool SaveAsJPEG(const PixelView& pixels, OutputSink& out, const EncodeOptions& options);
+
+	// MyJPEG file into out, replacing its content
+	// A vector with enough capacity, as left by the previous call, is filled without reallocating
+	// and the code is copied once, from the encoder stream into out.
+	bool EncodeToBuffer(std::vector<uint8_t>& out, const EncodeOptions& options = EncodeOptions());
+
+	// MyJPEG or JFIF file in memory, told apart by its first bytes
+	// MyJPEG payloads are decoded in place, nothing is copied. Files given by name are mapped and
+	// decoded the same way.
+	bool Decode(const uint8_t* data, size_t size);
 
 private:
+	friend class StreamDecoder;
+
 	bool allocPixel(int w, int h);
 	void freePixel();
 
-	void writeCodeJPEG(float quality);
-	void readCodeJPEG(float quality);
+	jpeg::container::Header headerJPEG(const jpeg::util::QuantTable& table);
+	void writeCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options);
+	void pipeCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options, std::ostream& out);
+	void resetCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options);
+	void transformCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options, int nbw, size_t begin, size_t end);
+	void prepareCodeJPEG(std::vector<float>& blocks, size_t nbw, size_t nbh);
+	void prepareBlockJPEG(std::vector<float>& blocks, int nbw, size_t block_id);
+	bool reuseCodeJPEG(const jpeg::util::QuantTable& table, const EncodeOptions& options);
+	void quantizeCodeJPEG(std::vector<float>& blocks, const jpeg::util::QuantTable& table, const EncodeOptions& options);
+	void encodeCodeJPEG(const std::vector<float>& blocks);
+	void spliceCodeJPEG();
+	void spliceBlocksJPEG(size_t begin, size_t end, std::vector<int>& prev_dc_coef, BitStream* out);
+	size_t estimateCodeJPEG(const std::vector<float>& blocks);
+	void readCodeJPEG(
+		const jpeg::util::QuantTable& table,
+		const jpeg::huffman_coding::HuffmanTable& dc_table,
+		const jpeg::huffman_coding::HuffmanTable& ac_table,
+		BitStream* in);
+	bool decodeJPEG(const uint8_t* data, size_t size);
+	void openCodeJPEG(const jpeg::container::Header& header);
+	void resetReadJPEG(const jpeg::util::QuantTable& table);
+	void renderCodeJPEG(const jpeg::util::QuantTable& table, size_t row0, size_t rows);
+	void restoreCodeJPEG(std::vector<float>& blocks, size_t nbw, size_t nbh, size_t row0 = 0);
+
+	jpeg::jfif::Frame frameJFIF(const jpeg::util::QuantTable& table, const EncodeOptions& options);
+	void prepareCodeJFIF(
+		const jpeg::util::QuantTable& table,
+		const EncodeOptions& options,
+		std::vector<std::vector<float> >& planes);
+	void renderCodeJFIF(const jpeg::jfif::Coefficients& coefs);
 
 private:
 	int m_width, m_height;
 	unsigned char* m_Pixels;
-	BitStream* m_stream;
+	size_t m_max_pixels;                  // of images read, 0: no limit
+	std::shared_ptr<EncoderContext> m_context;
+	bool m_shared_context;                // m_context was set by the caller
+
+	// quantized coefs of the last decoded or saved image in zigzag order, empty if none
+	// saving with the same quantization codes them again, only edited blocks are transformed
+	std::vector<float> m_coefs;
+	std::vector<int> m_coefs_quant[2];
+	float m_coefs_lambda;                 // -1: decoded, any save may reuse them, 0: rounded, > 0: trellis lambda
+	DCTMethod m_coefs_dct;
+	std::vector<bool> m_changed;          // blocks edited since m_coefs was filled
+	std::vector<std::string> m_segments;  // AC bits of each channel of each block, empty if not coded yet
+};
+
+// Push-style decoding of a MyJPEG file received in chunks
+// Feed decodes every block whose bits have all arrived and renders finished rows of blocks into
+// the canvas, so decoding overlaps with receiving. A block cut by the end of a chunk is decoded
+// again from its first bit once more data arrived. Errors other than missing data are thrown.
+class StreamDecoder
+{
+public:
+	explicit StreamDecoder(Canvas& canvas);
+	~StreamDecoder();
+
+	// ret: number of pixel rows of the canvas ready so far, from the top
+	size_t Feed(const void* data, size_t size);
+
+	bool headerReady() const { return m_state != State::Header; }
+	bool done() const { return m_state == State::Done; }
+	size_t rowsReady() const { return m_rows; }
+
+private:
+	void decode();
+
+private:
+	enum class State { Header, Payload, Done };
+
+	Canvas& m_canvas;
+	State m_state;
+	std::string m_header; // bytes of the header received so far
+
+	std::unique_ptr<jpeg::util::QuantTable> m_table;
+	std::unique_ptr<jpeg::huffman_coding::HuffmanTable> m_dc_table, m_ac_table;
+	std::unique_ptr<ChunkBitStream> m_bits;
+
+	std::vector<int> m_prev_dc_coef;
+	size_t m_block;    // next block to decode
+	size_t m_rows;     // pixel rows ready
+};
+
+// One image of a batch
+struct EncodeJob
+{
+	const unsigned char* pixels; // width x height RGBA, rows packed, alive until the batch is done
+	int width, height;
+	EncodeOptions options;
+	std::string destination;
+};
+
+// Encodes many images to MyJPEG files on a work-stealing thread pool
+// Small images are encoded whole by one worker in its own scratch buffers. Large ones are split
+// into block ranges transformed in parallel, the worker finishing the last range codes the file.
+class BatchEncoder
+{
+public:
+	// 0 threads: one per hardware thread
+	explicit BatchEncoder(size_t threads = 0);
+	~BatchEncoder();
+
+	// ret: error message of each job, empty on success
+	std::vector<std::string> Encode(const std::vector<EncodeJob>& jobs);
+
+	// images of more blocks are split into ranges of range_blocks blocks
+	size_t split_blocks = 4096;
+	size_t range_blocks = 1024;
+
+	// files are handed to io if set, else workers write them with blocking streams
+	BatchIO* io = nullptr;
+
+private:
+	struct Scratch
+	{
+		std::vector<float> blocks;
+		EncoderContext context;
+	};
+
+	struct Image;
+
+	struct PendingWrite
+	{
+		std::future<void> done;
+		std::string* error;
+	};
+
+	void encodeWhole(const EncodeJob& job, std::string& error);
+	void encodeRange(const std::shared_ptr<Image>& image, size_t begin, size_t end);
+	void finish(const EncodeJob& job, const std::vector<float>& blocks, std::string& error);
+
+private:
+	std::unique_ptr<ThreadPool> m_pool;
+	std::vector<std::unique_ptr<Scratch> > m_scratch; // by worker index
+
+	std::mutex m_writes_mutex;
+	std::vector<PendingWrite> m_writes;  // of the current Encode call
 };
 
 #endif // !ENGINE_H
@@ -0,0 +1,698 @@
+#include "Jfif.h"
+#include "jpeg.h"
+
+#include <stdexcept>
+#include <utility>
+
+namespace jpeg
+{
+namespace jfif
+{
+using std::vector;
+
+
+// put_u8 / put_u16
+// Big-endian field output
+void put_u8(std::ostream& out, uint8_t val)
+{
+	out.put((char)val);
+}
+
+void put_u16(std::ostream& out, uint16_t val)
+{
+	out.put((char)(val >> 8));
+	out.put((char)(val & 0xFF));
+}
+
+
+// get_u8 / get_u16
+// Big-endian field input
+uint8_t get_u8(std::istream& in)
+{
+	const int c = in.get();
+	if (c == EOF)
+		throw std::runtime_error("Unexpected end of file");
+	return (uint8_t)c;
+}
+
+uint16_t get_u16(std::istream& in)
+{
+	const uint16_t hi = get_u8(in);
+	return (uint16_t)(hi << 8 | get_u8(in));
+}
+
+
+// put_dht
+// One table of a DHT segment: class/id, 16 code counts, symbols
+void put_dht(std::ostream& out, uint8_t table_class, uint8_t id, const vector<int>& bits, const vector<int>& values)
+{
+	if (bits.size() != 16)
+		throw std::runtime_error("Invalid Huffman table");
+
+	put_u16(out, DHT);
+	put_u16(out, (uint16_t)(2 + 1 + 16 + values.size()));
+	put_u8(out, (uint8_t)(table_class << 4 | id));
+
+	for (int count : bits)
+		put_u8(out, (uint8_t)count);
+
+	for (int symbol : values)
+		put_u8(out, (uint8_t)symbol);
+}
+
+
+//
+//
+void WriteHeaders(std::ostream& out, const Frame& frame)
+{
+	if (frame.components.empty() || frame.components.size() > 4)
+		throw std::runtime_error("Invalid number of components");
+
+	put_u16(out, SOI);
+
+	// JFIF 1.01, no units, 1:1 aspect, no thumbnail
+	put_u16(out, APP0);
+	put_u16(out, 16);
+	out.write("JFIF", 5);
+	put_u8(out, 1);
+	put_u8(out, 1);
+	put_u8(out, 0);
+	put_u16(out, 1);
+	put_u16(out, 1);
+	put_u8(out, 0);
+	put_u8(out, 0);
+
+	// 8-bit quant steps in zigzag order
+	for (size_t t = 0; t < MAX_TABLES; ++t)
+	{
+		if (frame.quant[t].empty())
+			continue;
+
+		if (frame.quant[t].size() != 64)
+			throw std::runtime_error("Invalid quantization table");
+
+		put_u16(out, DQT);
+		put_u16(out, 2 + 1 + 64);
+		put_u8(out, (uint8_t)t);
+
+		for (size_t e = 0; e < 64; ++e)
+			put_u8(out, (uint8_t)frame.quant[t][jpeg::util::zigzag_mat8x8[e]]);
+	}
+
+	put_u16(out, frame.progressive ? SOF2 : SOF0);
+	put_u16(out, (uint16_t)(2 + 6 + frame.components.size() * 3));
+	put_u8(out, 8);
+	put_u16(out, frame.height);
+	put_u16(out, frame.width);
+	put_u8(out, (uint8_t)frame.components.size());
+
+	for (const Component& comp : frame.components)
+	{
+		put_u8(out, comp.id);
+		put_u8(out, (uint8_t)(comp.h << 4 | comp.v));
+		put_u8(out, comp.quant_table);
+	}
+
+	for (size_t t = 0; t < MAX_TABLES; ++t)
+	{
+		if (!frame.dc_bits[t].empty())
+			put_dht(out, 0, (uint8_t)t, frame.dc_bits[t], frame.dc_values[t]);
+		if (!frame.ac_bits[t].empty())
+			put_dht(out, 1, (uint8_t)t, frame.ac_bits[t], frame.ac_values[t]);
+	}
+
+	if (frame.restart_interval)
+	{
+		put_u16(out, DRI);
+		put_u16(out, 4);
+		put_u16(out, frame.restart_interval);
+	}
+}
+
+
+//
+//
+void WriteScan(std::ostream& out, const Frame& frame, const Scan& scan)
+{
+	if (scan.components.empty() || scan.components.size() > frame.components.size())
+		throw std::runtime_error("Invalid scan");
+
+	put_u16(out, SOS);
+	put_u16(out, (uint16_t)(2 + 1 + scan.components.size() * 2 + 3));
+	put_u8(out, (uint8_t)scan.components.size());
+
+	for (uint8_t c : scan.components)
+	{
+		const Component& comp = frame.components.at(c);
+		put_u8(out, comp.id);
+		put_u8(out, (uint8_t)(comp.dc_table << 4 | comp.ac_table));
+	}
+
+	put_u8(out, scan.ss);
+	put_u8(out, scan.se);
+	put_u8(out, 0);
+}
+
+
+//
+//
+void WriteEnd(std::ostream& out)
+{
+	put_u16(out, EOI);
+}
+
+
+// get_marker
+// Next marker code, fill bytes (0xFF) in front of it are skipped
+uint16_t get_marker(std::istream& in)
+{
+	if (get_u8(in) != 0xFF)
+		throw std::runtime_error("Marker expected");
+
+	uint8_t code = get_u8(in);
+	while (code == 0xFF)
+		code = get_u8(in);
+
+	return (uint16_t)(0xFF00 | code);
+}
+
+
+// get_dqt / get_dht
+// A segment may hold several tables
+void get_dqt(std::istream& in, size_t length, Frame& frame)
+{
+	while (length > 0)
+	{
+		const uint8_t pq_tq = get_u8(in);
+		const size_t t = pq_tq & 0xF;
+
+		if (pq_tq >> 4 != 0)
+			throw std::runtime_error("Unsupported quantization precision");
+		if (t >= MAX_TABLES || length < 1 + 64)
+			throw std::runtime_error("Invalid DQT segment");
+
+		frame.quant[t].resize(64);
+		for (size_t e = 0; e < 64; ++e)
+			frame.quant[t][jpeg::util::zigzag_mat8x8[e]] = get_u8(in);
+
+		length -= 1 + 64;
+	}
+}
+
+void get_dht(std::istream& in, size_t length, Frame& frame)
+{
+	while (length > 0)
+	{
+		const uint8_t tc_th = get_u8(in);
+		const size_t tc = tc_th >> 4, t = tc_th & 0xF;
+
+		if (tc > 1 || t >= MAX_TABLES || length < 1 + 16)
+			throw std::runtime_error("Invalid DHT segment");
+
+		vector<int>& bits = tc == 0 ? frame.dc_bits[t] : frame.ac_bits[t];
+		vector<int>& values = tc == 0 ? frame.dc_values[t] : frame.ac_values[t];
+
+		size_t count{};
+		bits.resize(16);
+		for (size_t l = 0; l < 16; ++l)
+			count += bits[l] = get_u8(in);
+
+		if (count > 256 || length < 1 + 16 + count)
+			throw std::runtime_error("Invalid DHT segment");
+
+		values.resize(count);
+		for (size_t k = 0; k < count; ++k)
+			values[k] = get_u8(in);
+
+		length -= 1 + 16 + count;
+	}
+}
+
+
+// get_sos
+// Scan header, checked against the frame
+void get_sos(std::istream& in, size_t length, Frame& frame)
+{
+	if (frame.components.empty())
+		throw std::runtime_error("Scan before frame header");
+
+	const size_t n_comp = get_u8(in);
+	if (n_comp < 1 || n_comp > frame.components.size() || length != 1 + n_comp * 2 + 3)
+		throw std::runtime_error("Invalid scan header");
+
+	Scan scan;
+
+	for (size_t k = 0; k < n_comp; ++k)
+	{
+		const uint8_t id = get_u8(in);
+		const uint8_t td_ta = get_u8(in);
+
+		// components appear in frame order
+		size_t c = scan.components.empty() ? 0 : scan.components.back() + 1;
+		while (c < frame.components.size() && frame.components[c].id != id)
+			++c;
+
+		if (c == frame.components.size())
+			throw std::runtime_error("Invalid scan header");
+
+		Component& comp = frame.components[c];
+		comp.dc_table = td_ta >> 4;
+		comp.ac_table = td_ta & 0xF;
+
+		if (comp.dc_table >= MAX_TABLES || comp.ac_table >= MAX_TABLES)
+			throw std::runtime_error("Invalid scan header");
+
+		scan.components.push_back((uint8_t)c);
+	}
+
+	scan.ss = get_u8(in);
+	scan.se = get_u8(in);
+	const uint8_t ah_al = get_u8(in);
+
+	if (!frame.progressive)
+	{
+		if (scan.ss != 0 || scan.se != 63 || ah_al != 0)
+			throw std::runtime_error("Invalid scan header");
+	}
+	else
+	{
+		// DC and AC are never mixed, AC scans hold one component
+		if (scan.se > 63 || scan.ss > scan.se || (scan.ss == 0 && scan.se != 0) || (scan.ss > 0 && n_comp != 1))
+			throw std::runtime_error("Invalid scan header");
+
+		if (ah_al != 0)
+			throw std::runtime_error("Unsupported successive approximation");
+	}
+
+	frame.scan = scan;
+}
+
+
+//
+//
+Frame ReadHeaders(std::istream& in)
+{
+	Frame frame;
+
+	if (get_marker(in) != SOI)
+		throw std::runtime_error("Not a JPEG file");
+
+	if (!NextScan(in, frame))
+		throw std::runtime_error("No scan in file");
+
+	return frame;
+}
+
+
+//
+//
+bool NextScan(std::istream& in, Frame& frame)
+{
+	for (;;)
+	{
+		// a file cut at a scan boundary ends like EOI
+		if (in.peek() == EOF)
+			return false;
+
+		const uint16_t marker = get_marker(in);
+
+		if (marker == EOI)
+			return false;
+
+		const uint16_t length = get_u16(in);
+
+		if (length < 2)
+			throw std::runtime_error("Invalid segment length");
+
+		switch (marker)
+		{
+		case DQT:
+			get_dqt(in, length - 2, frame);
+			break;
+
+		case DHT:
+			get_dht(in, length - 2, frame);
+			break;
+
+		case DRI:
+			frame.restart_interval = get_u16(in);
+			break;
+
+		case SOF0:
+		case SOF2:
+		{
+			if (!frame.components.empty())
+				throw std::runtime_error("Multiple frames");
+
+			frame.progressive = marker == SOF2;
+
+			if (get_u8(in) != 8)
+				throw std::runtime_error("Unsupported sample precision");
+
+			frame.height = get_u16(in);
+			frame.width = get_u16(in);
+
+			const size_t n_comp = get_u8(in);
+			if ((n_comp != 1 && n_comp != 3) || length != 8 + n_comp * 3)
+				throw std::runtime_error("Unsupported number of components");
+
+			for (size_t c = 0; c < n_comp; ++c)
+			{
+				Component comp{};
+				comp.id = get_u8(in);
+				const uint8_t hv = get_u8(in);
+				comp.h = hv >> 4;
+				comp.v = hv & 0xF;
+				comp.quant_table = get_u8(in);
+
+				if (comp.h < 1 || comp.h > 2 || comp.v < 1 || comp.v > 2 || comp.quant_table >= MAX_TABLES)
+					throw std::runtime_error("Unsupported sampling factors");
+
+				frame.components.push_back(comp);
+			}
+
+			if (frame.width == 0 || frame.height == 0)
+				throw std::runtime_error("Invalid image size");
+
+			break;
+		}
+
+		case SOS:
+			get_sos(in, length - 2, frame);
+			return true;
+
+		default:
+			// SOF1, SOF3.. are processes not supported here
+			if (marker >= 0xFFC1 && marker <= 0xFFCF && marker != DHT && marker != 0xFFC8 && marker != 0xFFCC)
+				throw std::runtime_error("Unsupported JPEG process");
+
+			// APPn, COM and others are skipped
+			in.ignore(length - 2);
+			break;
+		}
+	}
+}
+
+// Layout
+//
+Layout::Layout(const Frame& frame) : comps(frame.components), hmax(1), vmax(1)
+{
+	// a single component frame has one block per MCU whatever its factors are
+	if (comps.size() == 1)
+		comps[0].h = comps[0].v = 1;
+
+	for (const auto& comp : comps)
+	{
+		hmax = comp.h > hmax ? comp.h : hmax;
+		vmax = comp.v > vmax ? comp.v : vmax;
+	}
+
+	nmw = (frame.width + 8 * hmax - 1) / (8 * hmax);
+	nmh = (frame.height + 8 * vmax - 1) / (8 * vmax);
+
+	// visited by single component scans
+	for (const auto& comp : comps)
+	{
+		inner_w.push_back(((frame.width * comp.h + hmax - 1) / hmax + 7) / 8);
+		inner_h.push_back(((frame.height * comp.v + vmax - 1) / vmax + 7) / 8);
+	}
+}
+
+
+//
+//
+vector<Scan> DefaultScans(const Frame& frame)
+{
+	vector<Scan> scans(1);
+
+	for (size_t c = 0; c < frame.components.size(); ++c)
+		scans[0].components.push_back((uint8_t)c);
+
+	if (!frame.progressive)
+		return scans;
+
+	scans[0].se = 0;
+
+	for (const auto& band : { std::make_pair(1, 5), std::make_pair(6, 63) })
+	{
+		for (size_t c = 0; c < frame.components.size(); ++c)
+		{
+			Scan scan;
+			scan.components = { (uint8_t)c };
+			scan.ss = (uint8_t)band.first;
+			scan.se = (uint8_t)band.second;
+			scans.push_back(scan);
+		}
+	}
+
+	return scans;
+}
+
+
+// for_each_block
+// Visit the blocks of a scan in coding order, visit(c, block_id, unit) where unit counts restart units
+// Interleaved scans visit MCUs holding h x v blocks of each component in raster order
+// Single component scans visit the blocks inside the component in raster order
+template <typename Visit>
+void for_each_block(const Layout& layout, const Scan& scan, Visit visit)
+{
+	if (scan.components.size() > 1)
+	{
+		for (size_t m = 0; m < layout.nmw * layout.nmh; ++m)
+		{
+			const size_t mi = m / layout.nmw, mj = m % layout.nmw;
+
+			for (size_t c : scan.components)
+			{
+				const Component& comp = layout.comps[c];
+
+				for (size_t y = 0; y < comp.v; ++y)
+					for (size_t x = 0; x < comp.h; ++x)
+						visit(c, (mi * comp.v + y) * layout.PlaneWidth(c) + mj * comp.h + x, m);
+			}
+		}
+	}
+	else
+	{
+		// MCU is a single block
+		const size_t c = scan.components[0];
+
+		for (size_t i = 0; i < layout.inner_h[c]; ++i)
+			for (size_t j = 0; j < layout.inner_w[c]; ++j)
+				visit(c, i * layout.PlaneWidth(c) + j, i * layout.inner_w[c] + j);
+	}
+}
+
+
+//
+//
+void DecodeScan(const Frame& frame, JFIFBitStream* in, vector<vector<float> >& planes)
+{
+	const Layout layout(frame);
+	const Scan& scan = frame.scan;
+
+	// tables may be redefined between scans
+	vector<jpeg::huffman_coding::HuffmanTable> dc_tables(frame.components.size()), ac_tables(frame.components.size());
+
+	for (size_t c : scan.components)
+	{
+		const Component& comp = frame.components[c];
+
+		if (scan.ss == 0)
+		{
+			if (frame.dc_bits[comp.dc_table].empty())
+				throw std::runtime_error("Missing table");
+			dc_tables[c] = jpeg::huffman_coding::HuffmanTable(frame.dc_bits[comp.dc_table], frame.dc_values[comp.dc_table]);
+		}
+
+		if (scan.se > 0)
+		{
+			if (frame.ac_bits[comp.ac_table].empty())
+				throw std::runtime_error("Missing table");
+			ac_tables[c] = jpeg::huffman_coding::HuffmanTable(frame.ac_bits[comp.ac_table], frame.ac_values[comp.ac_table]);
+		}
+	}
+
+	vector<int> prev_dc_coef(frame.components.size(), 0);
+	int eobrun{};
+	size_t last_unit{};
+
+	for_each_block(layout, scan, [&](size_t c, size_t block_id, size_t unit) {
+		// first block of a new restart interval
+		if (frame.restart_interval && unit != last_unit && unit % frame.restart_interval == 0)
+		{
+			in->Restart();
+			for (int& prev : prev_dc_coef)
+				prev = 0;
+			eobrun = 0;
+		}
+		last_unit = unit;
+
+		if (frame.progressive)
+			jpeg::huffman_coding::DecodeBand(planes[c], block_id, c, scan.ss, scan.se, prev_dc_coef[c], eobrun, in, dc_tables[c], ac_tables[c]);
+		else
+			jpeg::huffman_coding::DecodeBlock(planes[c], block_id, c, prev_dc_coef[c], in, dc_tables[c], ac_tables[c]);
+	});
+}
+
+
+//
+//
+void EncodeScan(const Frame& frame, const Scan& scan, const vector<vector<float> >& planes, BitStream* out)
+{
+	const Layout layout(frame);
+
+	vector<jpeg::huffman_coding::HuffmanTable> dc_tables(frame.components.size()), ac_tables(frame.components.size());
+
+	for (size_t c : scan.components)
+	{
+		const Component& comp = frame.components[c];
+
+		if (frame.dc_bits[comp.dc_table].empty() || frame.ac_bits[comp.ac_table].empty())
+			throw std::runtime_error("Missing table");
+
+		dc_tables[c] = jpeg::huffman_coding::HuffmanTable(frame.dc_bits[comp.dc_table], frame.dc_values[comp.dc_table]);
+		ac_tables[c] = jpeg::huffman_coding::HuffmanTable(frame.ac_bits[comp.ac_table], frame.ac_values[comp.ac_table]);
+	}
+
+	vector<int> prev_dc_coef(frame.components.size(), 0);
+
+	for_each_block(layout, scan, [&](size_t c, size_t block_id, size_t) {
+		jpeg::huffman_coding::EncodeBand(planes[c], block_id, c, scan.ss, scan.se, prev_dc_coef[c], out, dc_tables[c], ac_tables[c]);
+	});
+}
+
+
+//
+//
+Coefficients ReadCoefficients(std::istream& in, std::function<void(const Coefficients&, size_t)> on_scan, size_t max_pixels)
+{
+	Coefficients coefs;
+	coefs.frame = ReadHeaders(in);
+
+	if (max_pixels > 0 && (size_t)coefs.frame.width * coefs.frame.height > max_pixels)
+		throw std::runtime_error("Image too large");
+
+	const Layout layout(coefs.frame);
+
+	coefs.planes.resize(coefs.frame.components.size());
+	for (size_t c = 0; c < coefs.planes.size(); ++c)
+		coefs.planes[c].assign(layout.PlaneWidth(c) * layout.PlaneHeight(c) * 256, 0.f);
+
+	size_t scans{};
+
+	do
+	{
+		JFIFBitStream stream;
+		stream.Read(in);
+
+		DecodeScan(coefs.frame, &stream, coefs.planes);
+
+		if (on_scan)
+			on_scan(coefs, ++scans);
+	}
+	while (NextScan(in, coefs.frame));
+
+	return coefs;
+}
+
+
+//
+//
+void WriteCoefficients(std::ostream& out, const Coefficients& coefs)
+{
+	Frame frame = coefs.frame;
+	frame.restart_interval = 0;
+
+	WriteHeaders(out, frame);
+
+	for (const Scan& scan : DefaultScans(frame))
+	{
+		JFIFBitStream stream;
+		EncodeScan(frame, scan, coefs.planes, &stream);
+
+		WriteScan(out, frame, scan);
+		stream.Write(out);
+	}
+
+	WriteEnd(out);
+}
+
+
+//
+//
+void SetDefaultTables(Frame& frame)
+{
+	const jpeg::huffman_coding::HuffmanTable& dc_table = jpeg::huffman_coding::DefaultTable_DC();
+	const jpeg::huffman_coding::HuffmanTable& ac_table = jpeg::huffman_coding::DefaultTable_AC();
+
+	for (size_t t = 0; t < MAX_TABLES; ++t)
+	{
+		frame.dc_bits[t].clear();
+		frame.dc_values[t].clear();
+		frame.ac_bits[t].clear();
+		frame.ac_values[t].clear();
+	}
+
+	frame.dc_bits[0] = dc_table.bits;
+	frame.dc_values[0] = dc_table.values;
+	frame.ac_bits[0] = ac_table.bits;
+	frame.ac_values[0] = ac_table.values;
+
+	for (Component& comp : frame.components)
+		comp.dc_table = comp.ac_table = 0;
+}
+
+//
+//
+void SetOptimalTables(Coefficients& coefs)
+{
+	Frame& frame = coefs.frame;
+	const Layout layout(frame);
+
+	// table 0 for Y, table 1 for chroma
+	vector<size_t> dc_freq[2], ac_freq[2];
+	for (size_t t = 0; t < 2; ++t)
+	{
+		dc_freq[t].assign(256, 0);
+		ac_freq[t].assign(256, 0);
+	}
+
+	for (const Scan& scan : DefaultScans(frame))
+	{
+		vector<int> prev_dc_coef(frame.components.size(), 0);
+
+		for_each_block(layout, scan, [&](size_t c, size_t block_id, size_t) {
+			const size_t t = c == 0 ? 0 : 1;
+			jpeg::huffman_coding::CountBand(coefs.planes[c], block_id, c, scan.ss, scan.se, prev_dc_coef[c], dc_freq[t], ac_freq[t]);
+		});
+	}
+
+	for (size_t t = 0; t < MAX_TABLES; ++t)
+	{
+		frame.dc_bits[t].clear();
+		frame.dc_values[t].clear();
+		frame.ac_bits[t].clear();
+		frame.ac_values[t].clear();
+	}
+
+	for (size_t c = 0; c < frame.components.size(); ++c)
+	{
+		const size_t t = c == 0 ? 0 : 1;
+
+		if (frame.dc_bits[t].empty())
+		{
+			const jpeg::huffman_coding::HuffmanTable dc_table = jpeg::huffman_coding::OptimalTable(dc_freq[t]);
+			const jpeg::huffman_coding::HuffmanTable ac_table = jpeg::huffman_coding::OptimalTable(ac_freq[t]);
+
+			frame.dc_bits[t] = dc_table.bits;
+			frame.dc_values[t] = dc_table.values;
+			frame.ac_bits[t] = ac_table.bits;
+			frame.ac_values[t] = ac_table.values;
+		}
+
+		frame.components[c].dc_table = frame.components[c].ac_table = (uint8_t)t;
+	}
+}
+}
+}
@@ -0,0 +1,129 @@
+#ifndef JFIF_H
+#define JFIF_H
+
+#ifdef UNIT_TEST_FLAG
+#include "Jfif.cpp"
+#endif
+
+#include <iostream>
+#include <vector>
+#include <cstdint>
+#include <functional>
+
+#include "BitStream.h"
+
+namespace jpeg
+{
+namespace jfif
+{
+// Baseline and progressive JFIF (ITU T.81 + JFIF 1.01) marker segments
+// Multi-byte fields are big-endian, each segment length includes itself
+//
+// SOI, APP0 "JFIF", DQT..., SOF0|SOF2, DHT..., [DRI], { [DHT...], SOS, <entropy-coded data> }..., EOI
+
+constexpr uint16_t SOI = 0xFFD8;
+constexpr uint16_t EOI = 0xFFD9;
+constexpr uint16_t APP0 = 0xFFE0;
+constexpr uint16_t DQT = 0xFFDB;
+constexpr uint16_t SOF0 = 0xFFC0;
+constexpr uint16_t SOF2 = 0xFFC2;
+constexpr uint16_t DHT = 0xFFC4;
+constexpr uint16_t SOS = 0xFFDA;
+constexpr uint16_t DRI = 0xFFDD;
+
+constexpr size_t MAX_TABLES = 4;
+
+struct Component
+{
+	uint8_t id;
+	uint8_t h, v;        // sampling factors
+	uint8_t quant_table;
+	uint8_t dc_table;
+	uint8_t ac_table;
+};
+
+// Spectral selection of a scan, successive approximation is not supported
+struct Scan
+{
+	std::vector<uint8_t> components; // indices into Frame::components
+	uint8_t ss{ 0 }, se{ 63 };
+};
+
+struct Frame
+{
+	uint16_t width{};
+	uint16_t height{};
+	bool progressive{};
+	std::vector<Component> components;
+
+	// tables by destination id, empty if not defined
+	std::vector<int> quant[MAX_TABLES];                        // natural order
+	std::vector<int> dc_bits[MAX_TABLES], dc_values[MAX_TABLES]; // DHT form
+	std::vector<int> ac_bits[MAX_TABLES], ac_values[MAX_TABLES]; // DHT form
+
+	uint16_t restart_interval{};
+
+	// scan being read, table selectors of its components are in Component
+	Scan scan;
+};
+
+// Everything from SOI up to the first SOS
+void WriteHeaders(std::ostream& out, const Frame& frame);
+void WriteScan(std::ostream& out, const Frame& frame, const Scan& scan);
+void WriteEnd(std::ostream& out);
+
+// Parse up to and including the first SOS, the stream is left at the entropy-coded data
+// Baseline (SOF0) and spectral selection progressive (SOF2) frames are accepted
+Frame ReadHeaders(std::istream& in);
+// Parse segments following a scan up to and including the next SOS
+// ret: false at EOI or end of file
+bool NextScan(std::istream& in, Frame& frame);
+
+// Block grids of a frame
+// Each component has its own plane of (nmw * h) x (nmh * v) blocks
+struct Layout
+{
+	Layout(const Frame& frame);
+
+	size_t PlaneWidth(size_t c) const { return nmw * comps[c].h; }
+	size_t PlaneHeight(size_t c) const { return nmh * comps[c].v; }
+
+	std::vector<Component> comps; // a single component frame is sampled 1x1
+	size_t hmax, vmax;
+	size_t nmw, nmh;
+	std::vector<size_t> inner_w, inner_h; // blocks inside the image
+};
+
+// Quantized coefs of a whole image
+// planes[c] holds blocks of 256 floats like the rest of the codec, coefs of component c
+// are at offset c * 64 in zigzag order
+struct Coefficients
+{
+	Frame frame;
+	std::vector<std::vector<float> > planes;
+};
+
+// Sequential: one interleaved scan
+// Progressive: interleaved DC scan, then AC 1-5 and 6-63 of each component
+std::vector<Scan> DefaultScans(const Frame& frame);
+
+// Entropy coding of one scan, restart markers are not written
+void DecodeScan(const Frame& frame, JFIFBitStream* in, std::vector<std::vector<float> >& planes);
+void EncodeScan(const Frame& frame, const Scan& scan, const std::vector<std::vector<float> >& planes, BitStream* out);
+
+// Whole files, on_scan is called after each scan with the number of scans read so far
+// Frames above max_pixels (0: no limit) throw before their planes are allocated
+Coefficients ReadCoefficients(
+	std::istream& in,
+	std::function<void(const Coefficients&, size_t)> on_scan = nullptr,
+	size_t max_pixels = 0);
+void WriteCoefficients(std::ostream& out, const Coefficients& coefs);
+
+// Use the default Huffman tables for every component
+void SetDefaultTables(Frame& frame);
+// Tables built from the symbols of DefaultScans, table 0 for Y and table 1 for chroma
+void SetOptimalTables(Coefficients& coefs);
+}
+}
+
+#endif // !JFIF_H
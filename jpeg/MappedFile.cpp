@@ -0,0 +1,95 @@
+#include "MappedFile.h"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+
+#ifdef _WIN32
+MappedFile::MappedFile(const string& filename) : m_data(nullptr), m_size(0)
+{
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("File missing");
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		throw std::runtime_error("File missing");
+	}
+
+	// no mapping of empty files
+	if (size.QuadPart > 0)
+	{
+		HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (mapping)
+		{
+			m_data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			m_size = m_data ? (size_t)size.QuadPart : 0;
+
+			// the view keeps the mapping alive
+			CloseHandle(mapping);
+		}
+	}
+
+	CloseHandle(file);
+
+	if (size.QuadPart > 0 && !m_data) throw std::runtime_error("Cannot map file");
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_data)
+		UnmapViewOfFile(m_data);
+}
+#else
+MappedFile::MappedFile(const string& filename) : m_data(nullptr), m_size(0)
+{
+	const int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) throw std::runtime_error("File missing");
+
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+	{
+		close(fd);
+		throw std::runtime_error("File missing");
+	}
+
+	// no mapping of empty files
+	if (st.st_size > 0)
+	{
+		void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			m_data = (const unsigned char*)data;
+			m_size = (size_t)st.st_size;
+
+			// decoding walks the file front to back
+			madvise(data, m_size, MADV_SEQUENTIAL);
+		}
+	}
+
+	close(fd);
+
+	if (st.st_size > 0 && !m_data) throw std::runtime_error("Cannot map file");
+}
+
+MappedFile::~MappedFile()
+{
+	if (m_data)
+		munmap((void*)m_data, m_size);
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#ifdef UNIT_TEST_FLAG
+#include "MappedFile.cpp"
+#endif
+
+#include <string>
+#include <cstddef>
+
+// Whole file mapped read only, pages are loaded as they are read
+// Throws "File missing" if the file cannot be opened. An empty file maps to no data.
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& filename);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	const unsigned char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+
+private:
+	const unsigned char* m_data;
+	size_t m_size;
+};
+
+#endif // !MAPPED_FILE_H
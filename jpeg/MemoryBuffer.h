@@ -0,0 +1,59 @@
+#ifndef MEMORY_BUFFER_H
+#define MEMORY_BUFFER_H
+
+#include <streambuf>
+#include <ios>
+#include <cstddef>
+
+// Stream buffer over fixed memory, nothing is copied
+// Streams on it read the memory in place and write into it, writing past its end fails the
+// stream. Seekable, the JFIF reader puts the stream back at the marker after a scan.
+class MemoryBuffer : public std::streambuf
+{
+public:
+	MemoryBuffer(char* data, size_t size)
+	{
+		setg(data, data, data + size);
+		setp(data, data + size);
+	}
+
+	// Read only memory, writes fail
+	MemoryBuffer(const char* data, size_t size)
+	{
+		char* begin = const_cast<char*>(data);
+		setg(begin, begin, begin + size);
+	}
+
+	size_t written() const { return (size_t)(pptr() - pbase()); }
+
+protected:
+	pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+	{
+		const bool in = (which & std::ios_base::in) != 0;
+		const bool out = (which & std::ios_base::out) != 0 && pbase() != nullptr;
+
+		const off_type size = egptr() - eback();
+		const off_type cur = in ? gptr() - eback() : pptr() - pbase();
+		const off_type pos = dir == std::ios_base::beg ? off : dir == std::ios_base::cur ? cur + off : size + off;
+
+		if ((!in && !out) || pos < 0 || pos > size)
+			return pos_type(off_type(-1));
+
+		if (in)
+			setg(eback(), eback() + pos, egptr());
+		if (out)
+		{
+			setp(pbase(), epptr());
+			pbump((int)pos);
+		}
+
+		return pos_type(pos);
+	}
+
+	pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+	{
+		return seekoff(off_type(pos), std::ios_base::beg, which);
+	}
+};
+
+#endif // !MEMORY_BUFFER_H
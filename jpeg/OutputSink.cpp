@@ -0,0 +1,105 @@
+#include "OutputSink.h"
+
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+
+
+void VectorSink::Reserve(size_t size)
+{
+	m_out.reserve(m_out.size() + size);
+}
+
+void VectorSink::Write(const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+	m_out.insert(m_out.end(), bytes, bytes + size);
+}
+
+
+void StringSink::Reserve(size_t size)
+{
+	m_out.reserve(m_out.size() + size);
+}
+
+void StringSink::Write(const void* data, size_t size)
+{
+	m_out.append((const char*)data, size);
+}
+
+
+void MemorySink::Write(const void* data, size_t size)
+{
+	if (size > m_capacity - m_size)
+		throw std::runtime_error("Buffer too small");
+
+	memcpy(m_data + m_size, data, size);
+	m_size += size;
+}
+
+
+void StreamSink::Write(const void* data, size_t size)
+{
+	if (!m_out.write((const char*)data, (std::streamsize)size))
+		throw std::runtime_error("Write failed");
+}
+
+
+SinkBuffer::SinkBuffer(OutputSink& sink) : m_sink(sink)
+{
+	setp(m_buffer, m_buffer + sizeof(m_buffer));
+}
+
+SinkBuffer::~SinkBuffer()
+{
+	try
+	{
+		flush();
+	}
+	catch (const std::exception&)
+	{}
+}
+
+void SinkBuffer::flush()
+{
+	const size_t n = (size_t)(pptr() - pbase());
+	setp(m_buffer, m_buffer + sizeof(m_buffer));
+
+	if (n > 0)
+		m_sink.Write(m_buffer, n);
+}
+
+SinkBuffer::int_type SinkBuffer::overflow(int_type c)
+{
+	flush();
+
+	if (!traits_type::eq_int_type(c, traits_type::eof()))
+	{
+		*pptr() = traits_type::to_char_type(c);
+		pbump(1);
+	}
+
+	return traits_type::not_eof(c);
+}
+
+streamsize SinkBuffer::xsputn(const char* data, streamsize size)
+{
+	// gathered while it fits, else straight to the sink
+	if (size <= epptr() - pptr())
+	{
+		memcpy(pptr(), data, (size_t)size);
+		pbump((int)size);
+		return size;
+	}
+
+	flush();
+	m_sink.Write(data, (size_t)size);
+	return size;
+}
+
+int SinkBuffer::sync()
+{
+	flush();
+	return 0;
+}
@@ -0,0 +1,111 @@
+#ifndef OUTPUT_SINK_H
+#define OUTPUT_SINK_H
+
+#ifdef UNIT_TEST_FLAG
+#include "OutputSink.cpp"
+#endif
+
+#include <vector>
+#include <string>
+#include <streambuf>
+#include <ostream>
+#include <cstdint>
+#include <cstddef>
+
+// Destination of encoded bytes supplied by the caller
+// Encoders call Reserve with the size of the file when they know it before writing, then Write
+// the file in a few large pieces. A sink grows the memory behind it as it likes.
+class OutputSink
+{
+public:
+	virtual ~OutputSink() {}
+
+	// Room for that many more bytes, a hint
+	virtual void Reserve(size_t) {}
+	virtual void Write(const void* data, size_t size) = 0;
+};
+
+// Appends to a vector, capacity it already has is filled without reallocating
+class VectorSink : public OutputSink
+{
+public:
+	explicit VectorSink(std::vector<uint8_t>& out) : m_out(out)
+	{}
+
+	virtual void Reserve(size_t size);
+	virtual void Write(const void* data, size_t size);
+
+private:
+	std::vector<uint8_t>& m_out;
+};
+
+// Appends to a string
+class StringSink : public OutputSink
+{
+public:
+	explicit StringSink(std::string& out) : m_out(out)
+	{}
+
+	virtual void Reserve(size_t size);
+	virtual void Write(const void* data, size_t size);
+
+private:
+	std::string& m_out;
+};
+
+// Fills fixed memory, throws "Buffer too small" past its end
+class MemorySink : public OutputSink
+{
+public:
+	MemorySink(void* data, size_t capacity) : m_data((uint8_t*)data), m_capacity(capacity), m_size(0)
+	{}
+
+	virtual void Write(const void* data, size_t size);
+
+	// bytes written
+	size_t size() const { return m_size; }
+
+private:
+	uint8_t* m_data;
+	size_t m_capacity;
+	size_t m_size;
+};
+
+// Writes to a stream
+class StreamSink : public OutputSink
+{
+public:
+	explicit StreamSink(std::ostream& out) : m_out(out)
+	{}
+
+	// throws "Write failed" once the stream failed
+	virtual void Write(const void* data, size_t size);
+
+private:
+	std::ostream& m_out;
+};
+
+// Stream buffer writing to a sink, for coders that write to streams
+// Small writes are gathered, large ones go to the sink as they are. Not seekable, coders treat it
+// like a pipe.
+class SinkBuffer : public std::streambuf
+{
+public:
+	explicit SinkBuffer(OutputSink& sink);
+	// Flushes, errors of the sink are lost here, call pubsync first to get them
+	~SinkBuffer();
+
+protected:
+	int_type overflow(int_type c) override;
+	std::streamsize xsputn(const char* data, std::streamsize size) override;
+	int sync() override;
+
+private:
+	void flush();
+
+private:
+	OutputSink& m_sink;
+	char m_buffer[4096];
+};
+
+#endif // !OUTPUT_SINK_H
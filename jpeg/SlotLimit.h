@@ -0,0 +1,49 @@
+#ifndef SLOT_LIMIT_H
+#define SLOT_LIMIT_H
+
+#include <mutex>
+#include <condition_variable>
+#include <cstddef>
+
+// Bounded number of slots shared by producers, for back-pressure on job queues
+// acquire blocks until n more slots fit under the limit. A request for more than the limit still
+// goes through once every slot is free, it would wait forever otherwise.
+class SlotLimit
+{
+public:
+	explicit SlotLimit(size_t limit) : m_limit(limit > 0 ? limit : 1), m_used(0)
+	{}
+
+	void acquire(size_t n = 1)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_space.wait(lock, [this, n]() { return m_used == 0 || m_used + n <= m_limit; });
+		m_used += n;
+	}
+
+	void release(size_t n = 1)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_used -= n;
+		}
+		m_space.notify_all();
+	}
+
+	// Slots taken
+	size_t used()
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_used;
+	}
+
+	size_t limit() const { return m_limit; }
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_space;
+	const size_t m_limit;
+	size_t m_used;
+};
+
+#endif // !SLOT_LIMIT_H
@@ -0,0 +1,100 @@
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstddef>
+
+// Bounded lock-free queue between one producer and one consumer thread
+// Ring of capacity + 1 slots, only the producer moves m_tail and only the consumer moves m_head.
+// Push and Pop yield while the queue is full or empty, stages of a pipeline are expected to wait
+// on each other only briefly. The overloads taking a stop flag give up once it is set, so a failed
+// stage can't leave the others waiting forever.
+template <typename T>
+class SpscQueue
+{
+public:
+	explicit SpscQueue(size_t capacity) : m_slots(capacity + 1), m_head(0), m_tail(0)
+	{}
+
+	// ret: false if full, value is left untouched
+	bool TryPush(T& value)
+	{
+		const size_t tail = m_tail.load(std::memory_order_relaxed);
+		const size_t next = (tail + 1) % m_slots.size();
+
+		if (next == m_head.load(std::memory_order_acquire))
+			return false;
+
+		m_slots[tail] = std::move(value);
+		m_tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	// ret: false if empty
+	bool TryPop(T& value)
+	{
+		const size_t head = m_head.load(std::memory_order_relaxed);
+
+		if (head == m_tail.load(std::memory_order_acquire))
+			return false;
+
+		value = std::move(m_slots[head]);
+		m_head.store((head + 1) % m_slots.size(), std::memory_order_release);
+		return true;
+	}
+
+	void Push(T value)
+	{
+		while (!TryPush(value))
+			std::this_thread::yield();
+	}
+
+	T Pop()
+	{
+		T value;
+		while (!TryPop(value))
+			std::this_thread::yield();
+		return value;
+	}
+
+	// ret: false if stop was set before the value went in
+	bool Push(T value, const std::atomic<bool>& stop)
+	{
+		while (!TryPush(value))
+		{
+			if (stop.load(std::memory_order_relaxed))
+				return false;
+			std::this_thread::yield();
+		}
+		return true;
+	}
+
+	// ret: false if stop was set while the queue was empty
+	bool Pop(T& value, const std::atomic<bool>& stop)
+	{
+		while (!TryPop(value))
+		{
+			if (stop.load(std::memory_order_relaxed))
+				return false;
+			std::this_thread::yield();
+		}
+		return true;
+	}
+
+private:
+	// padding rather than alignas, new does not honour over-alignment before C++17
+	static const size_t CACHE_LINE = 64;
+
+	std::vector<T> m_slots;
+
+	// on separate cache lines, each is written by one side only
+	char m_pad0[CACHE_LINE];
+	std::atomic<size_t> m_head;
+	char m_pad1[CACHE_LINE - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> m_tail;
+	char m_pad2[CACHE_LINE - sizeof(std::atomic<size_t>)];
+};
+
+#endif // !SPSC_QUEUE_H
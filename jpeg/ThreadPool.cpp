@@ -0,0 +1,130 @@
+#include "ThreadPool.h"
+
+// pool of the calling thread and its worker index
+static thread_local const ThreadPool* tls_pool = nullptr;
+static thread_local int tls_index = -1;
+
+
+ThreadPool::ThreadPool(size_t threads) : m_queued(0), m_pending(0), m_next(0), m_stop(false)
+{
+	if (threads == 0)
+		threads = std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+
+	for (size_t i = 0; i < threads; ++i)
+		m_queues.emplace_back(new Queue);
+
+	for (size_t i = 0; i < threads; ++i)
+		m_workers.emplace_back(&ThreadPool::run, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_wake.notify_all();
+
+	for (std::thread& worker : m_workers)
+		worker.join();
+}
+
+int ThreadPool::WorkerIndex()
+{
+	return tls_index;
+}
+
+// Submit
+// Workers push to their own deque, other threads round robin
+void ThreadPool::Submit(std::function<void()> task)
+{
+	size_t index;
+	{
+		// counted before the push, a worker taking the task right away must not take m_queued below 0
+		std::lock_guard<std::mutex> lock(m_mutex);
+		++m_pending;
+		++m_queued;
+		index = tls_pool == this ? (size_t)tls_index : m_next++ % m_queues.size();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+		m_queues[index]->tasks.push_back(std::move(task));
+	}
+
+	m_wake.notify_one();
+}
+
+void ThreadPool::Wait()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	m_idle.wait(lock, [this]() { return m_pending == 0; });
+}
+
+// take
+// Newest task of own deque, else oldest task of the others
+bool ThreadPool::take(size_t index, std::function<void()>& task)
+{
+	const size_t n = m_queues.size();
+
+	for (size_t k = 0; k < n; ++k)
+	{
+		Queue& queue = *m_queues[(index + k) % n];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+
+		if (queue.tasks.empty())
+			continue;
+
+		if (k == 0)
+		{
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		}
+		else
+		{
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+
+		return true;
+	}
+
+	return false;
+}
+
+void ThreadPool::run(size_t index)
+{
+	tls_pool = this;
+	tls_index = (int)index;
+
+	std::function<void()> task;
+
+	for (;;)
+	{
+		if (take(index, task))
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				--m_queued;
+			}
+
+			task();
+			task = nullptr;
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_pending == 0)
+				m_idle.notify_all();
+
+			continue;
+		}
+
+		// a task counted in m_queued may be taken by another worker before this one gets to it
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wake.wait(lock, [this]() { return m_queued > 0 || m_stop; });
+
+		if (m_stop && m_queued == 0)
+			return;
+	}
+}
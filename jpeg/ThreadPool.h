@@ -0,0 +1,60 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#ifdef UNIT_TEST_FLAG
+#include "ThreadPool.cpp"
+#endif
+
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+// Work-stealing thread pool
+// Every worker owns a deque, it takes its newest task first (the one most likely still in cache)
+// and when empty steals the oldest task of another worker. Tasks submitted by a worker go to its
+// own deque, tasks submitted from outside are spread over all of them.
+class ThreadPool
+{
+public:
+	// 0 threads: one per hardware thread
+	explicit ThreadPool(size_t threads = 0);
+	~ThreadPool();
+
+	size_t size() const { return m_workers.size(); }
+
+	// Tasks must not throw
+	void Submit(std::function<void()> task);
+	// Block until every submitted task has run, must not be called from a task
+	void Wait();
+
+	// Index of the calling worker in its pool, -1 outside pools
+	static int WorkerIndex();
+
+private:
+	struct Queue
+	{
+		std::mutex mutex;
+		std::deque<std::function<void()> > tasks;
+	};
+
+	void run(size_t index);
+	bool take(size_t index, std::function<void()>& task);
+
+private:
+	std::vector<std::thread> m_workers;
+	std::vector<std::unique_ptr<Queue> > m_queues;
+
+	std::mutex m_mutex;
+	std::condition_variable m_wake;  // tasks queued or stopping
+	std::condition_variable m_idle;  // nothing pending
+	size_t m_queued;                 // tasks submitted and not taken yet
+	size_t m_pending;                // tasks submitted and not finished
+	size_t m_next;                   // deque of the next outside submit
+	bool m_stop;
+};
+
+#endif // !THREAD_POOL_H
@@ -0,0 +1,656 @@
+#include "Transcode.h"
+#include "jpeg.h"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <utility>
+#include <map>
+
+namespace jpeg
+{
+namespace transcode
+{
+using std::vector;
+using jpeg::jfif::Coefficients;
+using jpeg::jfif::Frame;
+using jpeg::jfif::Layout;
+
+
+// CoefMap
+// Where each zigzag coef of a destination block comes from
+struct CoefMap
+{
+	size_t source[64];
+	float sign[64];
+};
+
+
+// make_coef_map
+// Transposing a block transposes its coefs, mirroring it negates the coefs of odd frequency
+// in that direction. Flips apply after the transpose.
+CoefMap make_coef_map(bool transpose, bool flip_h, bool flip_v)
+{
+	CoefMap map;
+	size_t zigzag_of[64];
+
+	for (size_t e = 0; e < 64; ++e)
+		zigzag_of[jpeg::util::zigzag_mat8x8[e]] = e;
+
+	for (size_t e = 0; e < 64; ++e)
+	{
+		const size_t n = jpeg::util::zigzag_mat8x8[e];
+		const size_t v = n / 8, u = n % 8;
+
+		map.source[e] = zigzag_of[transpose ? u * 8 + v : n];
+		map.sign[e] = ((flip_h && u % 2) != (flip_v && v % 2)) ? -1.f : 1.f;
+	}
+
+	return map;
+}
+
+
+// copy_block
+// Copy coefs of channel c from one block to another through a CoefMap
+void copy_block(
+	const vector<float>& src, size_t src_id,
+	vector<float>& dst, size_t dst_id,
+	size_t c, const CoefMap& map)
+{
+	const size_t src_offset = src_id * 256 + c * 64;
+	const size_t dst_offset = dst_id * 256 + c * 64;
+
+	for (size_t e = 0; e < 64; ++e)
+		dst[dst_offset + e] = map.sign[e] * src[src_offset + map.source[e]];
+}
+
+
+// alloc_planes
+// Zeroed planes for the layout of a frame
+vector<vector<float> > alloc_planes(const Layout& layout)
+{
+	vector<vector<float> > planes(layout.comps.size());
+
+	for (size_t c = 0; c < planes.size(); ++c)
+		planes[c].assign(layout.PlaneWidth(c) * layout.PlaneHeight(c) * 256, 0.f);
+
+	return planes;
+}
+
+
+//
+//
+Coefficients Apply(const Coefficients& src, Transform transform)
+{
+	bool transpose{}, flip_h{}, flip_v{};
+
+	switch (transform)
+	{
+	case Transform::FlipH: flip_h = true; break;
+	case Transform::FlipV: flip_v = true; break;
+	case Transform::Transpose: transpose = true; break;
+	case Transform::Transverse: transpose = flip_h = flip_v = true; break;
+	case Transform::Rotate90: transpose = flip_h = true; break;
+	case Transform::Rotate180: flip_h = flip_v = true; break;
+	case Transform::Rotate270: transpose = flip_v = true; break;
+	}
+
+	Coefficients dst;
+	dst.frame = src.frame;
+	Frame& frame = dst.frame;
+
+	if (transpose)
+	{
+		std::swap(frame.width, frame.height);
+
+		for (auto& comp : frame.components)
+			std::swap(comp.h, comp.v);
+
+		// steps follow their coefs
+		for (auto& quant : frame.quant)
+		{
+			if (quant.empty())
+				continue;
+
+			const vector<int> copy = quant;
+			for (size_t n = 0; n < 64; ++n)
+				quant[n] = copy[(n % 8) * 8 + n / 8];
+		}
+	}
+
+	// drop partial MCUs in flipped directions
+	{
+		const Layout layout(frame);
+		const size_t mcu_w = 8 * layout.hmax, mcu_h = 8 * layout.vmax;
+
+		if (flip_h)
+			frame.width = (uint16_t)(frame.width / mcu_w * mcu_w);
+		if (flip_v)
+			frame.height = (uint16_t)(frame.height / mcu_h * mcu_h);
+
+		if (frame.width == 0 || frame.height == 0)
+			throw std::runtime_error("Image smaller than one MCU");
+	}
+
+	const Layout src_layout(src.frame);
+	const Layout dst_layout(frame);
+	const CoefMap map = make_coef_map(transpose, flip_h, flip_v);
+
+	dst.planes = alloc_planes(dst_layout);
+
+	for (size_t c = 0; c < dst.planes.size(); ++c)
+	{
+		const size_t pw = dst_layout.PlaneWidth(c), ph = dst_layout.PlaneHeight(c);
+		const size_t sw = src_layout.PlaneWidth(c);
+
+		for (size_t i = 0; i < ph; ++i)
+			for (size_t j = 0; j < pw; ++j)
+			{
+				const size_t ii = flip_v ? ph - 1 - i : i;
+				const size_t jj = flip_h ? pw - 1 - j : j;
+				const size_t src_id = transpose ? jj * sw + ii : ii * sw + jj;
+
+				copy_block(src.planes[c], src_id, dst.planes[c], i * pw + j, c, map);
+			}
+	}
+
+	return dst;
+}
+
+
+//
+//
+Coefficients Crop(const Coefficients& src, size_t x, size_t y, size_t w, size_t h)
+{
+	const Layout src_layout(src.frame);
+	const size_t mcu_w = 8 * src_layout.hmax, mcu_h = 8 * src_layout.vmax;
+
+	if (x % mcu_w != 0 || y % mcu_h != 0)
+		throw std::runtime_error("Crop origin not on an MCU boundary");
+
+	if (w == 0 || h == 0 || x + w > src.frame.width || y + h > src.frame.height)
+		throw std::out_of_range("Crop outside image");
+
+	Coefficients dst;
+	dst.frame = src.frame;
+	dst.frame.width = (uint16_t)w;
+	dst.frame.height = (uint16_t)h;
+
+	const Layout dst_layout(dst.frame);
+	const CoefMap map = make_coef_map(false, false, false);
+
+	dst.planes = alloc_planes(dst_layout);
+
+	for (size_t c = 0; c < dst.planes.size(); ++c)
+	{
+		const size_t pw = dst_layout.PlaneWidth(c), ph = dst_layout.PlaneHeight(c);
+		const size_t sw = src_layout.PlaneWidth(c);
+
+		// first source block of the crop
+		const size_t bi = y / mcu_h * dst_layout.comps[c].v;
+		const size_t bj = x / mcu_w * dst_layout.comps[c].h;
+
+		for (size_t i = 0; i < ph; ++i)
+			for (size_t j = 0; j < pw; ++j)
+				copy_block(src.planes[c], (bi + i) * sw + bj + j, dst.planes[c], i * pw + j, c, map);
+	}
+
+	return dst;
+}
+
+
+//
+//
+Coefficients Requantize(const Coefficients& src, float quality)
+{
+	const jpeg::util::QuantTable& table = jpeg::util::GetQuantTable(quality);
+
+	Coefficients dst;
+	dst.frame = src.frame;
+	dst.planes = src.planes;
+
+	Frame& frame = dst.frame;
+
+	for (auto& quant : frame.quant)
+		quant.clear();
+
+	// target steps of each component, table 0 for Y, table 1 for chroma
+	for (size_t c = 0; c < frame.components.size(); ++c)
+	{
+		const size_t t = c == 0 ? 0 : 1;
+		const vector<int>& src_steps = src.frame.quant[src.frame.components[c].quant_table];
+
+		if (src_steps.size() != 64)
+			throw std::runtime_error("Missing table");
+
+		if (frame.quant[t].empty())
+			frame.quant[t] = table.divisors[t];
+
+		// 8-bit DQT
+		for (size_t n = 0; n < 64; ++n)
+		{
+			int step = std::max(frame.quant[t][n], src_steps[n]);
+			frame.quant[t][n] = std::min(std::max(step, 1), 255);
+		}
+
+		frame.components[c].quant_table = (uint8_t)t;
+	}
+
+	for (size_t c = 0; c < frame.components.size(); ++c)
+	{
+		const vector<int>& src_steps = src.frame.quant[src.frame.components[c].quant_table];
+		const vector<int>& dst_steps = frame.quant[frame.components[c].quant_table];
+
+		float ratio[64];
+		for (size_t e = 0; e < 64; ++e)
+		{
+			const size_t n = jpeg::util::zigzag_mat8x8[e];
+			ratio[e] = (float)src_steps[n] / (float)dst_steps[n];
+		}
+
+		vector<float>& plane = dst.planes[c];
+
+		// source coefs are already rounded, ties go towards zero since rounding them away
+		// would push every odd coef up at a 2:1 ratio
+		for (size_t b = 0; b < plane.size() / 256; ++b)
+			for (size_t e = 0; e < 64; ++e)
+			{
+				float& coef = plane[b * 256 + c * 64 + e];
+				const float mag = std::ceil(std::fabs(coef * ratio[e]) - .5f);
+				coef = coef < 0.f ? -mag : mag;
+			}
+	}
+
+	return dst;
+}
+
+
+// transcode_file
+// Read coefs, apply an operation and write them back
+template <typename Op>
+void transcode_file(const std::string& src, const std::string& dst, Op op)
+{
+	std::fstream in(src, std::ios::in | std::ios::binary);
+	if (!in) throw std::runtime_error("File missing");
+
+	Coefficients coefs = op(jpeg::jfif::ReadCoefficients(in));
+
+	// symbols of moved coefs may be missing from optimized tables of the source
+	jpeg::jfif::SetDefaultTables(coefs.frame);
+
+	std::fstream out(dst, std::ios::out | std::ios::binary);
+	if (!out) throw std::runtime_error("File missing");
+
+	jpeg::jfif::WriteCoefficients(out, coefs);
+}
+
+
+//
+//
+void TransformFile(const std::string& src, const std::string& dst, Transform transform)
+{
+	transcode_file(src, dst, [&](const Coefficients& coefs) { return Apply(coefs, transform); });
+}
+
+
+//
+//
+void CropFile(const std::string& src, const std::string& dst, size_t x, size_t y, size_t w, size_t h)
+{
+	transcode_file(src, dst, [&](const Coefficients& coefs) { return Crop(coefs, x, y, w, h); });
+}
+
+//
+//
+void RequantizeFile(const std::string& src, const std::string& dst, float quality)
+{
+	transcode_file(src, dst, [&](const Coefficients& coefs) { return Requantize(coefs, quality); });
+}
+
+// LegacyCode
+// Huffman code of builds that wrote a text header line, before the container
+struct LegacyCode
+{
+	const char* code;
+	int run;
+	int category;
+};
+
+// DC codes by category, not the Annex K ones
+const LegacyCode legacy_dc_codes[]{
+	{ "010", 0, 0 }, { "011", 0, 1 }, { "100", 0, 2 }, { "00", 0, 3 },
+	{ "101", 0, 4 }, { "110", 0, 5 }, { "1110", 0, 6 }, { "11110", 0, 7 },
+	{ "111110", 0, 8 }, { "1111110", 0, 9 }, { "11111110", 0, 10 }, { "111111110", 0, 11 },
+};
+
+// AC codes, EOB first and ZRL (run 16) last
+// (8, 1) was written with the code of (7, 1), those builds read it back as (7, 1) and so do we
+const LegacyCode legacy_ac_codes[]{
+	{ "1010", 0, 0 }, { "00", 0, 1 }, { "01", 0, 2 }, { "100", 0, 3 },
+	{ "1011", 0, 4 }, { "11010", 0, 5 }, { "111000", 0, 6 }, { "1111000", 0, 7 },
+	{ "1111110110", 0, 8 }, { "1111111110000010", 0, 9 }, { "1111111110000011", 0, 10 }, { "1100", 1, 1 },
+	{ "111001", 1, 2 }, { "1111001", 1, 3 }, { "111110110", 1, 4 }, { "11111110110", 1, 5 },
+	{ "1111111110000100", 1, 6 }, { "1111111110000101", 1, 7 }, { "1111111110000110", 1, 8 }, { "1111111110000111", 1, 9 },
+	{ "1111111110001000", 1, 10 }, { "11011", 2, 1 }, { "11111000", 2, 2 }, { "1111110111", 2, 3 },
+	{ "1111111110001001", 2, 4 }, { "1111111110001010", 2, 5 }, { "1111111110001011", 2, 6 }, { "1111111110001100", 2, 7 },
+	{ "1111111110001101", 2, 8 }, { "1111111110001110", 2, 9 }, { "1111111110001111", 2, 10 }, { "111010", 3, 1 },
+	{ "111110111", 3, 2 }, { "11111110111", 3, 3 }, { "1111111110010000", 3, 4 }, { "1111111110010001", 3, 5 },
+	{ "1111111110010010", 3, 6 }, { "1111111110010011", 3, 7 }, { "1111111110010100", 3, 8 }, { "1111111110010101", 3, 9 },
+	{ "1111111110010110", 3, 10 }, { "111011", 4, 1 }, { "1111111000", 4, 2 }, { "1111111110010111", 4, 3 },
+	{ "1111111110011000", 4, 4 }, { "1111111110011001", 4, 5 }, { "1111111110011010", 4, 6 }, { "1111111110011011", 4, 7 },
+	{ "1111111110011100", 4, 8 }, { "1111111110011101", 4, 9 }, { "1111111110011110", 4, 10 }, { "1111010", 5, 1 },
+	{ "1111111001", 5, 2 }, { "1111111110011111", 5, 3 }, { "1111111110100000", 5, 4 }, { "1111111110100001", 5, 5 },
+	{ "1111111110100010", 5, 6 }, { "1111111110100011", 5, 7 }, { "1111111110100100", 5, 8 }, { "1111111110100101", 5, 9 },
+	{ "1111111110100110", 5, 10 }, { "1111011", 6, 1 }, { "11111111000", 6, 2 }, { "1111111110100111", 6, 3 },
+	{ "1111111110101000", 6, 4 }, { "1111111110101001", 6, 5 }, { "1111111110101010", 6, 6 }, { "1111111110101011", 6, 7 },
+	{ "1111111110101100", 6, 8 }, { "1111111110101101", 6, 9 }, { "1111111110101110", 6, 10 }, { "11111001", 7, 1 },
+	{ "11111111001", 7, 2 }, { "1111111110101111", 7, 3 }, { "1111111110110000", 7, 4 }, { "1111111110110001", 7, 5 },
+	{ "1111111110110010", 7, 6 }, { "1111111110110011", 7, 7 }, { "1111111110110100", 7, 8 }, { "1111111110110101", 7, 9 },
+	{ "1111111110110110", 7, 10 }, { "111111111000000", 8, 2 }, { "1111111110110111", 8, 3 }, { "1111111110111000", 8, 4 },
+	{ "1111111110111001", 8, 5 }, { "1111111110111010", 8, 6 }, { "1111111110111011", 8, 7 }, { "1111111110111100", 8, 8 },
+	{ "1111111110111101", 8, 9 }, { "1111111110111110", 8, 10 }, { "111111000", 9, 1 }, { "1111111110111111", 9, 2 },
+	{ "1111111111000000", 9, 3 }, { "1111111111000001", 9, 4 }, { "1111111111000010", 9, 5 }, { "1111111111000011", 9, 6 },
+	{ "1111111111000100", 9, 7 }, { "1111111111000101", 9, 8 }, { "1111111111000110", 9, 9 }, { "1111111111000111", 9, 10 },
+	{ "111111001", 10, 1 }, { "1111111111001000", 10, 2 }, { "1111111111001001", 10, 3 }, { "1111111111001010", 10, 4 },
+	{ "1111111111001011", 10, 5 }, { "1111111111001100", 10, 6 }, { "1111111111001101", 10, 7 }, { "1111111111001110", 10, 8 },
+	{ "1111111111001111", 10, 9 }, { "1111111111010000", 10, 10 }, { "111111010", 11, 1 }, { "1111111111010001", 11, 2 },
+	{ "1111111111010010", 11, 3 }, { "1111111111010011", 11, 4 }, { "1111111111010100", 11, 5 }, { "1111111111010101", 11, 6 },
+	{ "1111111111010110", 11, 7 }, { "1111111111010111", 11, 8 }, { "1111111111011000", 11, 9 }, { "1111111111011001", 11, 10 },
+	{ "1111111010", 12, 1 }, { "1111111111011010", 12, 2 }, { "1111111111011011", 12, 3 }, { "1111111111011100", 12, 4 },
+	{ "1111111111011101", 12, 5 }, { "1111111111011110", 12, 6 }, { "1111111111011111", 12, 7 }, { "1111111111100000", 12, 8 },
+	{ "1111111111100001", 12, 9 }, { "1111111111100010", 12, 10 }, { "11111111010", 13, 1 }, { "1111111111100011", 13, 2 },
+	{ "1111111111100100", 13, 3 }, { "1111111111100101", 13, 4 }, { "1111111111100110", 13, 5 }, { "1111111111100111", 13, 6 },
+	{ "1111111111101000", 13, 7 }, { "1111111111101001", 13, 8 }, { "1111111111101010", 13, 9 }, { "1111111111101011", 13, 10 },
+	{ "111111110110", 14, 1 }, { "1111111111101100", 14, 2 }, { "1111111111101101", 14, 3 }, { "1111111111101110", 14, 4 },
+	{ "1111111111101111", 14, 5 }, { "1111111111110000", 14, 6 }, { "1111111111110001", 14, 7 }, { "1111111111110010", 14, 8 },
+	{ "1111111111110011", 14, 9 }, { "1111111111110100", 14, 10 }, { "1111111111110101", 15, 1 }, { "1111111111110110", 15, 2 },
+	{ "1111111111110111", 15, 3 }, { "1111111111111000", 15, 4 }, { "1111111111111001", 15, 5 }, { "1111111111111010", 15, 6 },
+	{ "1111111111111011", 15, 7 }, { "1111111111111100", 15, 8 }, { "1111111111111101", 15, 9 }, { "1111111111111110", 15, 10 },
+	{ "111111110111", 16, 0 },
+};
+
+
+// legacy_symbol
+// Read bits until they form a code of the table, then its value bits
+// out: run, value
+void legacy_symbol(const std::map<std::string, std::pair<int, int> >& codes, StringBitStream& in, int& run, int& value)
+{
+	std::string code;
+
+	while (true)
+	{
+		const int bit = in.Pop();
+		if (bit < 0 || code.size() >= 16)
+			throw std::runtime_error("Invalid code format");
+
+		code.push_back((char)('0' + bit));
+
+		auto it = codes.find(code);
+		if (it == codes.end())
+			continue;
+
+		run = it->second.first;
+		const int category = it->second.second;
+
+		// negative values are stored as value - 1 in category bits, their first bit is 0
+		int bits = 0;
+		for (int i = 0; i < category; ++i)
+		{
+			const int b = in.Pop();
+			if (b < 0) throw std::runtime_error("Invalid code format");
+			bits = (bits << 1) | b;
+		}
+
+		value = category > 0 && (bits >> (category - 1)) == 0 ? bits - (1 << category) + 1 : bits;
+		return;
+	}
+}
+
+
+// read_legacy
+// Text MyJPEG file => header and quantized blocks in zigzag order
+// Line "w h quality", followed by 64 luma and 64 chroma steps in files of later builds, then the
+// payload as '0' / '1' characters. Files without steps divided the luma matrix by quality for
+// every channel without rounding, their steps are rounded here so pixels come out close, not equal.
+jpeg::container::Header read_legacy(std::istream& in, vector<float>& blocks)
+{
+	std::string line;
+	if (!std::getline(in, line))
+		throw std::runtime_error("Unknown file format");
+
+	std::stringstream config(line);
+
+	int w = 0, h = 0;
+	float quality = 0.f;
+	if (!(config >> w >> h >> quality) || w <= 0 || h <= 0 || !jpeg::util::IsValidQuality(quality))
+		throw std::runtime_error("Unknown file format");
+
+	jpeg::container::Header header;
+	header.width = (uint32_t)w;
+	header.height = (uint32_t)h;
+	header.quality = quality;
+	header.components = { { 0, 0, 0, 0 }, { 1, 1, 0, 0 }, { 2, 1, 0, 0 }, { 3, 0, 0, 0 } };
+
+	vector<int> steps(128);
+	size_t n = 0;
+	while (n < steps.size() && config >> steps[n])
+		++n;
+
+	if (n == steps.size())
+	{
+		header.quant[0].assign(steps.begin(), steps.begin() + 64);
+		header.quant[1].assign(steps.begin() + 64, steps.end());
+	}
+	else if (n == 0)
+	{
+		header.quant[0] = header.quant[1] = jpeg::util::QuantTable(quality).divisors[0];
+	}
+	else
+	{
+		throw std::runtime_error("Unknown file format");
+	}
+
+	StringBitStream payload;
+	payload.Read(in);
+
+	std::map<std::string, std::pair<int, int> > dc_codes, ac_codes;
+	for (const LegacyCode& c : legacy_dc_codes)
+		dc_codes.emplace(c.code, std::make_pair(c.run, c.category));
+	for (const LegacyCode& c : legacy_ac_codes)
+		ac_codes.emplace(c.code, std::make_pair(c.run, c.category));
+
+	const size_t nbw = (header.width + 7) / 8;
+	const size_t nbh = (header.height + 7) / 8;
+
+	// text payloads take a character per bit, at least 6 bits per channel of a block
+	if (payload.size() < nbw * nbh * 4 * 6)
+		throw std::runtime_error("Invalid code format");
+
+	blocks.assign(nbw * nbh * 256, 0.f);
+
+	vector<int> prev_dc_coef(4, 0);
+
+	for (size_t b = 0; b < nbw * nbh; ++b)
+	{
+		for (size_t c = 0; c < 4; ++c)
+		{
+			float* coefs = &blocks[b * 256 + c * 64];
+
+			int run = 0, value = 0;
+			legacy_symbol(dc_codes, payload, run, value);
+			prev_dc_coef[c] += value;
+			coefs[0] = (float)prev_dc_coef[c];
+
+			for (size_t k = 1; ; )
+			{
+				legacy_symbol(ac_codes, payload, run, value);
+
+				// EOB
+				if (run == 0 && value == 0)
+					break;
+
+				if (k + run >= 64)
+					throw std::runtime_error("Invalid run length");
+
+				k += run;
+
+				// ZRL carries no value
+				if (run == 16)
+					continue;
+
+				coefs[k++] = (float)value;
+
+				if (k == 64)
+				{
+					// a full block is still closed by EOB
+					legacy_symbol(ac_codes, payload, run, value);
+					break;
+				}
+			}
+		}
+	}
+
+	return header;
+}
+
+
+// write_recompressed
+// Quantized blocks => MyJPEG file coded with tables optimized for them
+void write_recompressed(jpeg::container::Header header, const vector<float>& blocks, std::ostream& out)
+{
+	const size_t nblocks = blocks.size() / 256;
+
+	// one DC and one AC table are shared by all channels
+	vector<size_t> dc_freq(256, 0), ac_freq(256, 0);
+
+	{
+		vector<int> prev_dc_coef(4, 0);
+
+		for (size_t b = 0; b < nblocks; ++b)
+			for (size_t c = 0; c < 4; ++c)
+				jpeg::huffman_coding::CountBand(blocks, b, c, 0, 63, prev_dc_coef[c], dc_freq, ac_freq);
+	}
+
+	const jpeg::huffman_coding::HuffmanTable dc_table = jpeg::huffman_coding::OptimalTable(dc_freq);
+	const jpeg::huffman_coding::HuffmanTable ac_table = jpeg::huffman_coding::OptimalTable(ac_freq);
+
+	BinaryBitStream packed;
+
+	{
+		vector<int> prev_dc_coef(4, 0);
+
+		for (size_t b = 0; b < nblocks; ++b)
+			for (size_t c = 0; c < 4; ++c)
+				jpeg::huffman_coding::EncodeBlock(blocks, b, c, prev_dc_coef[c], &packed, dc_table, ac_table);
+	}
+
+	header.format = jpeg::container::PayloadFormat::Binary;
+	header.dc_bits = dc_table.bits;
+	header.dc_values = dc_table.values;
+	header.ac_bits = ac_table.bits;
+	header.ac_values = ac_table.values;
+	header.payload_bits = packed.size();
+
+	jpeg::container::WriteHeader(out, header);
+	packed.Write(out);
+}
+
+
+// recompress_container
+// Decode the payload of a MyJPEG file without dequantizing and code it again
+void recompress_container(std::istream& in, std::ostream& out)
+{
+	jpeg::container::Header header = jpeg::container::ReadHeader(in);
+
+	StringBitStream text;
+	BinaryBitStream binary;
+	BitStream* payload = nullptr;
+
+	switch (header.format)
+	{
+	case jpeg::container::PayloadFormat::Text: payload = &text; break;
+	case jpeg::container::PayloadFormat::Binary: payload = &binary; break;
+	default: throw std::runtime_error("Unsupported payload format");
+	}
+
+	payload->Read(in);
+
+	// blocks of Y, Cb, Cr, A like Canvas::ReadAsJPEG
+	const size_t nbw = (header.width + 7) / 8;
+	const size_t nbh = (header.height + 7) / 8;
+
+	vector<float> blocks(nbw * nbh * 256, 0.f);
+
+	{
+		const jpeg::huffman_coding::HuffmanTable dc_table(header.dc_bits, header.dc_values);
+		const jpeg::huffman_coding::HuffmanTable ac_table(header.ac_bits, header.ac_values);
+
+		vector<int> prev_dc_coef(4, 0);
+
+		for (size_t b = 0; b < nbw * nbh; ++b)
+			for (size_t c = 0; c < 4; ++c)
+				jpeg::huffman_coding::DecodeBlock(blocks, b, c, prev_dc_coef[c], payload, dc_table, ac_table);
+	}
+
+	write_recompressed(header, blocks, out);
+}
+
+
+//
+//
+void RecompressFile(const std::string& src, const std::string& dst)
+{
+	std::stringstream in(std::ios::in | std::ios::out | std::ios::binary);
+
+	{
+		std::fstream fs(src, std::ios::in | std::ios::binary);
+		if (!fs) throw std::runtime_error("File missing");
+
+		in << fs.rdbuf();
+	}
+
+	const std::string original = in.str();
+
+	// MyJPEG files start with their magic, anything else is taken for JFIF
+	uint32_t magic{};
+	for (size_t i = 0; i < 4 && i < original.size(); ++i)
+		magic |= (uint32_t)(uint8_t)original[i] << (8 * i);
+
+	std::stringstream out(std::ios::in | std::ios::out | std::ios::binary);
+
+	// JFIF starts with SOI, text MyJPEG files of older builds with their size in digits
+	const bool jfif = original.size() >= 2 && (uint8_t)original[0] == 0xFF && (uint8_t)original[1] == 0xD8;
+	bool legacy = false;
+
+	if (magic == jpeg::container::MAGIC)
+	{
+		recompress_container(in, out);
+	}
+	else if (jfif)
+	{
+		Coefficients coefs = jpeg::jfif::ReadCoefficients(in);
+		jpeg::jfif::SetOptimalTables(coefs);
+		jpeg::jfif::WriteCoefficients(out, coefs);
+	}
+	else
+	{
+		vector<float> blocks;
+		jpeg::container::Header header = read_legacy(in, blocks);
+		write_recompressed(header, blocks, out);
+		legacy = true;
+	}
+
+	// files already coded tighter than we can (e.g. progressive with EOB runs) are kept as they are
+	// legacy files are always converted, nothing reads them any more
+	const std::string recompressed = out.str();
+	const std::string& best = legacy || recompressed.size() < original.size() ? recompressed : original;
+
+	std::fstream fs(dst, std::ios::out | std::ios::binary);
+	if (!fs) throw std::runtime_error("File missing");
+
+	fs.write(best.data(), best.size());
+}
+}
+}
@@ -0,0 +1,56 @@
+#ifndef TRANSCODE_H
+#define TRANSCODE_H
+
+#ifdef UNIT_TEST_FLAG
+#include "Transcode.cpp"
+#endif
+
+#include <string>
+
+#include "Jfif.h"
+#include "Container.h"
+
+namespace jpeg
+{
+namespace transcode
+{
+// Lossless operations on quantized coefs, no IDCT / DCT round trip
+//
+// Flips move whole blocks, so an edge MCU that is only partly inside the image
+// would end up inside it. Like jpegtran -trim such MCUs are dropped in every
+// flipped direction.
+
+enum class Transform
+{
+	FlipH,      // mirror left-right
+	FlipV,      // mirror top-bottom
+	Transpose,  // across the main diagonal
+	Transverse, // across the anti-diagonal
+	Rotate90,   // clockwise
+	Rotate180,
+	Rotate270,
+};
+
+jpeg::jfif::Coefficients Apply(const jpeg::jfif::Coefficients& src, Transform transform);
+
+// x, y must be on MCU boundaries, w, h are arbitrary
+jpeg::jfif::Coefficients Crop(const jpeg::jfif::Coefficients& src, size_t x, size_t y, size_t w, size_t h);
+
+// Steps of GetQuantTable(quality), luma for the first component and chroma for the others
+// Steps finer than those of the source cannot bring detail back and keep the source step
+jpeg::jfif::Coefficients Requantize(const jpeg::jfif::Coefficients& src, float quality);
+
+// JFIF file => JFIF file, written with the default Huffman tables and no restart markers
+void TransformFile(const std::string& src, const std::string& dst, Transform transform);
+void CropFile(const std::string& src, const std::string& dst, size_t x, size_t y, size_t w, size_t h);
+void RequantizeFile(const std::string& src, const std::string& dst, float quality);
+
+// Entropy-only recompression, every quantized coef is kept so pixels stay identical
+// JFIF files get Huffman tables optimized for their symbols
+// MyJPEG files get optimized tables and a binary payload (text payloads take one byte per bit)
+// Text files of builds before the container header (a "w h quality" line) become container files
+void RecompressFile(const std::string& src, const std::string& dst);
+}
+}
+
+#endif // !TRANSCODE_H
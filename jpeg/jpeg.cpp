@@ -8,6 +8,10 @@
 #include <queue>
 #include <map>
 #include <unordered_map>
+#include <mutex>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
 
 namespace jpeg
 {
@@ -89,6 +93,167 @@ void InverseTransform8x8(vector<float>& block, size_t block_id, size_t channel)
 	for (size_t e = 0; e < 64; ++e)
 		block[offset + e] = copy[e] + 128.f;
 }
+
+
+// AAN (Arai, Agui, Nakajima) output scale factors
+// s(0) = 1, s(k) = cos(k * pi/16) * sqrt(2)
+// Fast transform yields F(u,v) * 8 * s(u) * s(v), which is folded into quantization
+const vector<float> aan_scale8([]() {
+	vector<float> ret(8);
+	for (size_t k = 0; k < 8; ++k)
+		ret[k] = k == 0 ? 1.f : (float)(cos(k * pi() / 16.f) * 2.f * sqrt1_2());
+	return ret;
+}());
+
+
+// aan_fdct8: 1D AAN forward transform of 8 samples with given stride (in place)
+inline void aan_fdct8(float* d, size_t stride)
+{
+	float tmp0 = d[0 * stride] + d[7 * stride];
+	float tmp7 = d[0 * stride] - d[7 * stride];
+	float tmp1 = d[1 * stride] + d[6 * stride];
+	float tmp6 = d[1 * stride] - d[6 * stride];
+	float tmp2 = d[2 * stride] + d[5 * stride];
+	float tmp5 = d[2 * stride] - d[5 * stride];
+	float tmp3 = d[3 * stride] + d[4 * stride];
+	float tmp4 = d[3 * stride] - d[4 * stride];
+
+	// even part
+	float tmp10 = tmp0 + tmp3;
+	float tmp13 = tmp0 - tmp3;
+	float tmp11 = tmp1 + tmp2;
+	float tmp12 = tmp1 - tmp2;
+
+	d[0 * stride] = tmp10 + tmp11;
+	d[4 * stride] = tmp10 - tmp11;
+
+	float z1 = (tmp12 + tmp13) * 0.707106781f;
+	d[2 * stride] = tmp13 + z1;
+	d[6 * stride] = tmp13 - z1;
+
+	// odd part
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+
+	float z5 = (tmp10 - tmp12) * 0.382683433f;
+	float z2 = 0.541196100f * tmp10 + z5;
+	float z4 = 1.306562965f * tmp12 + z5;
+	float z3 = tmp11 * 0.707106781f;
+
+	float z11 = tmp7 + z3;
+	float z13 = tmp7 - z3;
+
+	d[5 * stride] = z13 + z2;
+	d[3 * stride] = z13 - z2;
+	d[1 * stride] = z11 + z4;
+	d[7 * stride] = z11 - z4;
+}
+
+
+// FastForwardTransform8x8
+// Separable AAN DCT, in place, no temporaries
+// Output is NOT normalized: coef(u,v) = F(u,v) * 8 * aan_scale8[u] * aan_scale8[v]
+void FastForwardTransform8x8(vector<float>& block, size_t block_id, size_t channel)
+{
+	size_t offset = block_id * 256 + channel * 64;
+	float* data = block.data() + offset;
+
+	for (size_t e = 0; e < 64; ++e)
+		data[e] -= 128.f;
+
+	for (size_t i = 0; i < 8; ++i)
+		aan_fdct8(data + i * 8, 1);
+
+	for (size_t j = 0; j < 8; ++j)
+		aan_fdct8(data + j, 8);
+}
+
+
+// ScaledForwardTransform8x8
+// Matrix DCT with output scaled like FastForwardTransform8x8, so both quantize with QuantTable::Forward
+// Slower, but free of the rounding of the AAN rotations
+void ScaledForwardTransform8x8(vector<float>& block, size_t block_id, size_t channel)
+{
+	ForwardTransform8x8(block, block_id, channel);
+
+	float* data = block.data() + block_id * 256 + channel * 64;
+
+	for (size_t u = 0; u < 8; ++u)
+		for (size_t v = 0; v < 8; ++v)
+			data[u * 8 + v] *= 8.f * aan_scale8[u] * aan_scale8[v];
+}
+
+
+// aan_idct8: 1D AAN inverse transform of 8 prescaled coefs with given stride (in place)
+inline void aan_idct8(float* d, size_t stride)
+{
+	// even part
+	float tmp0 = d[0 * stride];
+	float tmp1 = d[2 * stride];
+	float tmp2 = d[4 * stride];
+	float tmp3 = d[6 * stride];
+
+	float tmp10 = tmp0 + tmp2;
+	float tmp11 = tmp0 - tmp2;
+	float tmp13 = tmp1 + tmp3;
+	float tmp12 = (tmp1 - tmp3) * 1.414213562f - tmp13;
+
+	tmp0 = tmp10 + tmp13;
+	tmp3 = tmp10 - tmp13;
+	tmp1 = tmp11 + tmp12;
+	tmp2 = tmp11 - tmp12;
+
+	// odd part
+	float tmp4 = d[1 * stride];
+	float tmp5 = d[3 * stride];
+	float tmp6 = d[5 * stride];
+	float tmp7 = d[7 * stride];
+
+	float z13 = tmp6 + tmp5;
+	float z10 = tmp6 - tmp5;
+	float z11 = tmp4 + tmp7;
+	float z12 = tmp4 - tmp7;
+
+	tmp7 = z11 + z13;
+	tmp11 = (z11 - z13) * 1.414213562f;
+
+	float z5 = (z10 + z12) * 1.847759065f;
+	tmp10 = 1.082392200f * z12 - z5;
+	tmp12 = -2.613125930f * z10 + z5;
+
+	tmp6 = tmp12 - tmp7;
+	tmp5 = tmp11 - tmp6;
+	tmp4 = tmp10 + tmp5;
+
+	d[0 * stride] = tmp0 + tmp7;
+	d[7 * stride] = tmp0 - tmp7;
+	d[1 * stride] = tmp1 + tmp6;
+	d[6 * stride] = tmp1 - tmp6;
+	d[2 * stride] = tmp2 + tmp5;
+	d[5 * stride] = tmp2 - tmp5;
+	d[4 * stride] = tmp3 + tmp4;
+	d[3 * stride] = tmp3 - tmp4;
+}
+
+
+// FastInverseTransform8x8
+// Separable AAN IDCT, in place, no temporaries
+// Input must be prescaled: coef(u,v) = F(u,v) * aan_scale8[u] * aan_scale8[v] / 8
+void FastInverseTransform8x8(vector<float>& block, size_t block_id, size_t channel)
+{
+	size_t offset = block_id * 256 + channel * 64;
+	float* data = block.data() + offset;
+
+	for (size_t j = 0; j < 8; ++j)
+		aan_idct8(data + j, 8);
+
+	for (size_t i = 0; i < 8; ++i)
+		aan_idct8(data + i * 8, 1);
+
+	for (size_t e = 0; e < 64; ++e)
+		data[e] += 128.f;
+}
 }
 }
 
@@ -114,6 +279,17 @@ const vector<float> quant_mat8x8_jpeg2000{
 	 72,  92,  95,  98, 112, 100, 103,  99,
 };
 
+const vector<float> quant_mat8x8_chroma{
+	 17,  18,  24,  47,  99,  99,  99,  99,
+	 18,  21,  26,  66,  99,  99,  99,  99,
+	 24,  26,  56,  99,  99,  99,  99,  99,
+	 47,  66,  99,  99,  99,  99,  99,  99,
+	 99,  99,  99,  99,  99,  99,  99,  99,
+	 99,  99,  99,  99,  99,  99,  99,  99,
+	 99,  99,  99,  99,  99,  99,  99,  99,
+	 99,  99,  99,  99,  99,  99,  99,  99,
+};
+
 const vector<int> zigzag_mat8x8{
 	0,
 	1,8,
@@ -212,25 +388,269 @@ void DownSampling420(vector<float>& block, size_t block_id, size_t channel)
 }
 
 
+// QuantTable
+// Scale standard matrices by quality into integer quant steps
+QuantTable::QuantTable(float quality_) : quality(quality_)
+{
+	vector<int> luma(64), chroma(64);
+
+	for (size_t n = 0; n < 64; ++n)
+	{
+		luma[n] = (int)std::round(quant_mat8x8_jpeg2000[n] / quality);
+		chroma[n] = (int)std::round(quant_mat8x8_chroma[n] / quality);
+	}
+
+	build(luma, chroma);
+}
+
+
+// QuantTable
+// Use quant steps as they are (e.g. tables read from file header)
+QuantTable::QuantTable(float quality_, const vector<int>& luma, const vector<int>& chroma) : quality(quality_)
+{
+	if (luma.size() != 64 || chroma.size() != 64)
+		throw std::runtime_error("Invalid quantization table");
+
+	build(luma, chroma);
+}
+
+
+// build
+// Precompute every derived table once so that kernels only multiply
+void QuantTable::build(const vector<int>& luma, const vector<int>& chroma)
+{
+	const vector<int>* steps[2]{ &luma, &chroma };
+
+	for (size_t t = 0; t < 2; ++t)
+	{
+		divisors[t].resize(64);
+		reciprocals[t].resize(64);
+		forward[t].resize(64);
+		inverse[t].resize(64);
+
+		for (size_t n = 0; n < 64; ++n)
+		{
+			const size_t u = n / 8, v = n % 8;
+			const int step = (*steps[t])[n] < 1 ? 1 : (*steps[t])[n] > 255 ? 255 : (*steps[t])[n];
+
+			divisors[t][n] = step;
+			reciprocals[t][n] = 1.f / step;
+			inverse[t][n] = step * dct::aan_scale8[u] * dct::aan_scale8[v] / 8.f;
+		}
+
+		for (size_t e = 0; e < 64; ++e)
+		{
+			const size_t n = zigzag_mat8x8[e];
+			const size_t u = n / 8, v = n % 8;
+			forward[t][e] = reciprocals[t][n] / (dct::aan_scale8[u] * dct::aan_scale8[v] * 8.f);
+		}
+	}
+}
+
+
+bool IsValidQuality(float quality)
+{
+	// false for NaN as well
+	return quality >= MIN_QUALITY && quality <= MAX_QUALITY;
+}
+
+
+// CanonicalQuality
+// quality rounded to 3 significant digits, the key of the table cache
+float CanonicalQuality(float quality)
+{
+	// 100 <= quality * scale < 1000
+	float scale = 1.f;
+	while (quality * scale < 100.f)
+		scale *= 10.f;
+	while (quality * scale >= 1000.f)
+		scale /= 10.f;
+
+	return std::round(quality * scale) / scale;
+}
+
+
+// GetQuantTable
+// Tables are built once per quality and shared afterwards
+// Entries are never dropped, callers keep references to them
+const QuantTable& GetQuantTable(float quality)
+{
+	assert(std::isfinite(quality));
+
+	if (!IsValidQuality(quality))
+		throw std::runtime_error("Invalid quality");
+
+	static std::map<float, std::unique_ptr<QuantTable> > cache;
+	static std::mutex cache_mutex;
+
+	const float key = CanonicalQuality(quality);
+
+	std::lock_guard<std::mutex> lock(cache_mutex);
+
+	auto it = cache.find(key);
+	if (it == cache.end())
+		it = cache.emplace(key, std::unique_ptr<QuantTable>(new QuantTable(key))).first;
+
+	return *it->second;
+}
+
+
 //
 //
-void Quantize(vector<float>& block, size_t block_id, size_t channel, float quality)
+void Quantize(vector<float>& block, size_t block_id, size_t channel, const QuantTable& table)
 {
 	size_t offset = block_id * 256 + channel * 64;
+	const vector<float>& reciprocals = table.reciprocals[QuantTable::Index(channel)];
 
 	for (size_t e = 0; e < 64; ++e)
-		block[offset + e] = std::round(block[offset + e] / quant_mat8x8_jpeg2000[e] * quality);
+		block[offset + e] = std::round(block[offset + e] * reciprocals[e]);
 }
 
 
 //
 //
-void Dequantize(vector<float>& block, size_t block_id, size_t channel, float quality)
+void Dequantize(vector<float>& block, size_t block_id, size_t channel, const QuantTable& table)
 {
 	size_t offset = block_id * 256 + channel * 64;
+	const vector<int>& divisors = table.divisors[QuantTable::Index(channel)];
 
 	for (size_t e = 0; e < 64; ++e)
-		block[offset + e] *= quant_mat8x8_jpeg2000[e] / quality;
+		block[offset + e] *= divisors[e];
+}
+
+
+// DequantizeZigzag
+// Quantized coefs in zigzag order => input of fast IDCT in natural order
+// Coefs are left as they are, so kept coefs can be rendered without copying them first
+void DequantizeZigzag(const vector<float>& coefs, size_t coef_id, vector<float>& block, size_t block_id, size_t channel, const vector<float>& table)
+{
+	const size_t src = coef_id * 256 + channel * 64;
+	const size_t dst = block_id * 256 + channel * 64;
+
+	for (size_t e = 0; e < 64; ++e)
+	{
+		const size_t n = zigzag_mat8x8[e];
+		block[dst + n] = coefs[src + e] * table[n];
+	}
+}
+
+
+// QuantizeZigzag
+// Quantize output of fast DCT with a forward table and reorder in a single pass
+void QuantizeZigzag(vector<float>& block, size_t block_id, size_t channel, const vector<float>& table)
+{
+	size_t offset = block_id * 256 + channel * 64;
+	float copy[64];
+
+	for (size_t e = 0; e < 64; ++e)
+		copy[e] = block[offset + e];
+
+	for (size_t e = 0; e < 64; ++e)
+		block[offset + e] = std::round(copy[zigzag_mat8x8[e]] * table[e]);
+}
+
+
+// TrellisQuantizeZigzag
+// Rate-distortion optimized alternative to QuantizeZigzag
+// AC levels and the last nonzero coef (EOB placement) are chosen to minimize
+// D + lambda * R, where D is the squared error in DCT domain and R the number
+// of bits from Huffman code lengths; lambda is relative to the mean squared AC step
+void TrellisQuantizeZigzag(vector<float>& block, size_t block_id, size_t channel, const QuantTable& table, float lambda)
+{
+	using huffman_coding::BitLength_AC;
+
+	size_t offset = block_id * 256 + channel * 64;
+	const vector<float>& forward = table.Forward(channel);
+	const vector<int>& divisors = table.divisors[QuantTable::Index(channel)];
+
+	// coefs in units of quant steps and squared steps, zigzag order
+	float coef[64], weight[64];
+	float mean{};
+
+	for (size_t e = 0; e < 64; ++e)
+	{
+		const size_t n = zigzag_mat8x8[e];
+		coef[e] = block[offset + n] * forward[e];
+		weight[e] = (float)(divisors[n] * divisors[n]);
+		if (e > 0) mean += weight[e] / 63.f;
+	}
+
+	const float lm = lambda * mean;
+	const huffman_coding::HuffmanTable& ac_table = huffman_coding::DefaultTable_AC();
+	const int zrl_length = BitLength_AC(0x10, 0, ac_table);
+	const int eob_length = BitLength_AC(0, 0, ac_table);
+
+	// zero[i]: distortion of dropping coefs 1..i
+	float zero[64]{};
+	for (size_t i = 1; i < 64; ++i)
+		zero[i] = zero[i - 1] + coef[i] * coef[i] * weight[i];
+
+	// cost[i]: min cost of coefs 1..i given coef i is the last nonzero one
+	// node 0 stands for the DC coef, i.e. no AC coef coded yet
+	const float inf = std::numeric_limits<float>::infinity();
+	float cost[64];
+	int level[64]{}, from[64]{};
+
+	cost[0] = 0.f;
+
+	for (int i = 1; i < 64; ++i)
+	{
+		cost[i] = inf;
+
+		const int l0 = (int)std::round(coef[i]);
+		if (l0 == 0) continue;
+
+		// candidates: rounded level and the one next to it toward zero
+		const int candidates[2]{ l0, l0 - (l0 > 0 ? 1 : -1) };
+
+		for (int l : candidates)
+		{
+			if (l == 0) continue;
+
+			const float d = (coef[i] - l) * (coef[i] - l) * weight[i];
+
+			for (int j = 0; j < i; ++j)
+			{
+				if (cost[j] == inf) continue;
+
+				const int run = i - j - 1;
+				const int rate = (run >> 4) * zrl_length + BitLength_AC(run & 0xF, l, ac_table);
+				const float c = cost[j] + (zero[i - 1] - zero[j]) + d + lm * rate;
+
+				if (c < cost[i])
+				{
+					cost[i] = c;
+					level[i] = l;
+					from[i] = j;
+				}
+			}
+		}
+	}
+
+	// EOB placement: drop everything after the best last coef
+	int last{};
+	float best = zero[63] + lm * eob_length;
+
+	for (int i = 1; i < 64; ++i)
+	{
+		if (cost[i] == inf) continue;
+
+		// no EOB follows a nonzero last coef
+		const float c = cost[i] + (zero[63] - zero[i]) + (i < 63 ? lm * eob_length : 0.f);
+		if (c < best)
+		{
+			best = c;
+			last = i;
+		}
+	}
+
+	for (size_t e = 0; e < 64; ++e)
+		block[offset + e] = 0.f;
+
+	block[offset + 0] = std::round(coef[0]);
+
+	for (int i = last; i > 0; i = from[i])
+		block[offset + i] = (float)level[i];
 }
 
 
@@ -485,12 +905,13 @@ struct AC_t
 
 
 
+// Standard luminance tables (ITU-T T.81 Annex K.3)
 const vector<DC_t> DC_Table{
-//  cat      len    code
-	{0x0,     3,    "010"      ,}, // 0
-	{0x1,     4,    "011"      ,}, // 1
-	{0x2,     5,    "100"      ,}, // 2
-	{0x3,     5,    "00"       ,}, // 3
+//  cat     len    code
+	{0x0,     2,    "00"       ,}, // 0
+	{0x1,     4,    "010"      ,}, // 1
+	{0x2,     5,    "011"      ,}, // 2
+	{0x3,     6,    "100"      ,}, // 3
 	{0x4,     7,    "101"      ,}, // 4
 	{0x5,     8,    "110"      ,}, // 5
 	{0x6,    10,    "1110"     ,}, // 6
@@ -501,41 +922,24 @@ const vector<DC_t> DC_Table{
 	{0xB,    20,    "111111110",}, // B
 };
 
-const unordered_map<string, int> DC_BaseCode{
-	// code       cat
-	{"010"      , 0},
-	{"011"      , 1},
-	{"100"      , 2},
-	{"00"       , 3},
-	{"101"      , 4},
-	{"110"      , 5},
-	{"1110"     , 6},
-	{"11110"    , 7},
-	{"111110"   , 8},
-	{"1111110"  , 9},
-	{"11111110" , 10},
-	{"111111110", 11},
-};
-
-
 const vector<AC_t> AC_Table{
-//	0-run   cat     len    code
+//	0-run   cat    len    code
 	// EOB
 	{0x0,   0x0,     4,    "1010"					,},
 	// 0
-	{0x0,   0x1,     3,    "00"						,},
-	{0x0,   0x2,     4,    "01"						,},
+	{0x0,   0x1,     3,    "00"					,},
+	{0x0,   0x2,     4,    "01"					,},
 	{0x0,   0x3,     6,    "100"					,},
 	{0x0,   0x4,     8,    "1011"					,},
 	{0x0,   0x5,    10,    "11010"					,},
-	{0x0,   0x6,    12,    "111000"					,},
-	{0x0,   0x7,    14,    "1111000"				,},
-	{0x0,   0x8,    18,    "1111110110"				,},
+	{0x0,   0x6,    13,    "1111000"				,},
+	{0x0,   0x7,    15,    "11111000"				,},
+	{0x0,   0x8,    18,    "1111110110"			,},
 	{0x0,   0x9,    25,    "1111111110000010"		,},
 	{0x0,   0xA,    26,    "1111111110000011"		,},
 	// 1
 	{0x1,   0x1,     5,    "1100"					,},
-	{0x1,   0x2,     8,    "111001"					,},
+	{0x1,   0x2,     7,    "11011"					,},
 	{0x1,   0x3,    10,    "1111001"				,},
 	{0x1,   0x4,    13,    "111110110"				,},
 	{0x1,   0x5,    16,    "11111110110"			,},
@@ -545,139 +949,139 @@ const vector<AC_t> AC_Table{
 	{0x1,   0x9,    25,    "1111111110000111"		,},
 	{0x1,   0xA,    26,    "1111111110001000"		,},
 	// 2
-	{0x2,   0x1,     6,    "11011"					,},
-	{0x2,   0x2,    10,    "11111000"				,},
-	{0x2,   0x3,    13,    "1111110111"				,},
-	{0x2,   0x4,    20,    "1111111110001001"		,},
-	{0x2,   0x5,    21,    "1111111110001010"		,},
-	{0x2,   0x6,    22,    "1111111110001011"		,},
-	{0x2,   0x7,    23,    "1111111110001100"		,},
-	{0x2,   0x8,    24,    "1111111110001101"		,},
-	{0x2,   0x9,    25,    "1111111110001110"		,},
-	{0x2,   0xA,    26,    "1111111110001111"		,},
+	{0x2,   0x1,     6,    "11100"					,},
+	{0x2,   0x2,    10,    "11111001"				,},
+	{0x2,   0x3,    13,    "1111110111"			,},
+	{0x2,   0x4,    16,    "111111110100"			,},
+	{0x2,   0x5,    21,    "1111111110001001"		,},
+	{0x2,   0x6,    22,    "1111111110001010"		,},
+	{0x2,   0x7,    23,    "1111111110001011"		,},
+	{0x2,   0x8,    24,    "1111111110001100"		,},
+	{0x2,   0x9,    25,    "1111111110001101"		,},
+	{0x2,   0xA,    26,    "1111111110001110"		,},
 	// 3
-	{0x3,   0x1,     7,    "111010"					,},
+	{0x3,   0x1,     7,    "111010"				,},
 	{0x3,   0x2,    11,    "111110111"				,},
-	{0x3,   0x3,    14,    "11111110111"			,},
-	{0x3,   0x4,    20,    "1111111110010000"		,},
-	{0x3,   0x5,    21,    "1111111110010001"		,},
-	{0x3,   0x6,    22,    "1111111110010010"		,},
-	{0x3,   0x7,    23,    "1111111110010011"		,},
-	{0x3,   0x8,    24,    "1111111110010100"		,},
-	{0x3,   0x9,    25,    "1111111110010101"		,},
-	{0x3,   0xA,    26,    "1111111110010110"		,},
+	{0x3,   0x3,    15,    "111111110101"			,},
+	{0x3,   0x4,    20,    "1111111110001111"		,},
+	{0x3,   0x5,    21,    "1111111110010000"		,},
+	{0x3,   0x6,    22,    "1111111110010001"		,},
+	{0x3,   0x7,    23,    "1111111110010010"		,},
+	{0x3,   0x8,    24,    "1111111110010011"		,},
+	{0x3,   0x9,    25,    "1111111110010100"		,},
+	{0x3,   0xA,    26,    "1111111110010101"		,},
 	// 4
-	{0x4,   0x1,     7,    "111011"					,},
-	{0x4,   0x2,    12,    "1111111000"				,},
-	{0x4,   0x3,    19,    "1111111110010111"		,},
-	{0x4,   0x4,    20,    "1111111110011000"		,},
-	{0x4,   0x5,    21,    "1111111110011001"		,},
-	{0x4,   0x6,    22,    "1111111110011010"		,},
-	{0x4,   0x7,    23,    "1111111110011011"		,},
-	{0x4,   0x8,    24,    "1111111110011100"		,},
-	{0x4,   0x9,    25,    "1111111110011101"		,},
-	{0x4,   0xA,    26,    "1111111110011110"		,},
+	{0x4,   0x1,     7,    "111011"				,},
+	{0x4,   0x2,    12,    "1111111000"			,},
+	{0x4,   0x3,    19,    "1111111110010110"		,},
+	{0x4,   0x4,    20,    "1111111110010111"		,},
+	{0x4,   0x5,    21,    "1111111110011000"		,},
+	{0x4,   0x6,    22,    "1111111110011001"		,},
+	{0x4,   0x7,    23,    "1111111110011010"		,},
+	{0x4,   0x8,    24,    "1111111110011011"		,},
+	{0x4,   0x9,    25,    "1111111110011100"		,},
+	{0x4,   0xA,    26,    "1111111110011101"		,},
 	// 5
 	{0x5,   0x1,     8,    "1111010"				,},
-	{0x5,   0x2,    12,    "1111111001"				,},
-	{0x5,   0x3,    19,    "1111111110011111"		,},
-	{0x5,   0x4,    20,    "1111111110100000"		,},
-	{0x5,   0x5,    21,    "1111111110100001"		,},
-	{0x5,   0x6,    22,    "1111111110100010"		,},
-	{0x5,   0x7,    23,    "1111111110100011"		,},
-	{0x5,   0x8,    24,    "1111111110100100"		,},
-	{0x5,   0x9,    25,    "1111111110100101"		,},
-	{0x5,   0xA,    26,    "1111111110100110"		,},
+	{0x5,   0x2,    13,    "11111110111"			,},
+	{0x5,   0x3,    19,    "1111111110011110"		,},
+	{0x5,   0x4,    20,    "1111111110011111"		,},
+	{0x5,   0x5,    21,    "1111111110100000"		,},
+	{0x5,   0x6,    22,    "1111111110100001"		,},
+	{0x5,   0x7,    23,    "1111111110100010"		,},
+	{0x5,   0x8,    24,    "1111111110100011"		,},
+	{0x5,   0x9,    25,    "1111111110100100"		,},
+	{0x5,   0xA,    26,    "1111111110100101"		,},
 	// 6
 	{0x6,   0x1,     8,    "1111011"				,},
-	{0x6,   0x2,    13,    "11111111000"			,},
-	{0x6,   0x3,    19,    "1111111110100111"		,},
-	{0x6,   0x4,    20,    "1111111110101000"		,},
-	{0x6,   0x5,    21,    "1111111110101001"		,},
-	{0x6,   0x6,    22,    "1111111110101010"		,},
-	{0x6,   0x7,    23,    "1111111110101011"		,},
-	{0x6,   0x8,    24,    "1111111110101100"		,},
-	{0x6,   0x9,    25,    "1111111110101101"		,},
-	{0x6,   0xA,    26,    "1111111110101110"		,},
+	{0x6,   0x2,    14,    "111111110110"			,},
+	{0x6,   0x3,    19,    "1111111110100110"		,},
+	{0x6,   0x4,    20,    "1111111110100111"		,},
+	{0x6,   0x5,    21,    "1111111110101000"		,},
+	{0x6,   0x6,    22,    "1111111110101001"		,},
+	{0x6,   0x7,    23,    "1111111110101010"		,},
+	{0x6,   0x8,    24,    "1111111110101011"		,},
+	{0x6,   0x9,    25,    "1111111110101100"		,},
+	{0x6,   0xA,    26,    "1111111110101101"		,},
 	// 7
-	{0x7,   0x1,     9,    "11111001"				,},
-	{0x7,   0x2,    13,    "11111111001"			,},
-	{0x7,   0x3,    19,    "1111111110101111"		,},
-	{0x7,   0x4,    20,    "1111111110110000"		,},
-	{0x7,   0x5,    21,    "1111111110110001"		,},
-	{0x7,   0x6,    22,    "1111111110110010"		,},
-	{0x7,   0x7,    23,    "1111111110110011"		,},
-	{0x7,   0x8,    24,    "1111111110110100"		,},
-	{0x7,   0x9,    25,    "1111111110110101"		,},
-	{0x7,   0xA,    26,    "1111111110110110"		,},
+	{0x7,   0x1,     9,    "11111010"				,},
+	{0x7,   0x2,    14,    "111111110111"			,},
+	{0x7,   0x3,    19,    "1111111110101110"		,},
+	{0x7,   0x4,    20,    "1111111110101111"		,},
+	{0x7,   0x5,    21,    "1111111110110000"		,},
+	{0x7,   0x6,    22,    "1111111110110001"		,},
+	{0x7,   0x7,    23,    "1111111110110010"		,},
+	{0x7,   0x8,    24,    "1111111110110011"		,},
+	{0x7,   0x9,    25,    "1111111110110100"		,},
+	{0x7,   0xA,    26,    "1111111110110101"		,},
 	// 8
-	{0x8,   0x1,     9,    "11111001"				,},
+	{0x8,   0x1,    10,    "111111000"				,},
 	{0x8,   0x2,    17,    "111111111000000"		,},
-	{0x8,   0x3,    19,    "1111111110110111"		,},
-	{0x8,   0x4,    20,    "1111111110111000"		,},
-	{0x8,   0x5,    21,    "1111111110111001"		,},
-	{0x8,   0x6,    22,    "1111111110111010"		,},
-	{0x8,   0x7,    23,    "1111111110111011"		,},
-	{0x8,   0x8,    24,    "1111111110111100"		,},
-	{0x8,   0x9,    25,    "1111111110111101"		,},
-	{0x8,   0xA,    26,    "1111111110111110"		,},
+	{0x8,   0x3,    19,    "1111111110110110"		,},
+	{0x8,   0x4,    20,    "1111111110110111"		,},
+	{0x8,   0x5,    21,    "1111111110111000"		,},
+	{0x8,   0x6,    22,    "1111111110111001"		,},
+	{0x8,   0x7,    23,    "1111111110111010"		,},
+	{0x8,   0x8,    24,    "1111111110111011"		,},
+	{0x8,   0x9,    25,    "1111111110111100"		,},
+	{0x8,   0xA,    26,    "1111111110111101"		,},
 	// 9
-	{0x9,   0x1,    10,    "111111000"				,},
-	{0x9,   0x2,    18,    "1111111110111111"		,},
-	{0x9,   0x3,    19,    "1111111111000000"		,},
-	{0x9,   0x4,    20,    "1111111111000001"		,},
-	{0x9,   0x5,    21,    "1111111111000010"		,},
-	{0x9,   0x6,    22,    "1111111111000011"		,},
-	{0x9,   0x7,    23,    "1111111111000100"		,},
-	{0x9,   0x8,    24,    "1111111111000101"		,},
-	{0x9,   0x9,    25,    "1111111111000110"		,},
-	{0x9,   0xA,    26,    "1111111111000111"		,},
+	{0x9,   0x1,    10,    "111111001"				,},
+	{0x9,   0x2,    18,    "1111111110111110"		,},
+	{0x9,   0x3,    19,    "1111111110111111"		,},
+	{0x9,   0x4,    20,    "1111111111000000"		,},
+	{0x9,   0x5,    21,    "1111111111000001"		,},
+	{0x9,   0x6,    22,    "1111111111000010"		,},
+	{0x9,   0x7,    23,    "1111111111000011"		,},
+	{0x9,   0x8,    24,    "1111111111000100"		,},
+	{0x9,   0x9,    25,    "1111111111000101"		,},
+	{0x9,   0xA,    26,    "1111111111000110"		,},
 	// A
-	{0xA,   0x1,    10,    "111111001"				,},
-	{0xA,   0x2,    18,    "1111111111001000"		,},
-	{0xA,   0x3,    19,    "1111111111001001"		,},
-	{0xA,   0x4,    20,    "1111111111001010"		,},
-	{0xA,   0x5,    21,    "1111111111001011"		,},
-	{0xA,   0x6,    22,    "1111111111001100"		,},
-	{0xA,   0x7,    23,    "1111111111001101"		,},
-	{0xA,   0x8,    24,    "1111111111001110"		,},
-	{0xA,   0x9,    25,    "1111111111001111"		,},
-	{0xA,   0xA,    26,    "1111111111010000"		,},
+	{0xA,   0x1,    10,    "111111010"				,},
+	{0xA,   0x2,    18,    "1111111111000111"		,},
+	{0xA,   0x3,    19,    "1111111111001000"		,},
+	{0xA,   0x4,    20,    "1111111111001001"		,},
+	{0xA,   0x5,    21,    "1111111111001010"		,},
+	{0xA,   0x6,    22,    "1111111111001011"		,},
+	{0xA,   0x7,    23,    "1111111111001100"		,},
+	{0xA,   0x8,    24,    "1111111111001101"		,},
+	{0xA,   0x9,    25,    "1111111111001110"		,},
+	{0xA,   0xA,    26,    "1111111111001111"		,},
 	// B
-	{0xB,   0x1,    10,    "111111010"				,},
-	{0xB,   0x2,    18,    "1111111111010001"		,},
-	{0xB,   0x3,    19,    "1111111111010010"		,},
-	{0xB,   0x4,    20,    "1111111111010011"		,},
-	{0xB,   0x5,    21,    "1111111111010100"		,},
-	{0xB,   0x6,    22,    "1111111111010101"		,},
-	{0xB,   0x7,    23,    "1111111111010110"		,},
-	{0xB,   0x8,    24,    "1111111111010111"		,},
-	{0xB,   0x9,    25,    "1111111111011000"		,},
-	{0xB,   0xA,    26,    "1111111111011001"		,},
+	{0xB,   0x1,    11,    "1111111001"			,},
+	{0xB,   0x2,    18,    "1111111111010000"		,},
+	{0xB,   0x3,    19,    "1111111111010001"		,},
+	{0xB,   0x4,    20,    "1111111111010010"		,},
+	{0xB,   0x5,    21,    "1111111111010011"		,},
+	{0xB,   0x6,    22,    "1111111111010100"		,},
+	{0xB,   0x7,    23,    "1111111111010101"		,},
+	{0xB,   0x8,    24,    "1111111111010110"		,},
+	{0xB,   0x9,    25,    "1111111111010111"		,},
+	{0xB,   0xA,    26,    "1111111111011000"		,},
 	// C
-	{0xC,   0x1,    11,    "1111111010"				,},
-	{0xC,   0x2,    18,    "1111111111011010"		,},
-	{0xC,   0x3,    19,    "1111111111011011"		,},
-	{0xC,   0x4,    20,    "1111111111011100"		,},
-	{0xC,   0x5,    21,    "1111111111011101"		,},
-	{0xC,   0x6,    22,    "1111111111011110"		,},
-	{0xC,   0x7,    23,    "1111111111011111"		,},
-	{0xC,   0x8,    24,    "1111111111100000"		,},
-	{0xC,   0x9,    25,    "1111111111100001"		,},
-	{0xC,   0xA,    26,    "1111111111100010"		,},
+	{0xC,   0x1,    11,    "1111111010"			,},
+	{0xC,   0x2,    18,    "1111111111011001"		,},
+	{0xC,   0x3,    19,    "1111111111011010"		,},
+	{0xC,   0x4,    20,    "1111111111011011"		,},
+	{0xC,   0x5,    21,    "1111111111011100"		,},
+	{0xC,   0x6,    22,    "1111111111011101"		,},
+	{0xC,   0x7,    23,    "1111111111011110"		,},
+	{0xC,   0x8,    24,    "1111111111011111"		,},
+	{0xC,   0x9,    25,    "1111111111100000"		,},
+	{0xC,   0xA,    26,    "1111111111100001"		,},
 	// D
-	{0xD,   0x1,    12,    "11111111010"			,},
-	{0xD,   0x2,    18,    "1111111111100011"		,},
-	{0xD,   0x3,    19,    "1111111111100100"		,},
-	{0xD,   0x4,    20,    "1111111111100101"		,},
-	{0xD,   0x5,    21,    "1111111111100110"		,},
-	{0xD,   0x6,    22,    "1111111111100111"		,},
-	{0xD,   0x7,    23,    "1111111111101000"		,},
-	{0xD,   0x8,    24,    "1111111111101001"		,},
-	{0xD,   0x9,    25,    "1111111111101010"		,},
-	{0xD,   0xA,    26,    "1111111111101011"		,},
+	{0xD,   0x1,    12,    "11111111000"			,},
+	{0xD,   0x2,    18,    "1111111111100010"		,},
+	{0xD,   0x3,    19,    "1111111111100011"		,},
+	{0xD,   0x4,    20,    "1111111111100100"		,},
+	{0xD,   0x5,    21,    "1111111111100101"		,},
+	{0xD,   0x6,    22,    "1111111111100110"		,},
+	{0xD,   0x7,    23,    "1111111111100111"		,},
+	{0xD,   0x8,    24,    "1111111111101000"		,},
+	{0xD,   0x9,    25,    "1111111111101001"		,},
+	{0xD,   0xA,    26,    "1111111111101010"		,},
 	// E
-	{0xE,   0x1,    13,    "111111110110"			,},
+	{0xE,   0x1,    17,    "1111111111101011"		,},
 	{0xE,   0x2,    18,    "1111111111101100"		,},
 	{0xE,   0x3,    19,    "1111111111101101"		,},
 	{0xE,   0x4,    20,    "1111111111101110"		,},
@@ -698,191 +1102,124 @@ const vector<AC_t> AC_Table{
 	{0xF,   0x8,    24,    "1111111111111100"		,},
 	{0xF,   0x9,    25,    "1111111111111101"		,},
 	{0xF,   0xA,    26,    "1111111111111110"		,},
-	//10
-	{0x10,  0x0,    12,    "111111110111"			,},
+	// ZRL (16 zeros)
+	{0x10,  0x0,    11,    "11111111001"			,},
 };
 
-const unordered_map<string, int> AC_BaseCode{
-	{"1010"					,  0},
-
-	{"00"					,  1},
-	{"01"					,  2},
-	{"100"					,  3},
-	{"1011"					,  4},
-	{"11010"				,  5},
-	{"111000"				,  6},
-	{"1111000"				,  7},
-	{"1111110110"			,  8},
-	{"1111111110000010"		,  9},
-	{"1111111110000011"		, 10},
-
-	{"1100"					, 11},
-	{"111001"				, 12},
-	{"1111001"				, 13},
-	{"111110110"			, 14},
-	{"11111110110"			, 15},
-	{"1111111110000100"		, 16},
-	{"1111111110000101"		, 17},
-	{"1111111110000110"		, 18},
-	{"1111111110000111"		, 19},
-	{"1111111110001000"		, 20},
-
-	{"11011"				, 21},
-	{"11111000"				, 22},
-	{"1111110111"			, 23},
-	{"1111111110001001"		, 24},
-	{"1111111110001010"		, 25},
-	{"1111111110001011"		, 26},
-	{"1111111110001100"		, 27},
-	{"1111111110001101"		, 28},
-	{"1111111110001110"		, 29},
-	{"1111111110001111"		, 30},
-
-	{"111010"				, 31},
-	{"111110111"			, 32},
-	{"11111110111"			, 33},
-	{"1111111110010000"		, 34},
-	{"1111111110010001"		, 35},
-	{"1111111110010010"		, 36},
-	{"1111111110010011"		, 37},
-	{"1111111110010100"		, 38},
-	{"1111111110010101"		, 39},
-	{"1111111110010110"		, 40},
-
-	{"111011"				, 41},
-	{"1111111000"			, 42},
-	{"1111111110010111"		, 43},
-	{"1111111110011000"		, 44},
-	{"1111111110011001"		, 45},
-	{"1111111110011010"		, 46},
-	{"1111111110011011"		, 47},
-	{"1111111110011100"		, 48},
-	{"1111111110011101"		, 49},
-	{"1111111110011110"		, 50},
-
-	{"1111010"				, 51},
-	{"1111111001"			, 52},
-	{"1111111110011111"		, 53},
-	{"1111111110100000"		, 54},
-	{"1111111110100001"		, 55},
-	{"1111111110100010"		, 56},
-	{"1111111110100011"		, 57},
-	{"1111111110100100"		, 58},
-	{"1111111110100101"		, 59},
-	{"1111111110100110"		, 60},
-
-	{"1111011"				, 61},
-	{"11111111000"			, 62},
-	{"1111111110100111"		, 63},
-	{"1111111110101000"		, 64},
-	{"1111111110101001"		, 65},
-	{"1111111110101010"		, 66},
-	{"1111111110101011"		, 67},
-	{"1111111110101100"		, 68},
-	{"1111111110101101"		, 69},
-	{"1111111110101110"		, 70},
-
-	{"11111001"				, 71},
-	{"11111111001"			, 72},
-	{"1111111110101111"		, 73},
-	{"1111111110110000"		, 74},
-	{"1111111110110001"		, 75},
-	{"1111111110110010"		, 76},
-	{"1111111110110011"		, 77},
-	{"1111111110110100"		, 78},
-	{"1111111110110101"		, 79},
-	{"1111111110110110"		, 80},
-
-	{"11111001"				, 81},
-	{"111111111000000"		, 82},
-	{"1111111110110111"		, 83},
-	{"1111111110111000"		, 84},
-	{"1111111110111001"		, 85},
-	{"1111111110111010"		, 86},
-	{"1111111110111011"		, 87},
-	{"1111111110111100"		, 88},
-	{"1111111110111101"		, 89},
-	{"1111111110111110"		, 90},
-
-	{"111111000"			, 91},
-	{"1111111110111111"		, 92},
-	{"1111111111000000"		, 93},
-	{"1111111111000001"		, 94},
-	{"1111111111000010"		, 95},
-	{"1111111111000011"		, 96},
-	{"1111111111000100"		, 97},
-	{"1111111111000101"		, 98},
-	{"1111111111000110"		, 99},
-	{"1111111111000111"		,100},
-
-	{"111111001"			,101},
-	{"1111111111001000"		,102},
-	{"1111111111001001"		,103},
-	{"1111111111001010"		,104},
-	{"1111111111001011"		,105},
-	{"1111111111001100"		,106},
-	{"1111111111001101"		,107},
-	{"1111111111001110"		,108},
-	{"1111111111001111"		,109},
-	{"1111111111010000"		,110},
-
-	{"111111010"			,111},
-	{"1111111111010001"		,112},
-	{"1111111111010010"		,113},
-	{"1111111111010011"		,114},
-	{"1111111111010100"		,115},
-	{"1111111111010101"		,116},
-	{"1111111111010110"		,117},
-	{"1111111111010111"		,118},
-	{"1111111111011000"		,119},
-	{"1111111111011001"		,120},
-
-	{"1111111010"			,121},
-	{"1111111111011010"		,122},
-	{"1111111111011011"		,123},
-	{"1111111111011100"		,124},
-	{"1111111111011101"		,125},
-	{"1111111111011110"		,126},
-	{"1111111111011111"		,127},
-	{"1111111111100000"		,128},
-	{"1111111111100001"		,129},
-	{"1111111111100010"		,130},
-
-	{"11111111010"			,131},
-	{"1111111111100011"		,132},
-	{"1111111111100100"		,133},
-	{"1111111111100101"		,134},
-	{"1111111111100110"		,135},
-	{"1111111111100111"		,136},
-	{"1111111111101000"		,137},
-	{"1111111111101001"		,138},
-	{"1111111111101010"		,139},
-	{"1111111111101011"		,140},
-
-	{"111111110110"			,141},
-	{"1111111111101100"		,142},
-	{"1111111111101101"		,143},
-	{"1111111111101110"		,144},
-	{"1111111111101111"		,145},
-	{"1111111111110000"		,146},
-	{"1111111111110001"		,147},
-	{"1111111111110010"		,148},
-	{"1111111111110011"		,149},
-	{"1111111111110100"		,150},
-
-	{"1111111111110101"		,151},
-	{"1111111111110110"		,152},
-	{"1111111111110111"		,153},
-	{"1111111111111000"		,154},
-	{"1111111111111001"		,155},
-	{"1111111111111010"		,156},
-	{"1111111111111011"		,157},
-	{"1111111111111100"		,158},
-	{"1111111111111101"		,159},
-	{"1111111111111110"		,160},
-
-	{"111111110111"			,161},
-};
+
+
+// HuffmanTable
+// Canonical codes are assigned in order of code length, then order of symbols
+HuffmanTable::HuffmanTable(const vector<int>& bits_, const vector<int>& values_) :
+	bits(bits_), values(values_), codes(256)
+{
+	if (bits.size() != 16)
+		throw std::runtime_error("Invalid Huffman table");
+
+	int code{}, k{};
+
+	for (int l = 1; l <= 16; ++l)
+	{
+		valptr[l] = k;
+		mincode[l] = code;
+
+		for (int i = 0; i < bits[l - 1]; ++i, ++code, ++k)
+		{
+			if (k >= (int)values.size() || values[k] < 0 || values[k] > 0xFF)
+				throw std::runtime_error("Invalid Huffman table");
+
+			string& basecode = codes[values[k]];
+			basecode.assign(l, '0');
+			for (int b = 0; b < l; ++b)
+				if (code & (1 << (l - 1 - b))) basecode[b] = '1';
+		}
+
+		// codes of one length must not exceed its range
+		if (code > (1 << l))
+			throw std::runtime_error("Invalid Huffman table");
+
+		maxcode[l] = bits[l - 1] > 0 ? code - 1 : -1;
+		code <<= 1;
+	}
+
+	if (k != (int)values.size())
+		throw std::runtime_error("Invalid Huffman table");
+}
+
+
+// Decode
+// Read bits until they form a code
+// ret: symbol
+int HuffmanTable::Decode(BitStream* in) const
+{
+	int code{};
+
+	for (int l = 1; l <= 16; ++l)
+	{
+		int bit = in->Pop();
+
+		if (bit == -1)
+			throw std::runtime_error("Invalid code format");
+
+		code = (code << 1) | bit;
+
+		if (code <= maxcode[l])
+			return values[valptr[l] + code - mincode[l]];
+	}
+
+	throw std::runtime_error("Invalid code format");
+}
+
+
+// table_from_entries
+// Collect (code, symbol) pairs of a static table into DHT form
+template <typename T>
+HuffmanTable table_from_entries(const vector<T>& entries, function<int(const T&)> symbol)
+{
+	vector<pair<string, int> > sorted;
+
+	for (const T& entry : entries)
+		sorted.emplace_back(entry.basecode, symbol(entry));
+
+	std::sort(sorted.begin(), sorted.end(), [](const pair<string, int>& a, const pair<string, int>& b) {
+		return a.first.size() != b.first.size() ? a.first.size() < b.first.size() : a.first < b.first;
+	});
+
+	vector<int> bits(16, 0), values;
+
+	for (const auto& p : sorted)
+	{
+		++bits[p.first.size() - 1];
+		values.push_back(p.second);
+	}
+
+	return HuffmanTable(bits, values);
+}
+
+
+//
+//
+const HuffmanTable& DefaultTable_DC()
+{
+	static const HuffmanTable table = table_from_entries<DC_t>(DC_Table, [](const DC_t& e) {
+		return e.category;
+	});
+
+	return table;
+}
+
+
+//
+//
+const HuffmanTable& DefaultTable_AC()
+{
+	// ZRL is stored with run 16 in AC_Table
+	static const HuffmanTable table = table_from_entries<AC_t>(AC_Table, [](const AC_t& e) {
+		return e.run > 0xF ? 0xF0 : (e.run << 4) | e.category;
+	});
+
+	return table;
+}
 
 
 
@@ -922,7 +1259,7 @@ string data2code(int val, int category)
 
 //
 //
-void Encode_DC(int val, BitStream* out)
+void Encode_DC(int val, BitStream* out, const HuffmanTable& table)
 {
 	string code{};
 
@@ -930,7 +1267,10 @@ void Encode_DC(int val, BitStream* out)
 	int category = data2category(val);
 
 	// get basecode
-	code.append(DC_Table[category].basecode);
+	if (table.codes[category].empty())
+		throw std::out_of_range("DC coef out of table");
+
+	code.append(table.codes[category]);
 
 	// get datacode
 	if (category != 0)
@@ -942,14 +1282,14 @@ void Encode_DC(int val, BitStream* out)
 
 //
 //
-void Encode_AC(int run, int val, BitStream* out)
+void Encode_AC(int run, int val, BitStream* out, const HuffmanTable& table)
 {
 	string code{};
 
 	// in case run length exceeds encoding standard
 	if (run > 0xF)
 	{
-		code.append(AC_Table[0xA1].basecode);
+		code.append(table.codes[0xF0]);
 		out->Add(code);
 		return;
 	}
@@ -957,11 +1297,14 @@ void Encode_AC(int run, int val, BitStream* out)
 	// determine category data belongs to
 	int category = data2category(val);
 
-	// if category is 0, nothing to do
-	int id = run * 10 + category;
+	// run length and category form the symbol
+	int symbol = (run << 4) | category;
 
 	// get basecode
-	code.append(AC_Table[id].basecode);
+	if (category > 0xF || table.codes[symbol].empty())
+		throw std::out_of_range("AC coef out of table");
+
+	code.append(table.codes[symbol]);
 
 	// get datacode
 	code.append(data2code(val, category));
@@ -970,6 +1313,29 @@ void Encode_AC(int run, int val, BitStream* out)
 }
 
 
+// BitLength_DC
+// Number of bits Encode_DC spends on a DC difference
+int BitLength_DC(int val, const HuffmanTable& table)
+{
+	int category = data2category(val);
+
+	return (int)table.codes[category].size() + category;
+}
+
+
+// BitLength_AC
+// Number of bits Encode_AC spends on a (run, value) pair
+int BitLength_AC(int run, int val, const HuffmanTable& table)
+{
+	if (run > 0xF)
+		return (int)table.codes[0xF0].size();
+
+	int category = data2category(val);
+
+	return (int)table.codes[(run << 4) | (category & 0xF)].size() + category;
+}
+
+
 // EncodeBlock
 // Encode a data block
 // in:  8x8 block of float data
@@ -980,18 +1346,91 @@ void EncodeBlock(
 	size_t block_id,
 	size_t channel,
 	int& prev,
-	BitStream* out)
+	BitStream* out,
+	const HuffmanTable& dc_table,
+	const HuffmanTable& ac_table)
+{
+	EncodeBand(block, block_id, channel, 0, 63, prev, out, dc_table, ac_table);
+}
+
+
+// EncodeBand
+// Encode coefs ss..se of a data block in zigzag order (spectral selection)
+// DC is coded if the band starts at 0, AC bands end with EOB unless their last coef is nonzero
+void EncodeBand(
+	const vector<float>& block,
+	size_t block_id,
+	size_t channel,
+	size_t ss,
+	size_t se,
+	int& prev,
+	BitStream* out,
+	const HuffmanTable& dc_table,
+	const HuffmanTable& ac_table)
 {
 	size_t offset = block_id * 256 + channel * 64;
 
+	if (ss == 0)
+	{
+		// diff between current DC coef and previous one
+		int diff = (int)block[offset + 0] - prev;
+		prev = (int)block[offset + 0];
+
+		// encode DC component
+		jpeg::huffman_coding::Encode_DC(diff, out, dc_table);
+
+		ss = 1;
+	}
+
+	// encode AC components
+	int run{}, val{};
+	for (size_t i = ss; i <= se; ++i)
+	{
+		val = (int)block[offset + i];
+
+		if (val != 0)
+		{
+			// runs longer than 15 are split by ZRL (16 zeros) codes
+			for (; run > 0xF; run -= 0x10)
+				jpeg::huffman_coding::Encode_AC(0x10, 0, out, ac_table);
+
+			jpeg::huffman_coding::Encode_AC(run, val, out, ac_table);
+			run = 0;
+		}
+		else
+		{
+			++run;
+		}
+	}
+
+	// Attach END of BLOCK code segment, omitted when the last coef is nonzero
+	if (run > 0)
+		jpeg::huffman_coding::Encode_AC(0, 0, out, ac_table);
+}
+
+
+
+// BitLengthBlock
+// Number of bits EncodeBlock spends on a data block, nothing is written
+// in:  8x8 block of quantized coefs in zigzag order
+// in:  previous DC coefficients
+size_t BitLengthBlock(
+	const vector<float>& block,
+	size_t block_id,
+	size_t channel,
+	int& prev,
+	const HuffmanTable& dc_table,
+	const HuffmanTable& ac_table)
+{
+	size_t offset = block_id * 256 + channel * 64;
+	size_t bits{};
+
 	// diff between current DC coef and previous one
 	int diff = (int)block[offset + 0] - prev;
 	prev = (int)block[offset + 0];
 
-	// encode DC component
-	jpeg::huffman_coding::Encode_DC(diff, out);
+	bits += BitLength_DC(diff, dc_table);
 
-	// encode AC components
 	int run{}, val{};
 	for (int i = 1; i < 64; ++i)
 	{
@@ -999,7 +1438,64 @@ void EncodeBlock(
 
 		if (val != 0)
 		{
-			jpeg::huffman_coding::Encode_AC(run, val, out);
+			for (; run > 0xF; run -= 0x10)
+				bits += BitLength_AC(0x10, 0, ac_table);
+
+			bits += BitLength_AC(run, val, ac_table);
+			run = 0;
+		}
+		else
+		{
+			++run;
+		}
+	}
+
+	// END of BLOCK
+	if (run > 0)
+		bits += BitLength_AC(0, 0, ac_table);
+
+	return bits;
+}
+
+
+// CountBand
+// Count the symbols EncodeBand would emit for a band of a block, nothing is written
+// in:  8x8 block of quantized coefs in zigzag order
+// in:  previous DC coefficients
+// out: frequencies of DC and AC symbols, 256 entries each
+void CountBand(
+	const vector<float>& block,
+	size_t block_id,
+	size_t channel,
+	size_t ss,
+	size_t se,
+	int& prev,
+	vector<size_t>& dc_freq,
+	vector<size_t>& ac_freq)
+{
+	size_t offset = block_id * 256 + channel * 64;
+
+	if (ss == 0)
+	{
+		int diff = (int)block[offset + 0] - prev;
+		prev = (int)block[offset + 0];
+
+		++dc_freq[data2category(diff)];
+
+		ss = 1;
+	}
+
+	int run{}, val{};
+	for (size_t i = ss; i <= se; ++i)
+	{
+		val = (int)block[offset + i];
+
+		if (val != 0)
+		{
+			for (; run > 0xF; run -= 0x10)
+				++ac_freq[0xF0];
+
+			++ac_freq[((run << 4) | data2category(val)) & 0xFF];
 			run = 0;
 		}
 		else
@@ -1008,11 +1504,94 @@ void EncodeBlock(
 		}
 	}
 
-	// Attach END of BLOCK code segment
-	jpeg::huffman_coding::Encode_AC(0, 0, out);
+	// END of BLOCK
+	if (run > 0)
+		++ac_freq[0x00];
 }
 
 
+// OptimalTable
+// Code lengths of a Huffman tree over symbol frequencies limited to 16 bits (ITU T.81 K.2)
+// A reserved symbol keeps the all-ones code out of the table
+// in:  frequencies of 256 symbols
+// out: canonical table holding every symbol of nonzero frequency
+HuffmanTable OptimalTable(const vector<size_t>& freq_)
+{
+	if (freq_.size() != 256)
+		throw std::runtime_error("Invalid symbol frequencies");
+
+	vector<size_t> freq(freq_);
+	freq.push_back(1);
+
+	const int n = (int)freq.size();
+	vector<int> codesize(n, 0), others(n, -1);
+
+	// merge the two least frequent trees until one is left, ties prefer the larger symbol
+	for (;;)
+	{
+		int v1 = -1, v2 = -1;
+
+		for (int i = 0; i < n; ++i)
+			if (freq[i] && (v1 < 0 || freq[i] <= freq[v1]))
+				v1 = i;
+
+		for (int i = 0; i < n; ++i)
+			if (freq[i] && i != v1 && (v2 < 0 || freq[i] <= freq[v2]))
+				v2 = i;
+
+		if (v2 < 0)
+			break;
+
+		freq[v1] += freq[v2];
+		freq[v2] = 0;
+
+		for (++codesize[v1]; others[v1] >= 0; ++codesize[v1])
+			v1 = others[v1];
+		others[v1] = v2;
+
+		for (++codesize[v2]; others[v2] >= 0; ++codesize[v2])
+			v2 = others[v2];
+	}
+
+	vector<int> count(33, 0);
+	for (int i = 0; i < n; ++i)
+		if (codesize[i])
+			++count[codesize[i] < 32 ? codesize[i] : 32];
+
+	// move pairs of too long codes up the tree
+	for (int l = 32; l > 16; --l)
+	{
+		while (count[l] > 0)
+		{
+			int j = l - 2;
+			while (count[j] == 0)
+				--j;
+
+			count[l] -= 2;
+			count[l - 1] += 1;
+			count[j + 1] += 2;
+			count[j] -= 1;
+		}
+	}
+
+	// drop the reserved code, it is one of the longest
+	int l = 16;
+	while (l > 0 && count[l] == 0)
+		--l;
+	if (l > 0)
+		count[l] -= 1;
+
+	vector<int> bits(count.begin() + 1, count.begin() + 17), values;
+
+	// symbols sorted by code size, then by value
+	for (int size = 1; size <= 32; ++size)
+		for (int i = 0; i < 256; ++i)
+			if (codesize[i] == size)
+				values.push_back(i);
+
+	return HuffmanTable(bits, values);
+}
+
 
 // code2data
 // Decrypt datacode based on LSBs expression
@@ -1038,147 +1617,199 @@ int code2data(const string& datacode, int category)
 }
 
 
-// scan_code
-// Scan over codes to decrypt data and push forward
-// in:  code (will be deleted visited bits during scanning)
-// in:  AC(1) or DC(0)
-// out: id or pointer to table entity
-// out: datacode of LSBs expression
-int scan_code(BitStream* in, bool AC, string& datacode)
+// read_datacode
+// Read LSBs expression following a basecode
+// in:  number of bits (category)
+// out: datacode
+string read_datacode(BitStream* in, int category)
 {
-	int id{ -1 }, len{ }, bit{};
-	string basecode{};
-	const unordered_map<string, int>& CodeDict = AC ? AC_BaseCode : DC_BaseCode;
-
-	datacode.clear();
+	string datacode(category, '0');
 
-	while (!in->empty())
+	for (int i = 0; i < category; ++i)
 	{
-		bit = in->Pop();
+		int bit = in->Pop();
 
 		if (bit == -1)
-			throw std::exception("Invalid code format");
-
-		basecode.push_back('0' + bit);
-		auto jt = CodeDict.find(basecode);
-
-		// code buffer matches one of basecodes
-		if (jt != CodeDict.end())
-		{
-			id = jt->second;
-
-			if (AC)
-				len = AC_Table[id].category;
-			else
-				len = DC_Table[id].category;
-
-			// read corresponding datacode
-			for (size_t i = 0; i < len; ++i)
-			{
-				bit = in->Pop();
-
-				if (bit == -1)
-					throw std::exception("Invalid code format");
-
-				datacode.push_back('0' + bit);
-			}
+			throw std::runtime_error("Invalid code format");
 
-			break;
-		}
+		datacode[i] = (char)('0' + bit);
 	}
 
-	return id;
+	return datacode;
 }
 
 
 //
 //
-int Decode_DC(BitStream* in)
+int Decode_DC(BitStream* in, const HuffmanTable& table)
 {
-	int val{};
-	string datacode{};
-
-	// scan datacode
-	int id = scan_code(in, false, datacode);
-
-	// code is not well-formatted
-	if (id == -1) throw std::exception("DC coef ill format");
-
 	// get category of data
-	int category = DC_Table[id].category;
+	int category = table.Decode(in);
+
+	if (category > 0xF)
+		throw std::runtime_error("DC coef ill format");
 
 	// if category is 0, return 0 directly
 	if (category == 0) return 0;
 
 	// get data from last significant bits
-	val = code2data(datacode, category);
-
-	return val;
+	return code2data(read_datacode(in, category), category);
 }
 
 
 //
 //
-pair<int,int> Decode_AC(BitStream* in)
+pair<int,int> Decode_AC(BitStream* in, const HuffmanTable& table)
 {
-	int val{};
-	string datacode{};
-
-	// extract datacode and determine category
-	int id = scan_code(in, true, datacode);
+	int symbol = table.Decode(in);
 
-	// code is not well-formatted
-	if (id == -1) throw std::exception("AC coef ill format");
+	// ZRL is reported as a run of 16 without value
+	if (symbol == 0xF0)
+		return { 0x10, 0 };
 
 	// get run length and category of data
-	int run = AC_Table[id].run;
-	int category = AC_Table[id].category;
+	int run = symbol >> 4;
+	int category = symbol & 0xF;
 
-	// get data from last significant bits
-	val = code2data(datacode, category);
+	if (category == 0)
+		return { run, 0 };
 
-	return { run, val };
+	// get data from last significant bits
+	return { run, code2data(read_datacode(in, category), category) };
 }
 
 
-//
-//
-void DecodeBlock(
-	vector<float>& block,
-	size_t block_id,
-	size_t channel,
-	int& prev,
-	BitStream* in)
+// decode_coefs
+// Decode quantized coefs of a block in zigzag order
+// in:  previous DC coefficient
+// out: 64 coefs (unvisited ones are zeroed)
+void decode_coefs(int* coefs, int& prev, BitStream* in, const HuffmanTable& dc_table, const HuffmanTable& ac_table)
 {
-	size_t offset = block_id * 256 + channel * 64;
+	for (int e = 0; e < 64; ++e)
+		coefs[e] = 0;
 
 	// decode DC component
-	int curr = jpeg::huffman_coding::Decode_DC(in) + prev;
+	int curr = jpeg::huffman_coding::Decode_DC(in, dc_table) + prev;
 	prev = curr;
-	block[offset + 0] = (float)curr;
+	coefs[0] = curr;
 
 	// decode AC components
+	// the block ends with EOB or with its last (63rd) AC coef
 	int run{}, val{}, id{ 1 };
 	do
 	{
-		auto p = jpeg::huffman_coding::Decode_AC(in);
+		auto p = jpeg::huffman_coding::Decode_AC(in, ac_table);
 		run = p.first, val = p.second;
 
+		// EOB
+		if (run == 0 && val == 0)
+			break;
+
 		if (id + run >= 64)
+			throw std::out_of_range("Invalid run length");
+
+		id += run;
+
+		// ZRL carries no value
+		if (run == 0x10)
+			continue;
+
+		coefs[id] = val;
+		++id;
+	}
+	while (id < 64);
+}
+
+
+// DecodeBlock
+// Decode a data block into quantized coefs in zigzag order
+void DecodeBlock(
+	vector<float>& block,
+	size_t block_id,
+	size_t channel,
+	int& prev,
+	BitStream* in,
+	const HuffmanTable& dc_table,
+	const HuffmanTable& ac_table)
+{
+	size_t offset = block_id * 256 + channel * 64;
+	int coefs[64];
+
+	decode_coefs(coefs, prev, in, dc_table, ac_table);
+
+	for (size_t e = 0; e < 64; ++e)
+		block[offset + e] = (float)coefs[e];
+}
+
+
+// DecodeBand
+// Decode coefs ss..se of a data block in zigzag order, other coefs are left as they are
+// AC bands may end with EOBn, which also ends the band of the next eobrun blocks
+void DecodeBand(
+	vector<float>& block,
+	size_t block_id,
+	size_t channel,
+	size_t ss,
+	size_t se,
+	int& prev,
+	int& eobrun,
+	BitStream* in,
+	const HuffmanTable& dc_table,
+	const HuffmanTable& ac_table)
+{
+	size_t offset = block_id * 256 + channel * 64;
+
+	if (ss == 0)
+	{
+		prev += jpeg::huffman_coding::Decode_DC(in, dc_table);
+		block[offset + 0] = (float)prev;
+
+		ss = 1;
+	}
+
+	if (ss > se)
+		return;
+
+	if (eobrun > 0)
+	{
+		--eobrun;
+		return;
+	}
+
+	for (size_t id = ss; id <= se; )
+	{
+		auto p = jpeg::huffman_coding::Decode_AC(in, ac_table);
+		int run = p.first, val = p.second;
+
+		// EOBn: this block and the next 2^n - 1 + (n extra bits) blocks end here
+		if (val == 0 && run < 0xF)
+		{
+			int extra{};
+			for (char c : read_datacode(in, run))
+				extra = (extra << 1) | (c - '0');
+
+			eobrun = (1 << run) - 1 + extra;
+			break;
+		}
+
+		// ZRL carries no value
+		if (run == 0x10)
 		{
-			if (run > 0)
+			if (id + run > se + 1)
 				throw std::out_of_range("Invalid run length");
-			else
-				break;
+
+			id += run;
+			continue;
 		}
 
-		for (int i = 0; i < run; ++i, ++id)
-			block[offset + id] = 0.0f;
+		if (id + run > se)
+			throw std::out_of_range("Invalid run length");
+
+		id += run;
 
 		block[offset + id] = (float)val;
 		++id;
 	}
-	while (run != 0 || val != 0);
 }
 }
 }
\ No newline at end of file
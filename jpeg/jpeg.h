@@ -15,6 +15,42 @@ namespace jpeg
 {
 namespace util // 
 {
+// zigzag_mat8x8[e] is the natural (row-major) index of the e-th coefficient in zigzag order
+extern const std::vector<int> zigzag_mat8x8;
+
+// Quantization tables of one quality level
+// [0] luma (Y, alpha), [1] chroma (Cb, Cr)
+struct QuantTable
+{
+	QuantTable(float quality);
+	QuantTable(float quality, const std::vector<int>& luma, const std::vector<int>& chroma);
+
+	static size_t Index(size_t channel) { return channel == 1 || channel == 2 ? 1 : 0; }
+
+	const std::vector<float>& Forward(size_t channel) const { return forward[Index(channel)]; }
+	const std::vector<float>& Inverse(size_t channel) const { return inverse[Index(channel)]; }
+
+	float quality;
+	std::vector<int> divisors[2];      // integer quant steps, natural order
+	std::vector<float> reciprocals[2]; // 1 / quant step, natural order
+	std::vector<float> forward[2];     // reciprocals merged with fast DCT output scales, zigzag order
+	std::vector<float> inverse[2];     // quant steps merged with fast IDCT input scales, natural order
+
+private:
+	void build(const std::vector<int>& luma, const std::vector<int>& chroma);
+};
+
+// Quality levels accepted by GetQuantTable, tables saturate well inside this range
+const float MIN_QUALITY = .01f;
+const float MAX_QUALITY = 100.f;
+
+bool IsValidQuality(float quality);
+
+// Table of quality rounded to 3 significant digits, built once and shared afterwards
+// Rounding bounds the cache to a few thousand tables whatever qualities a long running process is
+// asked for. Throws on qualities out of [MIN_QUALITY, MAX_QUALITY].
+const QuantTable& GetQuantTable(float quality);
+
 void RGB2YCC(std::vector<float>& block, size_t block_id);
 void YCC2RGB(std::vector<float>& block, size_t block_id);
 void UnionChannels(std::vector<float>& block, size_t block_id);
@@ -23,8 +59,11 @@ void ScatterChannels(std::vector<float>& block, size_t block_id);
 void DownSampling422(std::vector<float>& block, size_t block_id, size_t channel);
 void DownSampling420(std::vector<float>& block, size_t block_id, size_t channel);
 
-void Quantize(std::vector<float>& block, size_t block_id, size_t channel, float quality);
-void Dequantize(std::vector<float>& block, size_t block_id, size_t channel, float quality);
+void Quantize(std::vector<float>& block, size_t block_id, size_t channel, const QuantTable& table);
+void Dequantize(std::vector<float>& block, size_t block_id, size_t channel, const QuantTable& table);
+void DequantizeZigzag(const std::vector<float>& coefs, size_t coef_id, std::vector<float>& block, size_t block_id, size_t channel, const std::vector<float>& table);
+void QuantizeZigzag(std::vector<float>& block, size_t block_id, size_t channel, const std::vector<float>& table);
+void TrellisQuantizeZigzag(std::vector<float>& block, size_t block_id, size_t channel, const QuantTable& table, float lambda);
 
 void Zigzag(std::vector<float>& block, size_t block_id, size_t channel);
 void Unzigzag(std::vector<float>& block, size_t block_id, size_t channel);
@@ -39,6 +78,12 @@ namespace dct // decrete cosine transform
 {
 void ForwardTransform8x8(std::vector<float>& block, size_t block_id, size_t channel);
 void InverseTransform8x8(std::vector<float>& block, size_t block_id, size_t channel);
+
+void FastForwardTransform8x8(std::vector<float>& block, size_t block_id, size_t channel);
+void FastInverseTransform8x8(std::vector<float>& block, size_t block_id, size_t channel);
+
+// ForwardTransform8x8 scaled to the output of FastForwardTransform8x8
+void ScaledForwardTransform8x8(std::vector<float>& block, size_t block_id, size_t channel);
 }
 }
 
@@ -88,13 +133,45 @@ namespace jpeg
 {
 namespace huffman_coding
 {
-void Encode_DC(int val, BitStream*);
-void Encode_AC(int run, int val, BitStream*);
-void EncodeBlock(const std::vector<float>&, size_t, size_t, int&, BitStream*);
+// Canonical Huffman table in the form of a DHT segment
+// Symbols: DC => category, AC => (run << 4) | category, EOB = 0x00, ZRL = 0xF0
+struct HuffmanTable
+{
+	HuffmanTable() {}
+	HuffmanTable(const std::vector<int>& bits, const std::vector<int>& values);
+
+	int Decode(BitStream*) const;
+
+	std::vector<int> bits;          // number of codes of length 1..16
+	std::vector<int> values;        // symbols in order of codes
+	std::vector<std::string> codes; // basecode of each symbol, empty if absent
+
+	int mincode[17], maxcode[17], valptr[17];
+};
 
-int Decode_DC(BitStream*);
-std::pair<int, int> Decode_AC(BitStream*);
-void DecodeBlock(std::vector<float>&, size_t, size_t, int&, BitStream*);
+const HuffmanTable& DefaultTable_DC();
+const HuffmanTable& DefaultTable_AC();
+
+void Encode_DC(int val, BitStream*, const HuffmanTable& = DefaultTable_DC());
+void Encode_AC(int run, int val, BitStream*, const HuffmanTable& = DefaultTable_AC());
+int BitLength_DC(int val, const HuffmanTable& = DefaultTable_DC());
+int BitLength_AC(int run, int val, const HuffmanTable& = DefaultTable_AC());
+void EncodeBlock(const std::vector<float>&, size_t, size_t, int&, BitStream*,
+	const HuffmanTable& = DefaultTable_DC(), const HuffmanTable& = DefaultTable_AC());
+void EncodeBand(const std::vector<float>&, size_t, size_t, size_t, size_t, int&, BitStream*,
+	const HuffmanTable& = DefaultTable_DC(), const HuffmanTable& = DefaultTable_AC());
+size_t BitLengthBlock(const std::vector<float>&, size_t, size_t, int&,
+	const HuffmanTable& = DefaultTable_DC(), const HuffmanTable& = DefaultTable_AC());
+void CountBand(const std::vector<float>&, size_t, size_t, size_t, size_t, int&,
+	std::vector<size_t>& dc_freq, std::vector<size_t>& ac_freq);
+HuffmanTable OptimalTable(const std::vector<size_t>& freq);
+
+int Decode_DC(BitStream*, const HuffmanTable& = DefaultTable_DC());
+std::pair<int, int> Decode_AC(BitStream*, const HuffmanTable& = DefaultTable_AC());
+void DecodeBlock(std::vector<float>&, size_t, size_t, int&, BitStream*,
+	const HuffmanTable& = DefaultTable_DC(), const HuffmanTable& = DefaultTable_AC());
+void DecodeBand(std::vector<float>&, size_t, size_t, size_t, size_t, int&, int&, BitStream*,
+	const HuffmanTable& = DefaultTable_DC(), const HuffmanTable& = DefaultTable_AC());
 }
 }
 #endif // !JPEG_H
@@ -38,6 +38,9 @@ int main(int argc, char* argv[])
 	}
 	atexit(SDL_Quit);
 
+	// the viewer shows stage timings of every save and decode
+	SetEngineLog(true);
+
 
 
 	// SDL event handler